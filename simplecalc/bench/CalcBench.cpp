@@ -0,0 +1,541 @@
+// calc-bench measures the throughput of the phases of the calc compiler on
+// synthetic expressions. Every benchmark takes three arguments that control
+// the shape of the generated expression:
+//   depth - levels of nested parentheses,
+//   width - operands per level, so an expression has width^(depth+1) leaves,
+//   vars  - number of variables declared with 'with'.
+// Run with --benchmark_filter=<regex> to select benchmarks.
+#include "Bytecode.h"
+#include "CodeGen.h"
+#include "Incremental.h"
+#include "Interpreter.h"
+#include "JIT.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Sema.h"
+#include "Session.h"
+#include "benchmark/benchmark.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cctype>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// ExprGenerator produces random expressions that pass the semantic checks.
+// Divisions only divide by non-zero literals, so the generated code never
+// traps at run time. With Conditionals, every variable is clamped by a
+// comparison, a conditional or a builtin.
+class ExprGenerator {
+  std::mt19937_64 Rng;
+  unsigned Width;
+  unsigned NumVars;
+  bool Conditionals;
+  std::string Out;
+
+  void number() { Out += std::to_string(Rng() % 100 + 1); }
+
+  void leaf() {
+    if (!NumVars || !(Rng() % 2)) {
+      number();
+      return;
+    }
+    std::string Var = varName(Rng() % NumVars);
+    if (!Conditionals) {
+      Out += Var;
+      return;
+    }
+    std::string Limit = std::to_string(Rng() % 1000);
+    switch (Rng() % 4) {
+    case 0:
+      Out += "min(" + Var + ", " + Limit + ")";
+      break;
+    case 1:
+      Out += "max(" + Var + ", " + Limit + ")";
+      break;
+    case 2:
+      Out += "abs(" + Var + " - " + Limit + ")";
+      break;
+    default:
+      Out += "(" + Var + " < " + Limit + " ? " + Var + " : " + Limit + ")";
+      break;
+    }
+  }
+
+  void expr(unsigned Depth) {
+    static const char Ops[] = {'+', '-', '*', '/'};
+    for (unsigned I = 0; I < Width; ++I) {
+      if (I) {
+        char Op = Ops[Rng() % 4];
+        Out += ' ';
+        Out += Op;
+        Out += ' ';
+        if (Op == '/') {
+          number();
+          continue;
+        }
+      }
+      if (Depth == 0) {
+        leaf();
+      } else {
+        Out += '(';
+        expr(Depth - 1);
+        Out += ')';
+      }
+    }
+  }
+
+public:
+  ExprGenerator(unsigned Width, unsigned NumVars, uint64_t Seed = 42,
+                bool Conditionals = false)
+      : Rng(Seed), Width(Width), NumVars(NumVars), Conditionals(Conditionals) {}
+
+  // Identifiers consist of letters only: va, vb, ..., vz, vba, ...
+  static std::string varName(unsigned I) {
+    std::string Name;
+    do {
+      Name.insert(Name.begin(), char('a' + I % 26));
+      I /= 26;
+    } while (I);
+    return "v" + Name;
+  }
+
+  std::string generate(unsigned Depth) {
+    Out.clear();
+    if (NumVars) {
+      Out += "with ";
+      for (unsigned I = 0; I < NumVars; ++I) {
+        if (I)
+          Out += ", ";
+        Out += varName(I);
+      }
+      Out += ": ";
+    }
+    expr(Depth);
+    return Out;
+  }
+};
+
+std::string generate(const benchmark::State &State, bool Conditionals = false) {
+  return ExprGenerator(State.range(1), State.range(2), 42, Conditionals)
+      .generate(State.range(0));
+}
+
+// Parses and checks an expression, aborting the benchmark on errors.
+AST *parse(benchmark::State &State, llvm::StringRef Input, ASTContext &Ctx) {
+  Lexer Lex(Input);
+  Parser P(Lex, Ctx);
+  AST *Tree = P.parse();
+  if (!Tree || P.hasError() || Sema().semantic(Tree)) {
+    State.SkipWithError("invalid expression");
+    return nullptr;
+  }
+  return Tree;
+}
+
+void BM_Lex(benchmark::State &State) {
+  std::string Input = generate(State);
+  size_t NumTokens = 0;
+  for (auto _ : State) {
+    Lexer Lex(Input);
+    Token Tok;
+    for (Lex.next(Tok); !Tok.is(Token::eoi); Lex.next(Tok))
+      ++NumTokens;
+    benchmark::DoNotOptimize(Tok);
+  }
+  State.SetBytesProcessed(State.iterations() * Input.size());
+  State.counters["tokens"] =
+      benchmark::Counter(NumTokens, benchmark::Counter::kIsRate);
+}
+
+void BM_Parse(benchmark::State &State) {
+  std::string Input = generate(State);
+  size_t NumNodes = 0;
+  for (auto _ : State) {
+    ASTContext Ctx;
+    Lexer Lex(Input);
+    Parser P(Lex, Ctx);
+    benchmark::DoNotOptimize(P.parse());
+    NumNodes += Ctx.getNumNodes();
+  }
+  State.SetBytesProcessed(State.iterations() * Input.size());
+  State.counters["nodes"] =
+      benchmark::Counter(NumNodes, benchmark::Counter::kIsRate);
+}
+
+void BM_Sema(benchmark::State &State) {
+  std::string Input = generate(State);
+  ASTContext Ctx;
+  AST *Tree = parse(State, Input, Ctx);
+  if (!Tree)
+    return;
+  for (auto _ : State)
+    benchmark::DoNotOptimize(Sema().semantic(Tree));
+  State.counters["nodes"] = benchmark::Counter(
+      State.iterations() * Ctx.getNumNodes(), benchmark::Counter::kIsRate);
+}
+
+// Parsing and checking in one pass without an AST, as -verify-only does;
+// compare with BM_Parse and BM_Sema together.
+void BM_Verify(benchmark::State &State) {
+  std::string Input = generate(State);
+  for (auto _ : State) {
+    ASTContext Ctx;
+    Lexer Lex(Input);
+    Parser P(Lex, Ctx);
+    P.verify();
+    if (P.hasError() || P.hasSemanticError()) {
+      State.SkipWithError("invalid expression");
+      return;
+    }
+  }
+  State.SetBytesProcessed(State.iterations() * Input.size());
+}
+
+// The fourth argument is the optimization level.
+void BM_CodeGen(benchmark::State &State) {
+  std::string Input = generate(State);
+  ASTContext Ctx;
+  AST *Tree = parse(State, Input, Ctx);
+  if (!Tree)
+    return;
+  CodeGenOptions Opts;
+  Opts.OptLevel = State.range(3);
+  auto TM = CodeGen::createHostTargetMachine(Opts.OptLevel);
+  if (!TM) {
+    llvm::consumeError(TM.takeError());
+    State.SkipWithError("no target machine");
+    return;
+  }
+  CodeGen CG(Opts, TM->get());
+  for (auto _ : State) {
+    llvm::LLVMContext LLVMCtx;
+    benchmark::DoNotOptimize(CG.generate(Tree, LLVMCtx));
+  }
+  State.counters["nodes"] = benchmark::Counter(
+      State.iterations() * Ctx.getNumNodes(), benchmark::Counter::kIsRate);
+}
+
+// Replaces the number nearest to the middle of Input by Val, the way a
+// keystroke edits a literal of a formula.
+std::string editLiteral(const std::string &Input, unsigned Val) {
+  const char *Digits = "0123456789";
+  size_t Pos = Input.find_first_of(Digits, Input.size() / 2);
+  if (Pos == std::string::npos)
+    Pos = Input.find_last_of(Digits);
+  while (Pos && isdigit(Input[Pos - 1]))
+    --Pos;
+  size_t End = Input.find_first_not_of(Digits, Pos);
+  return Input.substr(0, Pos) + std::to_string(Val) +
+         (End == std::string::npos ? "" : Input.substr(End));
+}
+
+// Compiles an edited formula from scratch, the way 'calc -jit' does.
+void BM_EditFullCompile(benchmark::State &State) {
+  std::string Input = generate(State);
+  auto TM = CodeGen::createHostTargetMachine(0);
+  auto J = CalcJIT::create(0);
+  if (!TM || !J) {
+    llvm::consumeError(TM.takeError());
+    llvm::consumeError(J.takeError());
+    State.SkipWithError("no JIT");
+    return;
+  }
+  CodeGen CG(CodeGenOptions(), TM->get());
+  unsigned Version = 0;
+  for (auto _ : State) {
+    std::string Text = editLiteral(Input, ++Version);
+    ASTContext Ctx;
+    AST *Tree = parse(State, Text, Ctx);
+    if (!Tree)
+      return;
+    auto &JD = llvm::cantFail((*J)->createDylib("v" + std::to_string(Version)));
+    llvm::cantFail((*J)->addModule(JD, CG.generate(Tree)));
+    benchmark::DoNotOptimize(llvm::cantFail((*J)->lookupMain(JD)));
+    llvm::cantFail((*J)->removeDylib(JD));
+  }
+}
+
+// Compiles the same edits with the IncrementalCompiler.
+void BM_EditIncremental(benchmark::State &State) {
+  std::string Input = generate(State);
+  auto TM = CodeGen::createHostTargetMachine(0);
+  auto J = CalcJIT::create(0);
+  if (!TM || !J) {
+    llvm::consumeError(TM.takeError());
+    llvm::consumeError(J.takeError());
+    State.SkipWithError("no JIT");
+    return;
+  }
+  auto JD = (*J)->createDylib("incremental");
+  if (!JD) {
+    llvm::consumeError(JD.takeError());
+    State.SkipWithError("no JIT");
+    return;
+  }
+  IncrementalCompiler Compiler(**J, *JD, CodeGenOptions(), TM->get());
+  unsigned Version = 0;
+  for (auto _ : State) {
+    auto Fn = Compiler.update(editLiteral(Input, ++Version));
+    if (!Fn) {
+      State.SkipWithError(llvm::toString(Fn.takeError()).c_str());
+      return;
+    }
+    benchmark::DoNotOptimize(*Fn);
+  }
+}
+
+// Compiles an expression to an object file the way one run of calc does:
+// everything is set up for this expression alone.
+void BM_CompileOneShot(benchmark::State &State) {
+  std::string Input = generate(State);
+  for (auto _ : State) {
+    auto TM = CodeGen::createHostTargetMachine(0);
+    if (!TM) {
+      State.SkipWithError(llvm::toString(TM.takeError()).c_str());
+      return;
+    }
+    ASTContext Ctx;
+    AST *Tree = parse(State, Input, Ctx);
+    if (!Tree)
+      return;
+    CodeGen CG(CodeGenOptions(), TM->get());
+    if (auto Err = CG.compile(Tree, EmitKind::Object, llvm::nulls())) {
+      State.SkipWithError(llvm::toString(std::move(Err)).c_str());
+      return;
+    }
+  }
+}
+
+// Compiles the same expression through a CalcSession, which shares the setup.
+void BM_CompileSession(benchmark::State &State) {
+  std::string Input = generate(State);
+  auto Session = CalcSession::create();
+  if (!Session) {
+    State.SkipWithError(llvm::toString(Session.takeError()).c_str());
+    return;
+  }
+  for (auto _ : State) {
+    if (auto Err = (*Session)->compile(Input, EmitKind::Object, llvm::nulls())) {
+      State.SkipWithError(llvm::toString(std::move(Err)).c_str());
+      return;
+    }
+  }
+}
+
+// Compiled calc_batch function together with input columns for it. With
+// overflow checks, CheckedFn is set instead of Fn.
+struct BatchSetup {
+  std::unique_ptr<CalcJIT> JIT;
+  CalcJIT::BatchFnTy Fn = nullptr;
+  CalcJIT::CheckedBatchFn<int32_t> CheckedFn = nullptr;
+  std::vector<std::vector<int32_t>> Cols;
+  std::vector<const int32_t *> ColPtrs;
+  std::vector<int32_t> Out;
+  std::vector<uint8_t> Overflows;
+
+  bool init(benchmark::State &State, size_t NumRows, bool Checked = false,
+            bool Conditionals = false) {
+    std::string Input = generate(State, Conditionals);
+    ASTContext Ctx;
+    AST *Tree = parse(State, Input, Ctx);
+    if (!Tree)
+      return false;
+
+    CodeGenOptions Opts;
+    Opts.Batch = true;
+    Opts.Checked = Checked;
+    Opts.OptLevel = 2;
+    auto TM = CodeGen::createHostTargetMachine(Opts.OptLevel);
+    if (!TM)
+      return fail(State, TM.takeError());
+    auto J = CalcJIT::create(Opts.OptLevel);
+    if (!J)
+      return fail(State, J.takeError());
+    JIT = std::move(*J);
+    auto JD = JIT->createDylib("bench");
+    if (!JD)
+      return fail(State, JD.takeError());
+    if (auto Err = JIT->addModule(*JD, CodeGen(Opts, TM->get()).generate(Tree)))
+      return fail(State, std::move(Err));
+    unsigned NumCols;
+    if (Checked) {
+      auto F = JIT->lookupCheckedBatch(*JD, NumCols);
+      if (!F)
+        return fail(State, F.takeError());
+      CheckedFn = *F;
+    } else {
+      auto F = JIT->lookupBatch(*JD, NumCols);
+      if (!F)
+        return fail(State, F.takeError());
+      Fn = *F;
+    }
+
+    std::mt19937 Rng(7);
+    Cols.assign(NumCols, std::vector<int32_t>(NumRows));
+    for (auto &Col : Cols)
+      for (int32_t &V : Col)
+        V = Rng() % 1000;
+    for (auto &Col : Cols)
+      ColPtrs.push_back(Col.data());
+    Out.resize(NumRows);
+    Overflows.resize(NumRows);
+    return true;
+  }
+
+  bool fail(benchmark::State &State, llvm::Error Err) {
+    State.SkipWithError(llvm::toString(std::move(Err)).c_str());
+    return false;
+  }
+};
+
+constexpr size_t NumRows = 4096;
+
+// Evaluates the rows one call at a time, the way scalar code is used.
+void BM_EvalScalar(benchmark::State &State) {
+  BatchSetup Setup;
+  if (!Setup.init(State, NumRows))
+    return;
+  std::vector<const int32_t *> RowPtrs(Setup.ColPtrs.size());
+  for (auto _ : State) {
+    for (size_t Row = 0; Row < NumRows; ++Row) {
+      for (size_t I = 0; I < RowPtrs.size(); ++I)
+        RowPtrs[I] = Setup.ColPtrs[I] + Row;
+      Setup.Fn(RowPtrs.data(), Setup.Out.data() + Row, 1);
+    }
+    benchmark::ClobberMemory();
+  }
+  State.SetItemsProcessed(State.iterations() * NumRows);
+}
+
+// Evaluates all rows with one call to the (vectorized) batch loop.
+void BM_EvalBatch(benchmark::State &State) {
+  BatchSetup Setup;
+  if (!Setup.init(State, NumRows))
+    return;
+  for (auto _ : State) {
+    Setup.Fn(Setup.ColPtrs.data(), Setup.Out.data(), NumRows);
+    benchmark::ClobberMemory();
+  }
+  State.SetItemsProcessed(State.iterations() * NumRows);
+}
+
+// Evaluates all rows with overflow checks, for comparison with BM_EvalBatch.
+void BM_EvalBatchChecked(benchmark::State &State) {
+  BatchSetup Setup;
+  if (!Setup.init(State, NumRows, /*Checked=*/true))
+    return;
+  for (auto _ : State) {
+    Setup.CheckedFn(Setup.ColPtrs.data(), Setup.Out.data(), NumRows,
+                    Setup.Overflows.data());
+    benchmark::ClobberMemory();
+  }
+  State.SetItemsProcessed(State.iterations() * NumRows);
+}
+
+// Evaluates all rows of expressions whose variables are clamped by
+// conditionals and min/max/abs, which compile to selects, so the batch loop
+// is vectorized like that of BM_EvalBatch.
+void BM_EvalBatchSelect(benchmark::State &State) {
+  BatchSetup Setup;
+  if (!Setup.init(State, NumRows, /*Checked=*/false, /*Conditionals=*/true))
+    return;
+  for (auto _ : State) {
+    Setup.Fn(Setup.ColPtrs.data(), Setup.Out.data(), NumRows);
+    benchmark::ClobberMemory();
+  }
+  State.SetItemsProcessed(State.iterations() * NumRows);
+}
+
+// Evaluates the rows one at a time with the AST interpreter, the baseline of
+// BM_EvalBytecode, the first tier of TieredEngine, and of BM_EvalScalar.
+void BM_EvalInterpreted(benchmark::State &State) {
+  std::string Input = generate(State);
+  ASTContext Ctx;
+  AST *Tree = parse(State, Input, Ctx);
+  if (!Tree)
+    return;
+  Interpreter<int32_t> Interp(Tree);
+  unsigned NumVars = State.range(2);
+  std::mt19937 Rng(7);
+  std::vector<int32_t> Rows(NumRows * NumVars);
+  for (int32_t &V : Rows)
+    V = Rng() % 1000;
+  for (auto _ : State)
+    for (size_t Row = 0; Row < NumRows; ++Row)
+      benchmark::DoNotOptimize(Interp.evaluate(Rows.data() + Row * NumVars));
+  State.SetItemsProcessed(State.iterations() * NumRows);
+}
+
+// Evaluates the rows one at a time with the bytecode VM.
+void BM_EvalBytecode(benchmark::State &State) {
+  std::string Input = generate(State);
+  ASTContext Ctx;
+  AST *Tree = parse(State, Input, Ctx);
+  if (!Tree)
+    return;
+  BytecodeBuilder Builder(ValueType::I32);
+  Builder.add("calc_eval", Tree);
+  auto File = BytecodeFile::get(Builder);
+  if (!File) {
+    State.SkipWithError(llvm::toString(File.takeError()).c_str());
+    return;
+  }
+  const bytecode::Function &F = (*File)->functions().front();
+  unsigned NumVars = State.range(2);
+  std::mt19937 Rng(7);
+  std::vector<int32_t> Rows(NumRows * NumVars);
+  for (int32_t &V : Rows)
+    V = Rng() % 1000;
+  std::vector<int32_t> Regs(F.NumRegs);
+  for (auto _ : State)
+    for (size_t Row = 0; Row < NumRows; ++Row)
+      benchmark::DoNotOptimize(F.run(Rows.data() + Row * NumVars, Regs.data()));
+  State.SetItemsProcessed(State.iterations() * NumRows);
+  State.counters["regs"] = F.NumRegs;
+}
+
+// Shapes: a flat chain, a balanced tree and a deep, narrow nesting.
+void Shapes(benchmark::internal::Benchmark *B) {
+  B->ArgNames({"depth", "width", "vars"});
+  B->Args({0, 64, 4})->Args({3, 4, 8})->Args({5, 4, 16})->Args({12, 2, 4});
+}
+
+// Formulas large enough for the latency of an edit to matter.
+void EditShapes(benchmark::internal::Benchmark *B) {
+  B->ArgNames({"depth", "width", "vars"});
+  B->Args({0, 256, 4})->Args({5, 4, 16})->Args({7, 3, 8});
+}
+
+// Small expressions, where the setup of a compilation dominates.
+void SmallShapes(benchmark::internal::Benchmark *B) {
+  B->ArgNames({"depth", "width", "vars"});
+  B->Args({0, 2, 1})->Args({0, 16, 4});
+}
+
+void CodeGenShapes(benchmark::internal::Benchmark *B) {
+  B->ArgNames({"depth", "width", "vars", "O"});
+  for (int OptLevel : {0, 2})
+    B->Args({0, 64, 4, OptLevel})->Args({3, 4, 8, OptLevel})->Args({5, 4, 16, OptLevel});
+}
+
+} // namespace
+
+BENCHMARK(BM_Lex)->Apply(Shapes);
+BENCHMARK(BM_Parse)->Apply(Shapes);
+BENCHMARK(BM_Sema)->Apply(Shapes);
+BENCHMARK(BM_Verify)->Apply(Shapes);
+BENCHMARK(BM_CodeGen)->Apply(CodeGenShapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EditFullCompile)->Apply(EditShapes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_EditIncremental)->Apply(EditShapes)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_CompileOneShot)->Apply(SmallShapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_CompileSession)->Apply(SmallShapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvalInterpreted)->Apply(Shapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvalBytecode)->Apply(Shapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvalScalar)->Apply(Shapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvalBatch)->Apply(Shapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvalBatchChecked)->Apply(Shapes)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_EvalBatchSelect)->Apply(Shapes)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
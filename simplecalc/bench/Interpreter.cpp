@@ -0,0 +1,75 @@
+#include "Interpreter.h"
+#include "Arith.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+using namespace llvm;
+
+template <typename T> Interpreter<T>::Interpreter(AST *Tree) {
+  auto *W = dyn_cast<WithDecl>(Tree);
+  E = W ? W->getExpr() : cast<Expr>(Tree);
+  if (W) {
+    ArrayRef<uint32_t> Syms = W->getSymbols();
+    for (unsigned I = 0; I < Syms.size(); ++I) {
+      if (Syms[I] >= ArgIndex.size())
+        ArgIndex.resize(Syms[I] + 1);
+      ArgIndex[Syms[I]] = I;
+    }
+  }
+
+  // Convert the literals and look for shared nodes once, so evaluations of
+  // trees without any skip the memo table.
+  SmallPtrSet<Expr *, 32> Seen;
+  evaluatePostOrder<bool>(
+      E,
+      [&](Factor *F) {
+        if (F->getKind() == Factor::Number)
+          Numbers.try_emplace(F, arith::getNumber<T>(F->getVal()));
+        return true;
+      },
+      [&](BinaryOp *B, bool, bool) {
+        HasShared |= B->isShared();
+        return true;
+      },
+      [&](SelectOp *S, bool, bool, bool) {
+        HasShared |= S->isShared();
+        return true;
+      },
+      [&](Expr *N, bool &) { return N->isShared() && !Seen.insert(N).second; });
+}
+
+template <typename T> T Interpreter<T>::evaluate(const T *Args) const {
+  DenseMap<Expr *, T> Values;  // The values of the shared subexpressions.
+  return evaluatePostOrder<T>(
+      E,
+      [&](Factor *F) {
+        if (F->getKind() == Factor::Ident)
+          return Args[ArgIndex[F->getSymbol()]];
+        return Numbers.lookup(F);
+      },
+      [&](BinaryOp *B, T L, T R) {
+        T Res = arith::apply(B->getOperator(), L, R);
+        if (HasShared && B->isShared())
+          Values[B] = Res;
+        return Res;
+      },
+      [&](SelectOp *S, T C, T Then, T Else) {
+        T Res = arith::select(C, Then, Else);
+        if (HasShared && S->isShared())
+          Values[S] = Res;
+        return Res;
+      },
+      [&](Expr *N, T &Res) {
+        if (!HasShared || !N->isShared())
+          return false;
+        auto It = Values.find(N);
+        if (It == Values.end())
+          return false;
+        Res = It->second;
+        return true;
+      });
+}
+
+template class Interpreter<int32_t>;
+template class Interpreter<int64_t>;
+template class Interpreter<float>;
+template class Interpreter<double>;
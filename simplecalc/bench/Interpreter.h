@@ -0,0 +1,35 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include "AST.h"
+#include "llvm/ADT/DenseMap.h"
+#include <cstdint>
+#include <vector>
+
+// Interpreter evaluates an expression by walking its AST, without generating
+// any code, so the first evaluation costs no more than the walk itself. It is
+// the baseline BM_EvalInterpreted compares the bytecode VM and the generated
+// code with. T is the C++ type of the value type: int32_t, int64_t, float or
+// double. The results are those of the VM (see Arith.h).
+template <typename T> class Interpreter {
+  Expr *E;
+  std::vector<unsigned> ArgIndex;  // Position of the variables in Args, by symbol ID.
+  llvm::DenseMap<Factor *, T> Numbers;  // The literals, converted once.
+  bool HasShared = false;          // Whether there are subexpressions to memoize.
+
+public:
+  // The tree must stay alive and unchanged while the interpreter is used.
+  explicit Interpreter(AST *Tree);
+
+  // Evaluate the expression. Args holds the values of the 'with' variables in
+  // the order of their declaration. The interpreter is not changed, so
+  // several threads may evaluate at once.
+  T evaluate(const T *Args) const;
+};
+
+extern template class Interpreter<int32_t>;
+extern template class Interpreter<int64_t>;
+extern template class Interpreter<float>;
+extern template class Interpreter<double>;
+
+#endif
@@ -1,45 +1,84 @@
+// An example of the interactive runtime. Programs driven from pipes or files
+// are better served by the bulk runtime in src/BulkRuntime.cpp (-runtime=bulk).
+// Programs that evaluate expressions themselves, possibly from many threads,
+// need no runtime: compile them to calc_eval functions with -eval, or use the
+// C interface in src/CalcAPI.h.
+//
+// Link it with an object file written by 'calc -emit=obj', for any value
+// type (-type=i32, i64, f32 or f64); the generated 'main' calls the functions
+// below. Compile it with -DRTCALC_EXAMPLE_MAIN for a standalone example.
+
 #include <iostream>   // For input/output streams
 #include <string>     // For using std::string
+#include <cstdint>    // For int64_t
 #include <cstdlib>    // For exit()
+#include <stdexcept>  // For the exceptions of std::stoi and friends
+
+namespace {
+
+// Converts the input line to a value of the type T, throwing on invalid input.
+template <typename T> T parse(const std::string &buf);
+template <> int parse<int>(const std::string &buf) { return std::stoi(buf); }
+template <> int64_t parse<int64_t>(const std::string &buf) { return std::stoll(buf); }
+template <> float parse<float>(const std::string &buf) { return std::stof(buf); }
+template <> double parse<double>(const std::string &buf) { return std::stod(buf); }
 
 // Function to write (output) the result of a calculation
-// This function takes an integer value 'v' and prints it to the console.
-void calc_write(int v)
+// This function takes a value 'v' and prints it to the console.
+template <typename T> void write(T v)
 {
     // Output the result using std::cout
     std::cout << "The result is: " << v << std::endl;
 }
 
-// Function to read an integer value from the user input
-// This function takes a string 's' (which is the name of the variable)
+// Function to read a value from the user input
+// This function takes the name 's' of the variable
 // and prompts the user to input a value for it.
-int calc_read(const std::string &s)
+template <typename T> T read(const char *s)
 {
     std::string buf;  // String to store user input
-    int val;          // Variable to store the parsed integer
+    T val;            // Variable to store the parsed value
 
     // Prompt the user to enter a value for the variable represented by 's'.
     std::cout << "Enter a value for " << s << ": ";
-    
+
     // Get a line of input from the user
     std::getline(std::cin, buf);
-    
-    // Try to convert the input string to an integer
+
+    // Try to convert the input string to a value
     try {
-        val = std::stoi(buf);  // Convert string to integer
-    } catch (const std::invalid_argument&) {
-        // If conversion fails (invalid input), print an error message and exit
+        val = parse<T>(buf);  // Convert string to a value
+    } catch (const std::logic_error&) {
+        // If conversion fails (invalid or out-of-range input), print an error message and exit
         std::cerr << "Invalid input: " << buf << std::endl;
         std::exit(1);  // Exit with status 1 indicating error
     }
 
-    // Return the valid parsed integer
+    // Return the valid parsed value
     return val;
 }
 
+} // namespace
+
+// The entry points called by the generated code, one pair per value type.
+// The i32 versions keep their original names (see CodeGen::getRuntimeName).
+extern "C" {
+int calc_read(const char *s) { return read<int>(s); }
+int64_t calc_read_i64(const char *s) { return read<int64_t>(s); }
+float calc_read_f32(const char *s) { return read<float>(s); }
+double calc_read_f64(const char *s) { return read<double>(s); }
+
+void calc_write(int v) { write(v); }
+void calc_write_i64(int64_t v) { write(v); }
+void calc_write_f32(float v) { write(v); }
+void calc_write_f64(double v) { write(v); }
+}
+
+#ifdef RTCALC_EXAMPLE_MAIN
 int main() {
     // Example usage
     int x = calc_read("x");
     calc_write(x + 10);  // Just an example of adding 10 to the input value
     return 0;
 }
+#endif
@@ -1,13 +1,22 @@
 #ifndef AST_H
 #define AST_H
 
+#include "SymbolTable.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
 
 class AST;
 class Expr;
 class Factor;
 class BinaryOp;
+class SelectOp;
 class WithDecl;
 
 class ASTVisitor {
@@ -16,18 +25,41 @@ public:
   virtual void visit(Expr &){};
   virtual void visit(Factor &) = 0;
   virtual void visit(BinaryOp &) = 0;
+  virtual void visit(SelectOp &) = 0;
   virtual void visit(WithDecl &) = 0;
 };
 
 class AST {
 public:
+  // Discriminator for LLVM-style RTTI (isa<>, dyn_cast<>), so passes can
+  // inspect operands without a visitor.
+  enum NodeKind { NK_Factor, NK_BinaryOp, NK_SelectOp, NK_WithDecl };
+
+private:
+  const NodeKind Kind;
+
+public:
+  AST(NodeKind Kind) : Kind(Kind) {}
   virtual ~AST() {}
+  NodeKind getNodeKind() const { return Kind; }
   virtual void accept(ASTVisitor &V) = 0;
 };
 
 class Expr : public AST {
+  bool Shared = false;  // Whether the node is an operand of several nodes.
+
 public:
-  Expr() {}
+  Expr(NodeKind Kind) : AST(Kind) {}
+
+  // Only shared operations are memoized by the passes; all other nodes are
+  // reached once. Factors are never marked.
+  bool isShared() { return Shared; }
+  void setShared() { Shared = true; }
+
+  static bool classof(const AST *N) {
+    return N->getNodeKind() == NK_Factor || N->getNodeKind() == NK_BinaryOp ||
+           N->getNodeKind() == NK_SelectOp;
+  }
 };
 
 class Factor : public Expr {
@@ -36,21 +68,27 @@ public:
 
 private:
   ValueKind Kind;
+  uint32_t Sym;  // For identifiers, the ID of the name in the symbol table.
   llvm::StringRef Val;
 
 public:
-  Factor(ValueKind Kind, llvm::StringRef Val)
-      : Kind(Kind), Val(Val) {}
+  Factor(ValueKind Kind, llvm::StringRef Val, uint32_t Sym = SymbolTable::None)
+      : Expr(NK_Factor), Kind(Kind), Sym(Sym), Val(Val) {}
   ValueKind getKind() { return Kind; }
   llvm::StringRef getVal() { return Val; }
+  uint32_t getSymbol() { return Sym; }
   virtual void accept(ASTVisitor &V) override {
     V.visit(*this);
   }
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_Factor; }
 };
 
 class BinaryOp : public Expr {
 public:
-  enum Operator { Plus, Minus, Mul, Div };
+  // The comparisons yield 1 if they hold and 0 otherwise, in the value type.
+  // Min and Max are the builtins min(a, b) and max(a, b); abs(x) is parsed
+  // as max(x, 0 - x).
+  enum Operator { Plus, Minus, Mul, Div, Lt, Le, Gt, Ge, Eq, Ne, Min, Max };
 
 private:
   Expr *Left;
@@ -59,29 +97,318 @@ private:
 
 public:
   BinaryOp(Operator Op, Expr *L, Expr *R)
-      : Op(Op), Left(L), Right(R) {}
+      : Expr(NK_BinaryOp), Left(L), Right(R), Op(Op) {}
   Expr *getLeft() { return Left; }
   Expr *getRight() { return Right; }
   Operator getOperator() { return Op; }
+
+  static bool isComparison(Operator Op) { return Op >= Lt && Op <= Ne; }
+
+  virtual void accept(ASTVisitor &V) override {
+    V.visit(*this);
+  }
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_BinaryOp; }
+};
+
+// The conditional 'c ? a : b', which is b if c is 0 and a otherwise. Both
+// arms are always evaluated, so it compiles to a select instead of a branch:
+// a division in either arm must be valid, and with overflow checks the
+// operations of both arms count.
+class SelectOp : public Expr {
+  Expr *Cond;
+  Expr *Then;
+  Expr *Else;
+
+public:
+  SelectOp(Expr *Cond, Expr *Then, Expr *Else)
+      : Expr(NK_SelectOp), Cond(Cond), Then(Then), Else(Else) {}
+  Expr *getCond() { return Cond; }
+  Expr *getThen() { return Then; }
+  Expr *getElse() { return Else; }
   virtual void accept(ASTVisitor &V) override {
     V.visit(*this);
   }
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_SelectOp; }
 };
 
 class WithDecl : public AST {
-  using VarVector = llvm::SmallVector<llvm::StringRef, 8>;
+  using VarVector = llvm::ArrayRef<llvm::StringRef>;
   VarVector Vars;
+  llvm::ArrayRef<uint32_t> Syms;  // The symbol IDs of the variables.
   Expr *E;
 
 public:
-  WithDecl(llvm::SmallVector<llvm::StringRef, 8> Vars,
-           Expr *E)
-      : Vars(Vars), E(E) {}
+  WithDecl(VarVector Vars, llvm::ArrayRef<uint32_t> Syms, Expr *E)
+      : AST(NK_WithDecl), Vars(Vars), Syms(Syms), E(E) {}
   VarVector::const_iterator begin() { return Vars.begin(); }
   VarVector::const_iterator end() { return Vars.end(); }
+  VarVector getVars() { return Vars; }
+  llvm::ArrayRef<uint32_t> getSymbols() { return Syms; }
   Expr *getExpr() { return E; }
   virtual void accept(ASTVisitor &V) override {
     V.visit(*this);
   }
+  static bool classof(const AST *N) { return N->getNodeKind() == NK_WithDecl; }
+};
+
+// A named expression of a catalog file, e.g. 'area = with w, h: w * h;'.
+struct CatalogEntry {
+  llvm::StringRef Name;  // The name of the generated function.
+  AST *Tree;             // The expression, a WithDecl or an Expr; null after
+                         // syntax errors in it.
+  llvm::StringRef Source; // The text of the expression, to locate errors in.
+};
+
+// ASTContext owns all AST nodes. They are allocated from a bump allocator and
+// released in one shot when the context is destroyed, without running their
+// destructors. Nodes therefore must not own other memory: arrays such as the
+// variables of a WithDecl are copied into the context as well.
+//
+// By default, the context hash-conses expressions: getFactor, getBinaryOp and
+// getSelectOp return the existing node for a structurally identical
+// expression, so equal subtrees are the same node, also across inputs parsed
+// into the context.
+// The AST is then a DAG, and passes that memoize their results per node
+// handle every common subexpression once.
+class ASTContext {
+  llvm::BumpPtrAllocator Allocator;
+  size_t NumNodes = 0;  // Number of nodes created so far.
+  size_t NumShared = 0; // Number of requests answered with an existing node.
+  SymbolTable Symbols;  // The identifiers used by the nodes.
+
+  // The operator and operands of a BinaryOp, to look it up by.
+  struct BinaryOpKey {
+    BinaryOp::Operator Op;
+    Expr *L, *R;
+  };
+
+  // Hashes BinaryOps by their key. The set holds just the node pointers,
+  // which keeps it small; the key of a stored node is read from the node.
+  struct BinaryOpInfo {
+    static BinaryOp *getEmptyKey() { return llvm::DenseMapInfo<BinaryOp *>::getEmptyKey(); }
+    static BinaryOp *getTombstoneKey() { return llvm::DenseMapInfo<BinaryOp *>::getTombstoneKey(); }
+    static unsigned getHashValue(const BinaryOpKey &K) {
+      uint64_t H = reinterpret_cast<uintptr_t>(K.L) * 0x9E3779B97F4A7C15ull ^
+                   reinterpret_cast<uintptr_t>(K.R) * 0xC2B2AE3D27D4EB4Full ^ K.Op;
+      return unsigned(H ^ (H >> 32));
+    }
+    static unsigned getHashValue(BinaryOp *N) {
+      return getHashValue({N->getOperator(), N->getLeft(), N->getRight()});
+    }
+    static bool isEqual(const BinaryOpKey &K, BinaryOp *N) {
+      return N != getEmptyKey() && N != getTombstoneKey() &&
+             N->getOperator() == K.Op && N->getLeft() == K.L && N->getRight() == K.R;
+    }
+    static bool isEqual(BinaryOp *A, BinaryOp *B) { return A == B; }
+  };
+
+  // Hashes SelectOps by their operands, like BinaryOps.
+  struct SelectOpKey {
+    Expr *C, *T, *E;
+  };
+  struct SelectOpInfo {
+    static SelectOp *getEmptyKey() { return llvm::DenseMapInfo<SelectOp *>::getEmptyKey(); }
+    static SelectOp *getTombstoneKey() { return llvm::DenseMapInfo<SelectOp *>::getTombstoneKey(); }
+    static unsigned getHashValue(const SelectOpKey &K) {
+      uint64_t H = reinterpret_cast<uintptr_t>(K.C) * 0x9E3779B97F4A7C15ull ^
+                   reinterpret_cast<uintptr_t>(K.T) * 0xC2B2AE3D27D4EB4Full ^
+                   reinterpret_cast<uintptr_t>(K.E) * 0x165667B19E3779F9ull;
+      return unsigned(H ^ (H >> 32));
+    }
+    static unsigned getHashValue(SelectOp *N) {
+      return getHashValue({N->getCond(), N->getThen(), N->getElse()});
+    }
+    static bool isEqual(const SelectOpKey &K, SelectOp *N) {
+      return N != getEmptyKey() && N != getTombstoneKey() && N->getCond() == K.C &&
+             N->getThen() == K.T && N->getElse() == K.E;
+    }
+    static bool isEqual(SelectOp *A, SelectOp *B) { return A == B; }
+  };
+
+  // Hashes numbers by their text.
+  struct NumberInfo {
+    static Factor *getEmptyKey() { return llvm::DenseMapInfo<Factor *>::getEmptyKey(); }
+    static Factor *getTombstoneKey() { return llvm::DenseMapInfo<Factor *>::getTombstoneKey(); }
+    static unsigned getHashValue(llvm::StringRef Text) {
+      return llvm::DenseMapInfo<llvm::StringRef>::getHashValue(Text);
+    }
+    static unsigned getHashValue(Factor *N) { return getHashValue(N->getVal()); }
+    static bool isEqual(llvm::StringRef Text, Factor *N) {
+      return N != getEmptyKey() && N != getTombstoneKey() && N->getVal() == Text;
+    }
+    static bool isEqual(Factor *A, Factor *B) { return A == B; }
+  };
+
+  // The unique nodes, if uniquing is enabled.
+  bool Uniquing;
+  std::vector<Factor *> Idents;  // Identifiers, indexed by symbol ID.
+  llvm::DenseSet<Factor *, NumberInfo> Numbers;
+  llvm::DenseSet<BinaryOp *, BinaryOpInfo> BinaryOps;
+  llvm::DenseSet<SelectOp *, SelectOpInfo> SelectOps;
+
+public:
+  ASTContext(bool Uniquing = true) : Uniquing(Uniquing) {}
+  ASTContext(const ASTContext &) = delete;
+  ASTContext &operator=(const ASTContext &) = delete;
+
+  // Allocate a new node of type T in the context.
+  template <typename T, typename... Args> T *create(Args &&...As) {
+    ++NumNodes;
+    return new (Allocator.Allocate<T>()) T(std::forward<Args>(As)...);
+  }
+
+  // Return a Factor or BinaryOp node for the expression. Without uniquing,
+  // this is the same as create(), and the text of a Factor must live as long
+  // as the context. A uniquing context keeps its own copy of the text.
+  Factor *getFactor(Factor::ValueKind Kind, llvm::StringRef Val,
+                    uint32_t Sym = SymbolTable::None);
+  BinaryOp *getBinaryOp(BinaryOp::Operator Op, Expr *L, Expr *R);
+  SelectOp *getSelectOp(Expr *Cond, Expr *Then, Expr *Else);
+
+  bool isUniquing() const { return Uniquing; }
+
+  SymbolTable &getSymbols() { return Symbols; }
+
+  size_t getNumNodes() const { return NumNodes; }
+  size_t getNumShared() const { return NumShared; }
+  size_t getBytesAllocated() const { return Allocator.getBytesAllocated(); }
+
+  // Copy an array into memory owned by the context.
+  template <typename T> llvm::ArrayRef<T> copy(llvm::ArrayRef<T> A) {
+    T *Mem = Allocator.Allocate<T>(A.size());
+    std::uninitialized_copy(A.begin(), A.end(), Mem);
+    return llvm::ArrayRef<T>(Mem, A.size());
+  }
+
+  // Copy a string into memory owned by the context.
+  llvm::StringRef save(llvm::StringRef S) {
+    llvm::ArrayRef<char> A = copy(llvm::ArrayRef<char>(S.data(), S.size()));
+    return llvm::StringRef(A.data(), A.size());
+  }
 };
+
+inline Factor *ASTContext::getFactor(Factor::ValueKind Kind, llvm::StringRef Val,
+                                     uint32_t Sym) {
+  if (!Uniquing)
+    return create<Factor>(Kind, Val, Sym);
+  if (Kind == Factor::Ident) {
+    // Identifiers are unique by their symbol, whose name the table owns.
+    if (Sym >= Idents.size())
+      Idents.resize(Sym + 1);
+    if (!Idents[Sym])
+      Idents[Sym] = create<Factor>(Kind, Symbols.getName(Sym), Sym);
+    else
+      ++NumShared;
+    return Idents[Sym];
+  }
+  auto It = Numbers.find_as(Val);
+  if (It != Numbers.end()) {
+    ++NumShared;
+    return *It;
+  }
+  Factor *Node = create<Factor>(Kind, save(Val), Sym);
+  Numbers.insert(Node);
+  return Node;
+}
+
+inline BinaryOp *ASTContext::getBinaryOp(BinaryOp::Operator Op, Expr *L,
+                                         Expr *R) {
+  if (!Uniquing)
+    return create<BinaryOp>(Op, L, R);
+  BinaryOpKey Key{Op, L, R};
+  auto It = BinaryOps.find_as(Key);
+  if (It != BinaryOps.end()) {
+    ++NumShared;
+    (*It)->setShared();
+    return *It;
+  }
+  BinaryOp *Node = create<BinaryOp>(Op, L, R);
+  BinaryOps.insert(Node);
+  return Node;
+}
+
+inline SelectOp *ASTContext::getSelectOp(Expr *Cond, Expr *Then, Expr *Else) {
+  if (!Uniquing)
+    return create<SelectOp>(Cond, Then, Else);
+  SelectOpKey Key{Cond, Then, Else};
+  auto It = SelectOps.find_as(Key);
+  if (It != SelectOps.end()) {
+    ++NumShared;
+    (*It)->setShared();
+    return *It;
+  }
+  SelectOp *Node = create<SelectOp>(Cond, Then, Else);
+  SelectOps.insert(Node);
+  return Node;
+}
+
+// Computes a value of type T for the expression E bottom-up, with an explicit
+// stack instead of recursion, so deeply nested expressions cannot overflow the
+// call stack. Operands are visited left to right, as a recursive visitor would.
+//
+// Leaf(Factor *) returns the value of a Factor; it is passed nullptr for a
+// missing operand, which only occurs after syntax errors. Binary(BinaryOp *,
+// T L, T R) returns the value of an operation from those of its operands,
+// and Select(SelectOp *, T C, T Then, T Else) that of a conditional. Before
+// the operands of an operation or conditional are visited, Cached(Expr *,
+// T &) may supply its value and return true, e.g. for a shared subexpression
+// handled already.
+template <typename T, typename LeafFn, typename BinaryFn, typename SelectFn,
+          typename CachedFn>
+T evaluatePostOrder(Expr *E, LeafFn Leaf, BinaryFn Binary, SelectFn Select,
+                    CachedFn Cached) {
+  // A pending node: an expression still to visit, or an operation whose
+  // operands' values are on the value stack.
+  struct WorkItem {
+    Expr *E;
+    Expr *Done;
+  };
+  llvm::SmallVector<WorkItem, 32> Work;
+  llvm::SmallVector<T, 32> Values;
+  // Removes the value on top of the value stack and returns it.
+  auto Pop = [&] {
+    T V = std::move(Values.back());
+    Values.pop_back();
+    return V;
+  };
+  Work.push_back({E, nullptr});
+  while (!Work.empty()) {
+    WorkItem Item = Work.pop_back_val();
+    if (auto *B = llvm::dyn_cast_or_null<BinaryOp>(Item.Done)) {
+      // The right operand's value is on top.
+      T R = Pop();
+      T L = Pop();
+      Values.push_back(Binary(B, std::move(L), std::move(R)));
+      continue;
+    }
+    if (auto *S = llvm::dyn_cast_or_null<SelectOp>(Item.Done)) {
+      T Else = Pop();
+      T Then = Pop();
+      T C = Pop();
+      Values.push_back(Select(S, std::move(C), std::move(Then), std::move(Else)));
+      continue;
+    }
+    if (!Item.E || llvm::isa<Factor>(Item.E)) {
+      Values.push_back(Leaf(llvm::cast_or_null<Factor>(Item.E)));
+      continue;
+    }
+    T Res;
+    if (Cached(Item.E, Res)) {
+      Values.push_back(std::move(Res));
+      continue;
+    }
+    Work.push_back({nullptr, Item.E});
+    if (auto *B = llvm::dyn_cast<BinaryOp>(Item.E)) {
+      Work.push_back({B->getRight(), nullptr});
+      Work.push_back({B->getLeft(), nullptr});
+    } else {
+      auto *S = llvm::cast<SelectOp>(Item.E);
+      Work.push_back({S->getElse(), nullptr});
+      Work.push_back({S->getThen(), nullptr});
+      Work.push_back({S->getCond(), nullptr});
+    }
+  }
+  return Values.pop_back_val();
+}
+
 #endif
\ No newline at end of file
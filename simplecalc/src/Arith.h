@@ -0,0 +1,100 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+#include "AST.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <limits>
+#include <type_traits>
+
+// The arithmetic of the calc language on C++ values, for the evaluators that
+// run without generated code: the AST interpreter and the bytecode VM. T is
+// int32_t, int64_t, float or double.
+//
+// Integer arithmetic wraps around, and an integer division by zero, or of
+// the smallest value by -1, is a fatal error. Comparisons yield 1 or 0.
+// Generated code computes the same results only with
+// CodeGenOptions::Wrapping; otherwise its integer overflows and invalid
+// divisions are undefined, unless it is checked for overflow.
+namespace arith {
+
+// The value of a number literal, converted like CodeGen::emitNumber does.
+template <typename T> T getNumber(llvm::StringRef Text) {
+  if (std::is_floating_point<T>::value) {
+    double Val = 0;
+    Text.getAsDouble(Val);
+    return static_cast<T>(Val);
+  }
+  int64_t Val = 0;
+  Text.getAsInteger(10, Val);
+  return static_cast<T>(Val);
+}
+
+// Integers are computed unsigned, so overflows wrap around instead of being
+// undefined.
+template <typename T> T add(T L, T R) {
+  if constexpr (std::is_integral<T>::value)
+    return static_cast<T>(std::make_unsigned_t<T>(L) + std::make_unsigned_t<T>(R));
+  else
+    return L + R;
+}
+
+template <typename T> T sub(T L, T R) {
+  if constexpr (std::is_integral<T>::value)
+    return static_cast<T>(std::make_unsigned_t<T>(L) - std::make_unsigned_t<T>(R));
+  else
+    return L - R;
+}
+
+template <typename T> T mul(T L, T R) {
+  if constexpr (std::is_integral<T>::value)
+    return static_cast<T>(std::make_unsigned_t<T>(L) * std::make_unsigned_t<T>(R));
+  else
+    return L * R;
+}
+
+template <typename T> T div(T L, T R) {
+  if constexpr (std::is_integral<T>::value)
+    if (R == 0 || (L == std::numeric_limits<T>::min() && R == -1))
+      llvm::report_fatal_error("calc: integer division overflow");
+  return L / R;
+}
+
+template <typename T> T apply(BinaryOp::Operator Op, T L, T R) {
+  switch (Op) {
+  case BinaryOp::Plus:
+    return add(L, R);
+  case BinaryOp::Minus:
+    return sub(L, R);
+  case BinaryOp::Mul:
+    return mul(L, R);
+  case BinaryOp::Div:
+    return div(L, R);
+  case BinaryOp::Lt:
+    return L < R;
+  case BinaryOp::Le:
+    return L <= R;
+  case BinaryOp::Gt:
+    return L > R;
+  case BinaryOp::Ge:
+    return L >= R;
+  case BinaryOp::Eq:
+    return L == R;
+  case BinaryOp::Ne:
+    return L != R;
+  case BinaryOp::Min:
+    return L < R ? L : R;
+  case BinaryOp::Max:
+    return L > R ? L : R;
+  }
+  llvm_unreachable("Unknown binary operator");
+}
+
+// The value of 'C ? Then : Else'; both arms have been computed.
+template <typename T> T select(T C, T Then, T Else) {
+  return C != 0 ? Then : Else;
+}
+
+} // namespace arith
+
+#endif
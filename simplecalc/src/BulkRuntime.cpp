@@ -0,0 +1,220 @@
+#include "BulkRuntime.h"
+#include <charconv>  // Non-allocating parsing and printing of values.
+#include <cstdio>    // For the output buffer and error messages.
+#include <cstdlib>   // For exit() and the input buffer.
+#include <cstring>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// The state of the runtime. A program has one input and one output, so it is
+// a global, like the streams of the interactive runtime.
+struct BulkState {
+  const char *Ptr = nullptr;  // The unread part of the input.
+  const char *End = nullptr;
+  void *Mapped = nullptr;     // The mapping of the input file, if any.
+  size_t MappedSize = 0;
+  char *Owned = nullptr;      // The input, if it was read instead.
+  bool Binary = false;
+  bool ReadEmptyRow = false;  // For expressions without variables.
+  unsigned Line = 1;          // The current line of text input.
+  size_t OutLen = 0;
+  char Out[1 << 16];          // Results not yet written.
+} State;
+
+void flushOutput() {
+  std::fwrite(State.Out, 1, State.OutLen, stdout);
+  State.OutLen = 0;
+}
+
+// Report malformed input after the results of the rows before it.
+[[noreturn]] void fail(const char *Msg) {
+  flushOutput();
+  std::fflush(stdout);
+  if (State.Binary)
+    std::fprintf(stderr, "Invalid input: %s\n", Msg);
+  else
+    std::fprintf(stderr, "Invalid input: line %u: %s\n", State.Line, Msg);
+  std::exit(1);
+}
+
+// Read all of the file into a buffer of its own, for pipes and terminals.
+void readAll(std::FILE *File) {
+  size_t Size = 0, Capacity = 1 << 16;
+  State.Owned = static_cast<char *>(std::malloc(Capacity));
+  while (State.Owned) {
+    Size += std::fread(State.Owned + Size, 1, Capacity - Size, File);
+    if (Size < Capacity)
+      break;
+    Capacity *= 2;
+    State.Owned = static_cast<char *>(std::realloc(State.Owned, Capacity));
+  }
+  if (!State.Owned || std::ferror(File)) {
+    std::fprintf(stderr, "Cannot read the input\n");
+    std::exit(1);
+  }
+  State.Ptr = State.Owned;
+  State.End = State.Owned + Size;
+}
+
+// Map the file into memory if it is a regular file. Returns false if it
+// has to be read instead.
+bool mapFile(std::FILE *File) {
+#if defined(_WIN32)
+  (void)File;
+  return false;
+#else
+  int FD = fileno(File);
+  struct stat Stat;
+  if (fstat(FD, &Stat) || !S_ISREG(Stat.st_mode) || lseek(FD, 0, SEEK_CUR) != 0)
+    return false;
+  if (Stat.st_size == 0) {
+    State.Ptr = State.End = "";
+    return true;
+  }
+  void *Addr = mmap(nullptr, Stat.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+  if (Addr == MAP_FAILED)
+    return false;
+  State.Mapped = Addr;
+  State.MappedSize = Stat.st_size;
+  State.Ptr = static_cast<const char *>(Addr);
+  State.End = State.Ptr + Stat.st_size;
+  return true;
+#endif
+}
+
+bool isBlank(char C) { return C == ' ' || C == '\t' || C == '\r'; }
+
+void skipBlanks() {
+  while (State.Ptr != State.End && isBlank(*State.Ptr))
+    ++State.Ptr;
+}
+
+template <typename T> int readRow(T *Vals, int N) {
+  if (N == 0) {
+    bool First = !State.ReadEmptyRow;
+    State.ReadEmptyRow = true;
+    return First;
+  }
+
+  if (State.Binary) {
+    size_t RowSize = N * sizeof(T);
+    if (State.Ptr == State.End)
+      return 0;
+    if (static_cast<size_t>(State.End - State.Ptr) < RowSize)
+      fail("incomplete row at the end of the binary input");
+    std::memcpy(Vals, State.Ptr, RowSize);
+    State.Ptr += RowSize;
+    return 1;
+  }
+
+  // Skip empty lines.
+  for (;;) {
+    skipBlanks();
+    if (State.Ptr == State.End)
+      return 0;
+    if (*State.Ptr != '\n')
+      break;
+    ++State.Ptr;
+    ++State.Line;
+  }
+
+  for (int I = 0; I < N; ++I) {
+    if (I > 0) {
+      skipBlanks();
+      if (State.Ptr != State.End && *State.Ptr == ',') {
+        ++State.Ptr;
+        skipBlanks();
+      }
+    }
+    std::from_chars_result Res = std::from_chars(State.Ptr, State.End, Vals[I]);
+    if (Res.ec != std::errc())
+      fail("expected a value");
+    State.Ptr = Res.ptr;
+  }
+
+  skipBlanks();
+  if (State.Ptr != State.End) {
+    if (*State.Ptr != '\n')
+      fail("too many values in the row");
+    ++State.Ptr;
+  }
+  ++State.Line;
+  return 1;
+}
+
+template <typename T> void writeResult(T Val) {
+  if (sizeof(State.Out) - State.OutLen < 32)
+    flushOutput();
+  char *Buf = State.Out + State.OutLen;
+  if (State.Binary) {
+    std::memcpy(Buf, &Val, sizeof(T));
+    State.OutLen += sizeof(T);
+    return;
+  }
+  // 32 characters hold any integer and the shortest form of any float.
+  std::to_chars_result Res = std::to_chars(Buf, Buf + 31, Val);
+  *Res.ptr = '\n';
+  State.OutLen = Res.ptr + 1 - State.Out;
+}
+
+} // namespace
+
+void calc_bulk_open(int Argc, char **Argv) {
+  const char *Path = nullptr;
+  for (int I = 1; I < Argc; ++I) {
+    if (!std::strcmp(Argv[I], "-binary"))
+      State.Binary = true;
+    else
+      Path = Argv[I];
+  }
+
+  std::FILE *File = stdin;
+  if (Path && std::strcmp(Path, "-")) {
+    File = std::fopen(Path, "rb");
+    if (!File) {
+      std::fprintf(stderr, "Cannot open %s\n", Path);
+      std::exit(1);
+    }
+  }
+#if defined(_WIN32)
+  if (State.Binary) {
+    _setmode(_fileno(File), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+  }
+#endif
+  if (!mapFile(File))
+    readAll(File);
+  if (File != stdin)
+    std::fclose(File);
+}
+
+int calc_read_bulk(int32_t *Vals, int N) { return readRow(Vals, N); }
+int calc_read_bulk_i64(int64_t *Vals, int N) { return readRow(Vals, N); }
+int calc_read_bulk_f32(float *Vals, int N) { return readRow(Vals, N); }
+int calc_read_bulk_f64(double *Vals, int N) { return readRow(Vals, N); }
+
+void calc_write_bulk(int32_t Val) { writeResult(Val); }
+void calc_write_bulk_i64(int64_t Val) { writeResult(Val); }
+void calc_write_bulk_f32(float Val) { writeResult(Val); }
+void calc_write_bulk_f64(double Val) { writeResult(Val); }
+
+int calc_bulk_close() {
+  flushOutput();
+  int Res = std::fflush(stdout) ? 1 : 0;
+#if !defined(_WIN32)
+  if (State.Mapped)
+    munmap(State.Mapped, State.MappedSize);
+#endif
+  std::free(State.Owned);
+  State = BulkState();
+  return Res;
+}
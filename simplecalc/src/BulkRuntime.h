@@ -0,0 +1,47 @@
+#ifndef BULKRUNTIME_H
+#define BULKRUNTIME_H
+
+#include <cstdint>
+
+// The bulk runtime, the non-interactive alternative to calc_read/calc_write
+// selected with -runtime=bulk. The generated 'main' evaluates the expression
+// once per row of an input file:
+//
+//   calc_bulk_open(argc, argv);
+//   while (calc_read_bulk(Vals, NumVars))
+//     calc_write_bulk(<expression over Vals>);
+//   return calc_bulk_close();
+//
+// The program takes the arguments [-binary] [file]. The input file, or stdin
+// if there is none, is mapped into memory (or read in one go if it is not a
+// regular file) and parsed in place. Text input has one row per line, with
+// the values separated by commas or blanks; the results are written one per
+// line. Binary input and output are raw values in the byte order of the host,
+// NumVars values per row.
+//
+// BulkRuntime.cpp does not depend on LLVM, so it can be compiled on its own
+// and linked with object files generated by calc.
+extern "C" {
+
+// Open the input named by the program arguments.
+void calc_bulk_open(int Argc, char **Argv);
+
+// Read the next row of N values into Vals. Returns 0 at the end of the input.
+// An expression without variables reads one empty row. Malformed input is
+// reported and ends the program.
+int calc_read_bulk(int32_t *Vals, int N);
+int calc_read_bulk_i64(int64_t *Vals, int N);
+int calc_read_bulk_f32(float *Vals, int N);
+int calc_read_bulk_f64(double *Vals, int N);
+
+// Append a result to the output buffer.
+void calc_write_bulk(int32_t Val);
+void calc_write_bulk_i64(int64_t Val);
+void calc_write_bulk_f32(float Val);
+void calc_write_bulk_f64(double Val);
+
+// Flush the output and release the input. Returns the exit code of the program.
+int calc_bulk_close();
+}
+
+#endif
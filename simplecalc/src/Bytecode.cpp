@@ -0,0 +1,463 @@
+#include "Bytecode.h"
+#include "Arith.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MathExtras.h"
+#include <cstring>
+#include <map>
+
+using namespace llvm;
+using namespace bytecode;
+
+// Computed goto is a GNU extension, which GCC and Clang support. Other
+// compilers run the VM as a loop around a switch.
+#if defined(__GNUC__)
+#define CALC_THREADED_CODE 1
+#else
+#define CALC_THREADED_CODE 0
+#endif
+
+namespace {
+
+// The layout of a file: the header, the function table, the names, and then
+// the constants and the code of every function. All offsets are from the
+// start of the file, and all values are in the byte order of the host that
+// wrote the file (a file of the other byte order fails the magic check).
+constexpr char Magic[8] = {'C', 'A', 'L', 'C', 'B', 'C', '\r', '\n'};
+constexpr uint32_t FormatVersion = 2;  // 2 added comparisons, min, max and select.
+
+struct FileHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Type;  // The ValueType of all functions.
+  uint32_t NumFunctions;
+  uint32_t NamesSize;
+};
+
+struct FunctionEntry {
+  uint32_t NameOffset;  // From the start of the names.
+  uint32_t NameSize;
+  uint32_t NumArgs;
+  uint32_t NumRegs;
+  uint32_t NumConstants;
+  uint32_t NumInstructions;
+  uint64_t ConstantsOffset;
+  uint64_t CodeOffset;
+};
+
+static_assert(sizeof(FileHeader) % 8 == 0 && sizeof(FunctionEntry) % 8 == 0,
+              "the sections of a file are 8-byte aligned");
+static_assert(sizeof(Instruction) == 16, "instructions are packed");
+
+// The value of a number literal, stored in a constant slot.
+uint64_t getConstantSlot(ValueType Ty, StringRef Text) {
+  uint64_t Slot = 0;
+  auto Store = [&](auto Val) { std::memcpy(&Slot, &Val, sizeof(Val)); };
+  switch (Ty) {
+  case ValueType::I32:
+    Store(arith::getNumber<int32_t>(Text));
+    break;
+  case ValueType::I64:
+    Store(arith::getNumber<int64_t>(Text));
+    break;
+  case ValueType::F32:
+    Store(arith::getNumber<float>(Text));
+    break;
+  case ValueType::F64:
+    Store(arith::getNumber<double>(Text));
+    break;
+  }
+  return Slot;
+}
+
+Opcode getOpcode(BinaryOp::Operator Op) {
+  switch (Op) {
+  case BinaryOp::Plus:
+    return Add;
+  case BinaryOp::Minus:
+    return Sub;
+  case BinaryOp::Mul:
+    return Mul;
+  case BinaryOp::Div:
+    return Div;
+  case BinaryOp::Lt:
+    return Lt;
+  case BinaryOp::Le:
+    return Le;
+  case BinaryOp::Gt:
+    return Gt;
+  case BinaryOp::Ge:
+    return Ge;
+  case BinaryOp::Eq:
+    return Eq;
+  case BinaryOp::Ne:
+    return Ne;
+  case BinaryOp::Min:
+    return Min;
+  case BinaryOp::Max:
+    return Max;
+  }
+  llvm_unreachable("Unknown binary operator");
+}
+
+// Lowers an expression to the bytecode of one function, the sibling of
+// CodeGen's ToIRVisitor. A first walk pools the constants and counts the
+// readers of the shared operations; the second emits the instructions,
+// allocating a temporary for every operation and releasing those of its
+// operands, which it has read last.
+class ToBytecodeVisitor : public ASTVisitor {
+  ValueType Ty;
+  BytecodeBuilder::FunctionCode &Fn;
+  std::vector<uint32_t> ArgRegs;               // The register of each variable, by symbol ID.
+  DenseMap<Factor *, uint32_t> ConstRegs;      // The register of each literal.
+  DenseMap<Expr *, unsigned> NumReaders;       // Readers left of each shared operation.
+  DenseMap<Expr *, uint32_t> Emitted;          // The registers of the shared operations.
+  SmallVector<uint32_t, 16> FreeRegs;          // Temporaries no longer read.
+  uint32_t Reg = 0;                            // The register of the last visited node.
+
+  void prepare(Expr *E) {
+    std::map<uint64_t, uint32_t> Pool;  // Constants by value, in slot order.
+    SmallPtrSet<Expr *, 32> Seen;
+    auto CountReader = [&](Expr *Operand) {
+      if (Operand->isShared())
+        ++NumReaders[Operand];
+    };
+    evaluatePostOrder<bool>(
+        E,
+        [&](Factor *F) {
+          if (F->getKind() == Factor::Number && !ConstRegs.count(F)) {
+            uint64_t Slot = getConstantSlot(Ty, F->getVal());
+            auto It = Pool.try_emplace(Slot, Fn.Constants.size()).first;
+            if (It->second == Fn.Constants.size())
+              Fn.Constants.push_back(Slot);
+            ConstRegs[F] = Fn.NumArgs + It->second;
+          }
+          return true;
+        },
+        [&](BinaryOp *B, bool, bool) {
+          CountReader(B->getLeft());
+          CountReader(B->getRight());
+          return true;
+        },
+        [&](SelectOp *S, bool, bool, bool) {
+          CountReader(S->getCond());
+          CountReader(S->getThen());
+          CountReader(S->getElse());
+          return true;
+        },
+        [&](Expr *N, bool &) { return N->isShared() && !Seen.insert(N).second; });
+    Fn.NumRegs = Fn.NumArgs + Fn.Constants.size();
+  }
+
+  // The operand E in register R has been read by one more operation.
+  void release(Expr *E, uint32_t R) {
+    if (!isa<Factor>(E) && (!E->isShared() || --NumReaders[E] == 0))
+      FreeRegs.push_back(R);
+  }
+
+  uint32_t allocate() {
+    if (!FreeRegs.empty())
+      return FreeRegs.pop_back_val();
+    return Fn.NumRegs++;
+  }
+
+  void emit(Opcode Op, uint32_t Dst, uint32_t LHS, uint32_t RHS) {
+    Instruction I = {};
+    I.Op = Op;
+    I.Dst = Dst;
+    I.LHS = LHS;
+    I.RHS = RHS;
+    Fn.Code.push_back(I);
+  }
+
+public:
+  ToBytecodeVisitor(ValueType Ty, BytecodeBuilder::FunctionCode &Fn) : Ty(Ty), Fn(Fn) {}
+
+  void run(AST *Tree) {
+    auto *W = dyn_cast<WithDecl>(Tree);
+    Fn.NumArgs = W ? W->getVars().size() : 0;
+    prepare(W ? W->getExpr() : cast<Expr>(Tree));
+    Tree->accept(*this);
+    emit(Ret, 0, Reg, 0);
+  }
+
+  virtual void visit(Factor &Node) override {
+    Reg = Node.getKind() == Factor::Ident ? ArgRegs[Node.getSymbol()]
+                                          : ConstRegs.lookup(&Node);
+  }
+
+  // The operations are emitted without recursion, the left operand first.
+  uint32_t emitOperands(Expr *E) {
+    return evaluatePostOrder<uint32_t>(
+        E,
+        [&](Factor *F) {
+          F->accept(*this);
+          return Reg;
+        },
+        [&](BinaryOp *B, uint32_t LHS, uint32_t RHS) {
+          // The operands are read before the result is written, so it may
+          // reuse one of their registers.
+          release(B->getLeft(), LHS);
+          release(B->getRight(), RHS);
+          uint32_t Dst = allocate();
+          emit(getOpcode(B->getOperator()), Dst, LHS, RHS);
+          if (B->isShared())
+            Emitted[B] = Dst;
+          return Dst;
+        },
+        [&](SelectOp *S, uint32_t C, uint32_t Then, uint32_t Else) {
+          release(S->getCond(), C);
+          release(S->getThen(), Then);
+          release(S->getElse(), Else);
+          uint32_t Dst = allocate();
+          emit(Select, Dst, Then, Else);
+          emit(Select, 0, C, 0);  // The slot naming the condition.
+          if (S->isShared())
+            Emitted[S] = Dst;
+          return Dst;
+        },
+        [&](Expr *N, uint32_t &Res) {
+          if (!N->isShared())
+            return false;
+          auto It = Emitted.find(N);
+          if (It == Emitted.end())
+            return false;
+          Res = It->second;
+          return true;
+        });
+  }
+
+  virtual void visit(BinaryOp &Node) override { Reg = emitOperands(&Node); }
+  virtual void visit(SelectOp &Node) override { Reg = emitOperands(&Node); }
+
+  virtual void visit(WithDecl &Node) override {
+    // The arguments are the first registers.
+    ArrayRef<uint32_t> Syms = Node.getSymbols();
+    for (uint32_t I = 0; I < Syms.size(); ++I) {
+      if (Syms[I] >= ArgRegs.size())
+        ArgRegs.resize(Syms[I] + 1);
+      ArgRegs[Syms[I]] = I;
+    }
+    Node.getExpr()->accept(*this);
+  }
+};
+
+Error makeError(const Twine &Msg) {
+  return make_error<StringError>("invalid bytecode file: " + Msg,
+                                 inconvertibleErrorCode());
+}
+
+// Check that the function's code only names its own registers and ends.
+bool verify(const Function &F, uint32_t NumInstructions) {
+  if (NumInstructions == 0 || F.Code[NumInstructions - 1].Op != Ret)
+    return false;
+  for (uint32_t I = 0; I < NumInstructions; ++I) {
+    const Instruction &Insn = F.Code[I];
+    if (Insn.Op > Ret || Insn.LHS >= F.NumRegs ||
+        (Insn.Op != Ret && (Insn.Dst >= F.NumRegs || Insn.RHS >= F.NumRegs)))
+      return false;
+    // A select is followed by the slot naming its condition, before the ret.
+    if (Insn.Op == Select && (++I >= NumInstructions - 1 || F.Code[I].LHS >= F.NumRegs))
+      return false;
+  }
+  return true;
+}
+
+} // namespace
+
+template <typename T> T Function::run(const T *Args, T *Regs) const {
+  std::memcpy(Regs, Args, NumArgs * sizeof(T));
+  for (uint32_t I = 0; I < NumConstants; ++I)
+    std::memcpy(Regs + NumArgs + I, Constants + I, sizeof(T));
+
+  const Instruction *I = Code;
+#if CALC_THREADED_CODE
+  // Every handler jumps straight to the next one.
+  static const void *const Handlers[] = {&&AddOp, &&SubOp, &&MulOp, &&DivOp,
+                                         &&LtOp,  &&LeOp,  &&GtOp,  &&GeOp,
+                                         &&EqOp,  &&NeOp,  &&MinOp, &&MaxOp,
+                                         &&SelectOp, &&RetOp};
+#define VM_CASE(Name) Name##Op:
+#define VM_NEXT goto *Handlers[I->Op]
+  VM_NEXT;
+#else
+#define VM_CASE(Name) case Name:
+#define VM_NEXT continue
+  for (;;) {
+    switch (I->Op) {
+#endif
+  VM_CASE(Add)
+    Regs[I->Dst] = arith::add(Regs[I->LHS], Regs[I->RHS]);
+    ++I;
+    VM_NEXT;
+  VM_CASE(Sub)
+    Regs[I->Dst] = arith::sub(Regs[I->LHS], Regs[I->RHS]);
+    ++I;
+    VM_NEXT;
+  VM_CASE(Mul)
+    Regs[I->Dst] = arith::mul(Regs[I->LHS], Regs[I->RHS]);
+    ++I;
+    VM_NEXT;
+  VM_CASE(Div)
+    Regs[I->Dst] = arith::div(Regs[I->LHS], Regs[I->RHS]);
+    ++I;
+    VM_NEXT;
+#define VM_BINARY(Name)                                                        \
+  VM_CASE(Name)                                                                \
+    Regs[I->Dst] = arith::apply(BinaryOp::Name, Regs[I->LHS], Regs[I->RHS]);   \
+    ++I;                                                                       \
+    VM_NEXT;
+  VM_BINARY(Lt)
+  VM_BINARY(Le)
+  VM_BINARY(Gt)
+  VM_BINARY(Ge)
+  VM_BINARY(Eq)
+  VM_BINARY(Ne)
+  VM_BINARY(Min)
+  VM_BINARY(Max)
+#undef VM_BINARY
+  VM_CASE(Select)
+    Regs[I->Dst] = arith::select(Regs[I[1].LHS], Regs[I->LHS], Regs[I->RHS]);
+    I += 2;
+    VM_NEXT;
+  VM_CASE(Ret)
+    return Regs[I->LHS];
+#if !CALC_THREADED_CODE
+    }
+  }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+template int32_t Function::run(const int32_t *, int32_t *) const;
+template int64_t Function::run(const int64_t *, int64_t *) const;
+template float Function::run(const float *, float *) const;
+template double Function::run(const double *, double *) const;
+
+void BytecodeBuilder::add(StringRef Name, AST *Tree) {
+  Functions.emplace_back();
+  Functions.back().Name = Name.str();
+  ToBytecodeVisitor(Type, Functions.back()).run(Tree);
+}
+
+void BytecodeBuilder::write(raw_ostream &OS) const {
+  FileHeader Header = {};
+  std::memcpy(Header.Magic, Magic, sizeof(Magic));
+  Header.Version = FormatVersion;
+  Header.Type = static_cast<uint32_t>(Type);
+  Header.NumFunctions = Functions.size();
+  std::string Names;
+  for (const FunctionCode &F : Functions)
+    Names += F.Name;
+  Header.NamesSize = Names.size();
+
+  // Lay out the function table.
+  std::vector<FunctionEntry> Entries;
+  uint64_t Offset = sizeof(FileHeader) + Functions.size() * sizeof(FunctionEntry) +
+                    alignTo(Names.size(), 8);
+  uint32_t NameOffset = 0;
+  for (const FunctionCode &F : Functions) {
+    FunctionEntry Entry = {};
+    Entry.NameOffset = NameOffset;
+    Entry.NameSize = F.Name.size();
+    Entry.NumArgs = F.NumArgs;
+    Entry.NumRegs = F.NumRegs;
+    Entry.NumConstants = F.Constants.size();
+    Entry.NumInstructions = F.Code.size();
+    Entry.ConstantsOffset = Offset;
+    Offset += F.Constants.size() * sizeof(uint64_t);
+    Entry.CodeOffset = Offset;
+    Offset += F.Code.size() * sizeof(Instruction);
+    NameOffset += F.Name.size();
+    Entries.push_back(Entry);
+  }
+
+  auto Write = [&](const void *Data, size_t Size) {
+    OS.write(static_cast<const char *>(Data), Size);
+  };
+  Write(&Header, sizeof(Header));
+  Write(Entries.data(), Entries.size() * sizeof(FunctionEntry));
+  OS << Names;
+  OS.write_zeros(alignTo(Names.size(), 8) - Names.size());
+  for (const FunctionCode &F : Functions) {
+    Write(F.Constants.data(), F.Constants.size() * sizeof(uint64_t));
+    Write(F.Code.data(), F.Code.size() * sizeof(Instruction));
+  }
+}
+
+Expected<std::unique_ptr<BytecodeFile>>
+BytecodeFile::load(std::unique_ptr<MemoryBuffer> Buffer) {
+  const char *Start = Buffer->getBufferStart();
+  uint64_t Size = Buffer->getBufferSize();
+  if (reinterpret_cast<uintptr_t>(Start) % 8)
+    return makeError("the buffer is not aligned");
+  FileHeader Header;
+  if (Size < sizeof(Header))
+    return makeError("the file is too short");
+  std::memcpy(&Header, Start, sizeof(Header));
+  if (std::memcmp(Header.Magic, Magic, sizeof(Magic)))
+    return makeError("bad magic number");
+  if (Header.Version != FormatVersion)
+    return makeError("unsupported version " + Twine(Header.Version));
+  if (Header.Type > static_cast<uint32_t>(ValueType::F64))
+    return makeError("unknown value type");
+  uint64_t NamesOffset = sizeof(Header) + uint64_t(Header.NumFunctions) * sizeof(FunctionEntry);
+  if (NamesOffset + Header.NamesSize > Size)
+    return makeError("the function table is truncated");
+
+  std::unique_ptr<BytecodeFile> File(new BytecodeFile(std::move(Buffer)));
+  File->Type = static_cast<ValueType>(Header.Type);
+  auto *Entries = reinterpret_cast<const FunctionEntry *>(Start + sizeof(Header));
+  StringRef Names(Start + NamesOffset, Header.NamesSize);
+  for (uint32_t I = 0; I < Header.NumFunctions; ++I) {
+    const FunctionEntry &Entry = Entries[I];
+    uint64_t NumConstants = Entry.NumConstants;
+    if (uint64_t(Entry.NameOffset) + Entry.NameSize > Names.size() ||
+        Entry.ConstantsOffset % 8 || Entry.ConstantsOffset > Size ||
+        NumConstants * sizeof(uint64_t) > Size - Entry.ConstantsOffset ||
+        Entry.CodeOffset % 8 || Entry.CodeOffset > Size ||
+        uint64_t(Entry.NumInstructions) * sizeof(Instruction) > Size - Entry.CodeOffset ||
+        uint64_t(Entry.NumArgs) + NumConstants > Entry.NumRegs)
+      return makeError("function " + Twine(I) + " is out of bounds");
+    Function F;
+    F.Name = Names.substr(Entry.NameOffset, Entry.NameSize);
+    F.NumArgs = Entry.NumArgs;
+    F.NumRegs = Entry.NumRegs;
+    F.Constants = reinterpret_cast<const uint64_t *>(Start + Entry.ConstantsOffset);
+    F.NumConstants = Entry.NumConstants;
+    F.Code = reinterpret_cast<const Instruction *>(Start + Entry.CodeOffset);
+    if (!verify(F, Entry.NumInstructions))
+      return makeError("function " + F.Name + " has invalid code");
+    File->Functions.push_back(F);
+  }
+  return std::move(File);
+}
+
+Expected<std::unique_ptr<BytecodeFile>> BytecodeFile::open(StringRef Path) {
+  // Large files are mapped instead of being read.
+  auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!Buf)
+    return createStringError(Buf.getError(), "cannot read %s: %s",
+                             Path.str().c_str(), Buf.getError().message().c_str());
+  return load(std::move(*Buf));
+}
+
+Expected<std::unique_ptr<BytecodeFile>> BytecodeFile::get(const BytecodeBuilder &Builder) {
+  SmallString<0> Data;
+  raw_svector_ostream OS(Data);
+  Builder.write(OS);
+  // A new buffer is aligned, unlike one referring to Data.
+  auto Buf = WritableMemoryBuffer::getNewUninitMemBuffer(Data.size(), "bytecode");
+  std::memcpy(Buf->getBufferStart(), Data.data(), Data.size());
+  return load(std::move(Buf));
+}
+
+const Function *BytecodeFile::lookup(StringRef Name) const {
+  for (const Function &F : Functions)
+    if (F.Name == Name)
+      return &F;
+  return nullptr;
+}
@@ -0,0 +1,124 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "AST.h"
+#include "ValueType.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Calc bytecode, a compact encoding of expressions that a small VM runs
+// without LLVM's code generator, for hosts where no JIT may be shipped.
+//
+// The code is register-based. A function has a file of registers holding
+// its arguments first, the pooled constants next, and the temporaries last.
+// Every operation reads two registers and writes a third; the final 'ret'
+// returns a register. A conditional, 'select', reads a third register, the
+// condition, which is named by the slot after it. A temporary is reused as soon as its last reader has
+// run, so the register file stays about as small as the deepest nesting of
+// the expression.
+//
+// A file holds the functions of a catalog (or the single 'calc_eval' of an
+// expression) for one value type. It is read in place, so loading a file is
+// a single mapping plus a check of its contents; see BytecodeFile.
+namespace bytecode {
+
+// Comparisons yield 1 or 0. Ret is last.
+enum Opcode : uint8_t {
+  Add, Sub, Mul, Div, Lt, Le, Gt, Ge, Eq, Ne, Min, Max, Select, Ret
+};
+
+// A three-address instruction: Dst = LHS op RHS, or 'ret LHS'. For 'select',
+// Dst = C ? LHS : RHS, where C is the LHS of the next slot, which is skipped.
+struct Instruction {
+  uint8_t Op;
+  uint8_t Reserved[3];
+  uint32_t Dst, LHS, RHS;
+};
+
+// A function, pointing into the file it belongs to.
+struct Function {
+  llvm::StringRef Name;
+  uint32_t NumArgs;
+  uint32_t NumRegs;
+  const uint64_t *Constants;  // One slot per constant, holding a value of the
+                              // file's type in its first bytes.
+  uint32_t NumConstants;
+  const Instruction *Code;    // Ends with 'ret'.
+
+  // Run the function: return its value for the 'with' variables in Args, in
+  // the order of their declaration. Regs is the register file, NumRegs
+  // values. T is the C++ type of the file's value type. The code is threaded
+  // (computed goto) where the compiler supports it.
+  template <typename T> T run(const T *Args, T *Regs) const;
+};
+
+} // namespace bytecode
+
+// ToBytecodeVisitor's driver: compiles expressions into the functions of a
+// bytecode file.
+class BytecodeBuilder {
+public:
+  struct FunctionCode {
+    std::string Name;
+    uint32_t NumArgs = 0;
+    uint32_t NumRegs = 0;
+    std::vector<uint64_t> Constants;
+    std::vector<bytecode::Instruction> Code;
+  };
+
+private:
+  ValueType Type;
+  std::vector<FunctionCode> Functions;
+
+public:
+  explicit BytecodeBuilder(ValueType Type) : Type(Type) {}
+
+  // Compile the expression into a function of the file.
+  void add(llvm::StringRef Name, AST *Tree);
+  void add(llvm::ArrayRef<CatalogEntry> Entries) {
+    for (const CatalogEntry &Entry : Entries)
+      add(Entry.Name, Entry.Tree);
+  }
+
+  llvm::ArrayRef<FunctionCode> functions() const { return Functions; }
+
+  // Write the file.
+  void write(llvm::raw_ostream &OS) const;
+};
+
+// A bytecode file loaded for running. The functions point into the buffer,
+// which is checked once when it is loaded, so the VM does not need to check
+// any register or instruction.
+class BytecodeFile {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  ValueType Type;
+  std::vector<bytecode::Function> Functions;
+
+  BytecodeFile(std::unique_ptr<llvm::MemoryBuffer> Buffer) : Buffer(std::move(Buffer)) {}
+
+public:
+  // Load a file from a buffer, which must be 8-byte aligned.
+  static llvm::Expected<std::unique_ptr<BytecodeFile>>
+  load(std::unique_ptr<llvm::MemoryBuffer> Buffer);
+
+  // Map a file into memory and load it.
+  static llvm::Expected<std::unique_ptr<BytecodeFile>> open(llvm::StringRef Path);
+
+  // Load the functions of a builder without writing them to disk.
+  static llvm::Expected<std::unique_ptr<BytecodeFile>> get(const BytecodeBuilder &Builder);
+
+  ValueType getType() const { return Type; }
+  llvm::ArrayRef<bytecode::Function> functions() const { return Functions; }
+
+  // Return the function with the given name, or nullptr.
+  const bytecode::Function *lookup(llvm::StringRef Name) const;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include "Cache.h"
+#include "Lexer.h"                      // The token stream the key is computed from.
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"      // utohexstr() for the object file names.
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"    // Creating the cache directory.
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"          // Building object file paths.
+#include "llvm/Support/xxhash.h"        // Hash that is stable across runs.
+
+using namespace llvm;
+
+#define DEBUG_TYPE "calc-cache"
+
+ALWAYS_ENABLED_STATISTIC(NumMemoryHits, "Number of expressions found in memory");
+ALWAYS_ENABLED_STATISTIC(NumDiskHits, "Number of expressions loaded from disk");
+ALWAYS_ENABLED_STATISTIC(NumMisses, "Number of expressions compiled");
+ALWAYS_ENABLED_STATISTIC(NumEvictions, "Number of expressions evicted");
+
+// Build the normalized text of the input from its tokens and hash it.
+ExprKey ExprKey::compute(StringRef Input, StringRef Variant) {
+  ExprKey Key;
+  Key.Text = Variant.str() + ':';
+  Lexer Lex(Input);
+  Token Tok;
+  for (Lex.next(Tok); !Tok.is(Token::eoi); Lex.next(Tok)) {
+    Key.Text += ' ';
+    Key.Text += Tok.getText().str();
+  }
+  Key.Hash = xxHash64(Key.Text);
+  return Key;
+}
+
+std::string ExprKey::getName() const { return "calc-" + utohexstr(Hash); }
+
+std::string DiskObjectCache::getPath(StringRef Name) const {
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, Name + ".o");
+  return std::string(Path);
+}
+
+// Both files must exist and the stored key text must match.
+std::unique_ptr<MemoryBuffer> DiskObjectCache::load(StringRef Name, StringRef Text) {
+  auto Stored = MemoryBuffer::getFile(getPath(Name) + ".key", /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!Stored || (*Stored)->getBuffer() != Text)
+    return nullptr;  // Not cached yet, or cached for another key.
+  auto Buf = MemoryBuffer::getFile(getPath(Name), /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!Buf)
+    return nullptr;
+  return std::move(*Buf);
+}
+
+// Called by the JIT's compiler after a module was compiled to native code.
+// The key text is written after the object file, so an interrupted write
+// leaves no key to match.
+void DiskObjectCache::notifyObjectCompiled(const Module *M,
+                                           MemoryBufferRef Obj) {
+  auto It = KeyTexts.find(M->getModuleIdentifier());
+  if (It == KeyTexts.end())
+    return;  // Not a module of the cache.
+  if (std::error_code EC = sys::fs::create_directories(Dir)) {
+    errs() << "calc: cannot create cache directory " << Dir << ": "
+           << EC.message() << "\n";
+    return;
+  }
+  auto Write = [&](StringRef Path, StringRef Data) {
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << "calc: cannot write cache file: " << EC.message() << "\n";
+      return false;
+    }
+    OS << Data;
+    return true;
+  };
+  std::string Path = getPath(M->getModuleIdentifier());
+  if (Write(Path, Obj.getBuffer()))
+    Write(Path + ".key", It->second);
+}
+
+// Called by the JIT's compiler before compiling a module.
+std::unique_ptr<MemoryBuffer> DiskObjectCache::getObject(const Module *M) {
+  auto It = KeyTexts.find(M->getModuleIdentifier());
+  if (It == KeyTexts.end())
+    return nullptr;
+  return load(It->first(), It->second);
+}
+
+Expected<CompiledExpr> ExprCache::lookup(const ExprKey &Key,
+                                         StringRef EntryName) {
+  // First look for the expression in memory.
+  auto It = Index.find(Key.Text);
+  if (It != Index.end()) {
+    ++MemoryHits;
+    ++NumMemoryHits;
+    LRU.splice(LRU.begin(), LRU, It->second);  // Mark as most recently used.
+    ++It->second->Users;
+    return It->second->Code;
+  }
+
+  // Then try to load the object file compiled by a previous run.
+  if (ObjCache) {
+    if (std::unique_ptr<MemoryBuffer> Obj = ObjCache->load(Key.getName(), Key.Text)) {
+      ++DiskHits;
+      ++NumDiskHits;
+      auto JD = createDylib(Key);
+      if (!JD)
+        return JD.takeError();
+      if (auto Err = JIT.addObject(*JD, std::move(Obj)))
+        return std::move(Err);
+      return finish(Key, *JD, EntryName, {});
+    }
+  }
+
+  ++Misses;
+  ++NumMisses;
+  return CompiledExpr();
+}
+
+Expected<CompiledExpr> ExprCache::add(const ExprKey &Key,
+                                      orc::ThreadSafeModule TSM,
+                                      StringRef EntryName,
+                                      std::vector<std::string> Vars) {
+  // The module identifier names the object file in the disk cache.
+  TSM.withModuleDo(
+      [&](Module &M) { M.setModuleIdentifier(Key.getName()); });
+  if (ObjCache)
+    ObjCache->setKeyText(Key.getName(), Key.Text);
+
+  auto JD = createDylib(Key);
+  if (!JD)
+    return JD.takeError();
+  if (auto Err = JIT.addModule(*JD, std::move(TSM)))
+    return std::move(Err);
+  return finish(Key, *JD, EntryName, std::move(Vars));
+}
+
+// Keys whose hashes collide share the name of their object file, but each
+// entry has a dylib of its own.
+Expected<orc::JITDylib &> ExprCache::createDylib(const ExprKey &Key) {
+  return JIT.createDylib(Key.getName() + "." + std::to_string(NumDylibs++));
+}
+
+Expected<CompiledExpr> ExprCache::finish(const ExprKey &Key,
+                                         orc::JITDylib &JD,
+                                         StringRef EntryName,
+                                         std::vector<std::string> Vars) {
+  auto Entry = JIT.lookup(JD, EntryName);  // Compiles or links the code.
+  if (!Entry) {
+    consumeError(JIT.removeDylib(JD));
+    return Entry.takeError();
+  }
+  CompiledExpr Code;
+  Code.JD = &JD;
+  Code.Entry = *Entry;
+  Code.Vars = std::move(Vars);
+  insert(Key, Code);
+  return Code;
+}
+
+void ExprCache::insert(const ExprKey &Key, CompiledExpr Code) {
+  // Make room by dropping the least recently used entries nobody uses.
+  for (auto It = LRU.end(); LRU.size() >= Capacity && It != LRU.begin();) {
+    --It;
+    if (It->Users == 0)
+      evict(It++);
+  }
+
+  LRU.push_front(Entry{Key, std::move(Code), 1});
+  Index[Key.Text] = LRU.begin();
+  Dylibs[LRU.front().Code.JD] = LRU.begin();
+}
+
+void ExprCache::evict(std::list<Entry>::iterator It) {
+  if (auto Err = JIT.removeDylib(*It->Code.JD))
+    logAllUnhandledErrors(std::move(Err), errs(), "calc: ");
+  Index.erase(It->Key.Text);
+  Dylibs.erase(It->Code.JD);
+  LRU.erase(It);
+  ++Evictions;
+  ++NumEvictions;
+}
+
+void ExprCache::release(const CompiledExpr &Code) {
+  auto It = Dylibs.find(Code.JD);
+  assert(It != Dylibs.end() && It->second->Users && "Code not in use");
+  if (--It->second->Users == 0 && LRU.size() > Capacity)
+    evict(It->second);
+}
+
+void ExprCache::printStats(raw_ostream &OS) const {
+  OS << "cache: " << MemoryHits << " memory hits, " << DiskHits
+     << " disk hits, " << Misses << " misses, " << Evictions
+     << " evictions, " << LRU.size() << "/" << Capacity << " entries\n";
+}
@@ -0,0 +1,140 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "JIT.h"                                // The JIT holding the compiled expressions.
+#include "llvm/ADT/DenseMap.h"                  // Dylib -> LRU list position.
+#include "llvm/ADT/StringMap.h"                 // Key text -> LRU list position, and the
+                                                // key texts of the modules being compiled.
+#include "llvm/ExecutionEngine/ObjectCache.h"   // Base class for the on-disk object cache.
+#include "llvm/Support/raw_ostream.h"
+#include <list>
+#include <string>
+#include <vector>
+
+// ExprKey identifies an expression independent of its formatting. It is built
+// from the token stream produced by Lexer::next, so "a+1" and "a + 1" share
+// the same key.
+struct ExprKey {
+  std::string Text;  // The normalized source: token texts separated by a single space.
+  uint64_t Hash;     // Stable hash of Text, used as the cache index and object file name.
+
+  // Lex the input and compute its key. Variant distinguishes different kinds
+  // of code generated for the same source, e.g. 'main' and 'calc_batch'.
+  static ExprKey compute(llvm::StringRef Input, llvm::StringRef Variant);
+
+  // The name used for the module and the object file of this expression.
+  std::string getName() const;
+};
+
+// DiskObjectCache stores the native code of compiled modules in a directory,
+// one `<module identifier>.o` file per expression, so repeated runs of calc
+// can skip compilation entirely. Next to it, `<module identifier>.key` holds
+// the text of the expression's key; an object file is only used for the key
+// it was compiled from, so a hash collision is a miss.
+class DiskObjectCache : public llvm::ObjectCache {
+  std::string Dir;  // Directory holding the object files.
+  llvm::StringMap<std::string> KeyTexts;  // Key texts of the modules, by name.
+
+public:
+  DiskObjectCache(llvm::StringRef Dir) : Dir(Dir) {}
+
+  // Path of the object file for the given module name.
+  std::string getPath(llvm::StringRef Name) const;
+
+  // Load the object file for the given module name if it was compiled from
+  // the key text Text, or return nullptr.
+  std::unique_ptr<llvm::MemoryBuffer> load(llvm::StringRef Name, llvm::StringRef Text);
+
+  // Record the key text of a module before it is compiled, to store and
+  // check it with the object file.
+  void setKeyText(llvm::StringRef Name, llvm::StringRef Text) { KeyTexts[Name] = Text.str(); }
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+};
+
+// An expression compiled by the JIT.
+struct CompiledExpr {
+  llvm::orc::JITDylib *JD = nullptr;  // The dylib holding the code, nullptr if not compiled.
+  llvm::JITTargetAddress Entry = 0;   // Address of the entry point ('main', 'calc_batch' or 'calc_eval').
+  std::vector<std::string> Vars;      // The 'with' variables, if known.
+
+  explicit operator bool() const { return JD != nullptr; }
+};
+
+// ExprCache maps expression keys to already JIT-compiled code. Recently used
+// expressions are kept in memory up to a fixed capacity; older ones are
+// evicted and their code is removed from the JIT. Code returned by lookup or
+// add is in use until it is released, and is not evicted meanwhile, so the
+// cache may exceed its capacity while all of its entries are in use. With a
+// DiskObjectCache, a miss in memory falls back to loading the object file
+// from disk.
+class ExprCache {
+  struct Entry {
+    ExprKey Key;                   // The key, kept to remove the entry from the index.
+    CompiledExpr Code;             // The compiled code.
+    unsigned Users = 0;            // Callers that have not released the code.
+  };
+
+  CalcJIT &JIT;                    // The JIT the expressions are compiled with.
+  DiskObjectCache *ObjCache;       // Optional on-disk cache, may be nullptr.
+  size_t Capacity;                 // Maximum number of entries kept in memory.
+  std::list<Entry> LRU;            // Entries, most recently used first.
+  // Key text -> entry. The text rather than the hash, so a hash collision is a
+  // miss instead of evicting the other expression.
+  llvm::StringMap<std::list<Entry>::iterator> Index;
+  llvm::DenseMap<llvm::orc::JITDylib *, std::list<Entry>::iterator> Dylibs;
+  unsigned NumDylibs = 0;          // Makes the names of the dylibs unique.
+
+  // Counters to size the cache.
+  unsigned MemoryHits = 0;
+  unsigned DiskHits = 0;
+  unsigned Misses = 0;
+  unsigned Evictions = 0;
+
+  // Create the dylib for the code of the key.
+  llvm::Expected<llvm::orc::JITDylib &> createDylib(const ExprKey &Key);
+
+  // Insert a new entry at the front, evicting least recently used ones that
+  // are not in use if the cache is full.
+  void insert(const ExprKey &Key, CompiledExpr Code);
+
+  // Remove an entry and its code.
+  void evict(std::list<Entry>::iterator It);
+
+  // Look up the entry point in a freshly added dylib and cache it.
+  llvm::Expected<CompiledExpr> finish(const ExprKey &Key, llvm::orc::JITDylib &JD,
+                                      llvm::StringRef EntryName,
+                                      std::vector<std::string> Vars);
+
+public:
+  ExprCache(CalcJIT &JIT, size_t Capacity, DiskObjectCache *ObjCache = nullptr)
+      : JIT(JIT), ObjCache(ObjCache), Capacity(Capacity ? Capacity : 1) {}
+
+  // Return the compiled code for the key, or an empty CompiledExpr if it has
+  // to be compiled. EntryName is the function the caller wants to call. The
+  // variables of code loaded from disk are not known.
+  llvm::Expected<CompiledExpr> lookup(const ExprKey &Key, llvm::StringRef EntryName);
+
+  // Add the module generated for the key, with the 'with' variables Vars, to
+  // the JIT and cache the result.
+  llvm::Expected<CompiledExpr> add(const ExprKey &Key, llvm::orc::ThreadSafeModule TSM,
+                                   llvm::StringRef EntryName,
+                                   std::vector<std::string> Vars = {});
+
+  // Release code returned by lookup or add. Once no caller uses it, it may be
+  // evicted; right away if the cache is over its capacity.
+  void release(const CompiledExpr &Code);
+
+  unsigned getMemoryHits() const { return MemoryHits; }
+  unsigned getDiskHits() const { return DiskHits; }
+  unsigned getMisses() const { return Misses; }
+  unsigned getEvictions() const { return Evictions; }
+  size_t size() const { return LRU.size(); }
+
+  // Print the hit/miss counters.
+  void printStats(llvm::raw_ostream &OS) const;
+};
+
+#endif
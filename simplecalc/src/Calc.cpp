@@ -1,16 +1,875 @@
+#include "Bytecode.h"       // Includes the bytecode compiler and VM.
+#include "Cache.h"          // Includes the compiled-expression cache.
 #include "CodeGen.h"        // Includes the code generation logic.
+#include "Incremental.h"    // Includes the incremental compiler.
 #include "Parser.h"         // Includes the parser logic to build the AST from the token stream.
+#include "Phases.h"         // Includes the phase timers.
+#include "PrecompiledCatalog.h" // Includes the lazily loaded catalogs.
+#include "Profile.h"        // Includes the value profiles to specialize for.
+#include "ProfileRuntime.h" // Includes the runtime of instrumented code.
+#include "Runtime.h"        // Includes the value parsing and printing of the runtime.
 #include "Sema.h"           // Includes the semantic analysis logic.
+#include "Simplify.h"       // Includes the AST simplifier.
+#include "Tiered.h"         // Includes the tiered interpreter and JIT.
+#include "llvm/ADT/ScopeExit.h"         // Reporting statistics on every exit path.
+#include "llvm/ADT/Statistic.h"         // Counters reported with -stats.
 #include "llvm/Support/CommandLine.h"   // Provides command-line argument handling.
 #include "llvm/Support/InitLLVM.h"      // Initializes the LLVM environment.
+#include "llvm/Support/LineIterator.h"  // Reading batch input line by line.
+#include "llvm/Support/MemoryBuffer.h"  // Reading batch input from stdin.
+#include "llvm/Support/ToolOutputFile.h" // Output file that is removed on errors.
 #include "llvm/Support/raw_ostream.h"   // Provides LLVM's output streams (like `llvm::errs()` for errors).
 
+#define DEBUG_TYPE "calc"
+
+ALWAYS_ENABLED_STATISTIC(NumNodes, "Number of AST nodes allocated");
+ALWAYS_ENABLED_STATISTIC(NumASTBytes, "Number of bytes allocated for the AST");
+ALWAYS_ENABLED_STATISTIC(NumSharedNodes, "Number of AST nodes shared by equal subexpressions");
+
 // Define a command-line option for the input expression.
 static llvm::cl::opt<std::string>
     Input(llvm::cl::Positional,              // Positional argument (required input from the command line).
           llvm::cl::desc("<input expression>"),  // Description of the argument shown in the help message.
           llvm::cl::init(""));               // Default value if no input is provided.
 
+// Define command-line options to compile a catalog file of named expressions.
+static llvm::cl::opt<std::string>
+    CatalogFile("catalog",
+                llvm::cl::desc("Compile a file of 'name = <calc>;' entries into "
+                               "one module, with one function per entry "
+                               "('-' for stdin)"),
+                llvm::cl::value_desc("filename"), llvm::cl::init(""));
+
+static llvm::cl::opt<bool>
+    VerifyOnly("verify-only",
+               llvm::cl::desc("Only check the syntax and the declarations of "
+                              "the input or the -catalog file, in one pass "
+                              "that builds no AST"),
+               llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned>
+    NumThreads("j",
+               llvm::cl::desc("Compile a catalog on N threads (0: all cores)"),
+               llvm::cl::value_desc("N"), llvm::cl::Prefix, llvm::cl::init(1));
+
+static llvm::cl::opt<std::string>
+    EntryName("entry",
+              llvm::cl::desc("With -catalog and -jit, or -load-catalog, the "
+                             "entry to run"),
+              llvm::cl::value_desc("name"), llvm::cl::init(""));
+
+static llvm::cl::opt<std::string>
+    LoadCatalog("load-catalog",
+                llvm::cl::desc("Load a catalog precompiled with -emit=pcat and "
+                               "run the entry selected by -entry"),
+                llvm::cl::value_desc("filename"), llvm::cl::init(""));
+
+// Define a command-line option to run the expression in-process instead of printing IR.
+static llvm::cl::opt<bool>
+    Jit("jit",
+        llvm::cl::desc("Compile the expression with the ORC JIT and run it"),
+        llvm::cl::init(false));
+
+// Define a command-line option to generate the batch entry point 'calc_batch'.
+static llvm::cl::opt<bool>
+    Batch("batch",
+          llvm::cl::desc("Generate calc_batch, evaluating the expression over "
+                         "columns of rows (with -jit: CSV rows from stdin)"),
+          llvm::cl::init(false));
+
+// Define command-line options to compile successive versions of a formula incrementally.
+static llvm::cl::opt<bool>
+    Incremental("incremental",
+                llvm::cl::desc("Read versions of a formula from stdin, one per "
+                               "line, and compile each incrementally with the "
+                               "JIT, printing its value"),
+                llvm::cl::init(false));
+
+static llvm::cl::list<int>
+    Args("args",
+         llvm::cl::desc("With -incremental, the values of the variables, in "
+                        "the order of their declaration (default: 0)"),
+         llvm::cl::CommaSeparated, llvm::cl::value_desc("v1,v2,..."));
+
+// Define a command-line option to generate the entry point 'calc_eval'.
+static llvm::cl::opt<bool>
+    Eval("eval",
+         llvm::cl::desc("Generate calc_eval(const T *args), returning the "
+                        "value of the expression for its arguments"),
+         llvm::cl::init(false));
+
+// Define a command-line option to check the integer operations for overflow.
+static llvm::cl::opt<bool>
+    Checked("checked",
+            llvm::cl::desc("With -batch or -eval, check the integer operations "
+                           "for overflow and report the rows that overflow"),
+            llvm::cl::init(false));
+
+// Define a command-line option to run calc bytecode instead of compiling.
+static llvm::cl::opt<std::string>
+    VMFile("vm",
+           llvm::cl::desc("Run a calc bytecode file (see -emit=calcbc) over "
+                          "CSV rows from stdin; -entry selects the function"),
+           llvm::cl::value_desc("filename"), llvm::cl::init(""));
+
+// Define command-line options to evaluate the expression in tiers.
+static llvm::cl::opt<bool>
+    Tiered("tiered",
+           llvm::cl::desc("Evaluate the expression over CSV rows from stdin, "
+                          "interpreting it until it is hot enough to compile "
+                          "with the JIT in the background"),
+           llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned>
+    TierThreshold("tier-threshold",
+                  llvm::cl::desc("With -tiered, the number of interpreted "
+                                 "evaluations before the expression is compiled"),
+                  llvm::cl::value_desc("N"), llvm::cl::init(1000));
+
+// Define a command-line option selecting the type the expression computes with.
+static llvm::cl::opt<ValueType> Type(
+    "type", llvm::cl::desc("The type of all values of the expression"),
+    llvm::cl::values(
+        clEnumValN(ValueType::I32, "i32", "32-bit signed integers (default)"),
+        clEnumValN(ValueType::I64, "i64", "64-bit signed integers"),
+        clEnumValN(ValueType::F32, "f32", "Single precision floating point"),
+        clEnumValN(ValueType::F64, "f64", "Double precision floating point")),
+    llvm::cl::init(ValueType::I32));
+
+// Define a command-line option selecting the runtime the generated 'main' calls.
+static llvm::cl::opt<RuntimeKind> Runtime(
+    "runtime", llvm::cl::desc("The runtime of the generated main"),
+    llvm::cl::values(
+        clEnumValN(RuntimeKind::Interactive, "interactive",
+                   "Prompt for every variable (default)"),
+        clEnumValN(RuntimeKind::Bulk, "bulk",
+                   "Evaluate over the rows of a file, [-binary] [file] or "
+                   "stdin (see BulkRuntime.h)")),
+    llvm::cl::init(RuntimeKind::Interactive));
+
+// Define a command-line option selecting the optimization level, e.g. -O2.
+static llvm::cl::opt<unsigned>
+    OptLevel("O",
+             llvm::cl::desc("Optimization level of the LLVM pipeline (0-3)"),
+             llvm::cl::Prefix, llvm::cl::init(0));
+
+// Define command-line options selecting what is written, and where.
+static llvm::cl::opt<EmitKind> Emit(
+    "emit", llvm::cl::desc("The kind of output to write"),
+    llvm::cl::values(
+        clEnumValN(EmitKind::LLVMIR, "ll", "Textual LLVM IR (default)"),
+        clEnumValN(EmitKind::Bitcode, "bc", "LLVM bitcode"),
+        clEnumValN(EmitKind::Assembly, "asm", "Native assembly"),
+        clEnumValN(EmitKind::Object, "obj", "Native object file"),
+        clEnumValN(EmitKind::CalcBytecode, "calcbc",
+                   "Calc bytecode, run with -vm (see Bytecode.h)"),
+        clEnumValN(EmitKind::PrecompiledCatalog, "pcat",
+                   "With -catalog, native code per entry, run with "
+                   "-load-catalog (see PrecompiledCatalog.h)")),
+    llvm::cl::init(EmitKind::LLVMIR));
+
+static llvm::cl::opt<std::string>
+    OutputFile("o", llvm::cl::desc("Output file (default: stdout)"),
+               llvm::cl::value_desc("filename"), llvm::cl::init("-"));
+
+// Define a command-line option to time the phases of the compiler. LLVM's own
+// -stats and -stats-json print the counters (and, as JSON, the timers).
+static llvm::cl::opt<bool>
+    TimePhases("time-phases",
+               llvm::cl::desc("Time the phases of the compiler, printing the "
+                              "elapsed time for each on exit"),
+               llvm::cl::init(false));
+
+// Define a command-line option to run Sema and CodeGen on the flat AST encoding.
+static llvm::cl::opt<bool>
+    Flat("flat",
+         llvm::cl::desc("Check and compile the flat, post-order AST encoding"),
+         llvm::cl::init(false));
+
+// Define a command-line option to share the nodes of equal subexpressions.
+static llvm::cl::opt<bool>
+    CSE("cse",
+        llvm::cl::desc("Share the AST nodes of equal subexpressions, so they "
+                       "are checked and compiled once"),
+        llvm::cl::init(true));
+
+// Define command-line options controlling the AST simplifier run before code generation.
+static llvm::cl::opt<bool>
+    Simplify("simplify",
+             llvm::cl::desc("Fold constants and simplify the AST before code generation"),
+             llvm::cl::init(true));
+
+static llvm::cl::opt<bool>
+    SimplifyStats("simplify-stats",
+                  llvm::cl::desc("Print what the simplifier has done"),
+                  llvm::cl::init(false));
+
+// Define command-line options controlling the compiled-expression cache used with -jit.
+static llvm::cl::opt<std::string>
+    CacheDir("cache-dir",
+             llvm::cl::desc("Directory for caching compiled objects across runs"),
+             llvm::cl::value_desc("directory"), llvm::cl::init(""));
+
+static llvm::cl::opt<bool>
+    CacheStats("cache-stats",
+               llvm::cl::desc("Print cache hit/miss counters"),
+               llvm::cl::init(false));
+
+// Define command-line options for specializing code for the values it sees.
+static llvm::cl::opt<bool>
+    Instrument("instrument",
+               llvm::cl::desc("Record the values of the 'with' variables of "
+                              "integer code, written to $CALC_PROFILE or "
+                              "calc.profile when it exits"),
+               llvm::cl::init(false));
+
+static llvm::cl::opt<std::string>
+    ProfileUse("profile-use",
+               llvm::cl::desc("Specialize integer code for the values recorded "
+                              "in a profile of -instrument code"),
+               llvm::cl::value_desc("filename"), llvm::cl::init(""));
+
+// The profile read from the file given with -profile-use.
+static llvm::Optional<ValueProfile> Profile;
+
+// Run the front end over the input expression, allocating the AST in Ctx.
+// If FlatTree is given, the AST is converted to the flat encoding, which is
+// then used for the semantic analysis and returned for code generation.
+// Returns the AST, or nullptr after reporting syntax or semantic errors.
+static AST *parseInput(llvm::StringRef Input, ASTContext &Ctx,
+                       FlatAST *FlatTree) {
+  AST *Tree;
+  // The source manager locates the errors in the input, which it refers to
+  // without a copy.
+  llvm::SourceMgr SrcMgr;
+  SrcMgr.AddNewSourceBuffer(
+      llvm::MemoryBuffer::getMemBuffer(Input, "<input>", /*RequiresNullTerminator=*/false),
+      llvm::SMLoc());
+  {
+    // Tokens are lexed on demand, so lexing is timed as part of parsing.
+    PhaseTimer Timer("parse", "Lexing and parsing", TimePhases);
+
+    // Step 1: Lexical Analysis
+    // The lexer takes the input expression and breaks it into tokens.
+    Lexer Lex(Input);
+
+    // Step 2: Parsing
+    // The parser takes the tokens from the lexer and produces an Abstract Syntax Tree (AST).
+    Parser Parser(Lex, Ctx, &SrcMgr);
+    Tree = Parser.parse();  // Parse the input and get the AST.
+
+    // Check if the parsing resulted in any errors or if the AST is null.
+    if (!Tree || Parser.hasError()) {
+      llvm::errs() << "Syntax errors occured\n";  // Report syntax errors if found.
+      return nullptr;
+    }
+  }
+
+  // Step 3: Semantic Analysis
+  // Perform semantic analysis to ensure correctness (e.g., all variables are declared).
+  {
+    PhaseTimer Timer("sema", "Semantic analysis", TimePhases);
+    Sema Semantic(&SrcMgr, Type);
+    if (FlatTree)
+      *FlatTree = FlatAST::build(Tree);
+    if (FlatTree ? Semantic.semantic(*FlatTree, Input) : Semantic.semantic(Tree, Input)) {
+      llvm::errs() << "Semantic errors occured\n";  // Report semantic errors if found.
+      return nullptr;
+    }
+  }
+
+  // Step 3b: Simplification
+  // Fold constants and apply algebraic identities on the checked AST.
+  if (Simplify) {
+    PhaseTimer Timer("simplify", "AST simplification", TimePhases);
+    Simplifier Simp(Ctx, Type, Checked);
+    Tree = Simp.run(Tree);
+    if (SimplifyStats)
+      Simp.getStats().print(llvm::errs());
+    if (FlatTree)
+      *FlatTree = FlatAST::build(Tree);
+  }
+  NumNodes += Ctx.getNumNodes();
+  NumASTBytes += Ctx.getBytesAllocated();
+  NumSharedNodes += Ctx.getNumShared();
+  return Tree;
+}
+
+// Run the front end over a catalog file. Returns false after reporting
+// syntax or semantic errors. The entries without syntax errors are checked
+// even if others have some, so one run reports the errors of all entries.
+static bool parseCatalog(llvm::MemoryBufferRef Buffer, ASTContext &Ctx,
+                         llvm::SmallVectorImpl<CatalogEntry> &Entries) {
+  llvm::SourceMgr SrcMgr;
+  SrcMgr.AddNewSourceBuffer(llvm::MemoryBuffer::getMemBuffer(Buffer, /*RequiresNullTerminator=*/false),
+                            llvm::SMLoc());
+  bool SyntaxErrors;
+  {
+    PhaseTimer Timer("parse", "Lexing and parsing", TimePhases);
+    Lexer Lex(Buffer);
+    Parser Parser(Lex, Ctx, &SrcMgr);
+    Parser.parseCatalog(Entries);
+    SyntaxErrors = Parser.hasError();
+    if (SyntaxErrors)
+      llvm::errs() << "Syntax errors occured\n";
+  }
+
+  {
+    PhaseTimer Timer("sema", "Semantic analysis", TimePhases);
+    Sema Semantic(&SrcMgr, Type);
+    if (Semantic.semantic(Entries)) {
+      llvm::errs() << "Semantic errors occured\n";
+      return false;
+    }
+  }
+  if (SyntaxErrors)
+    return false;
+
+  // One simplifier for all entries, so the statistics cover the whole catalog.
+  if (Simplify) {
+    PhaseTimer Timer("simplify", "AST simplification", TimePhases);
+    Simplifier Simp(Ctx, Type, Checked);
+    for (CatalogEntry &Entry : Entries)
+      Entry.Tree = Simp.run(Entry.Tree);
+    if (SimplifyStats)
+      Simp.getStats().print(llvm::errs());
+  }
+  NumNodes += Ctx.getNumNodes();
+  NumASTBytes += Ctx.getBytesAllocated();
+  NumSharedNodes += Ctx.getNumShared();
+  return true;
+}
+
+// Collect the code generation options given on the command line.
+static CodeGenOptions getCodeGenOptions() {
+  CodeGenOptions Opts;
+  Opts.Batch = Batch;
+  Opts.Eval = Eval;
+  Opts.Checked = Checked;
+  Opts.OptLevel = OptLevel;
+  Opts.Type = Type;
+  Opts.Runtime = Runtime;
+  Opts.TimePhases = TimePhases;
+  Opts.Instrument = Instrument;
+  Opts.Profile = Profile ? &*Profile : nullptr;
+  return Opts;
+}
+
+// Report an error from the LLVM libraries and return the exit code for it.
+static int reportError(llvm::Error Err) {
+  llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "calc: ");
+  return 1;
+}
+
+// Write the values recorded by instrumented code, before the JIT that holds
+// the records goes away. Returns the exit code Res, or 1 on failure.
+static int writeProfile(int Res) {
+  if (calc_profile_write(nullptr)) {
+    llvm::errs() << "calc: cannot write the value profile\n";
+    return 1;
+  }
+  return Res;
+}
+
+// Open the file given with -o and let Compile write the generated code to it.
+static int writeOutput(llvm::function_ref<llvm::Error(llvm::raw_ostream &)> Compile) {
+  // Only IR and assembly are text; the output file is deleted unless kept.
+  std::error_code EC;
+  bool IsText = Emit == EmitKind::LLVMIR || Emit == EmitKind::Assembly;
+  llvm::ToolOutputFile Out(OutputFile, EC,
+                           IsText ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None);
+  if (EC) {
+    llvm::errs() << "calc: cannot open " << OutputFile << ": " << EC.message() << "\n";
+    return 1;
+  }
+  if (auto Err = Compile(Out.os()))
+    return reportError(std::move(Err));
+  Out.keep();
+  return 0;
+}
+
+// Read comma-separated rows of NumCols values of type T from stdin and pass
+// each to Row. Returns the exit code, 1 after reporting malformed input.
+template <typename T>
+static int readRows(unsigned NumCols, llvm::function_ref<void(const T *)> Row) {
+  auto Buf = llvm::MemoryBuffer::getSTDIN();
+  if (!Buf) {
+    llvm::errs() << "calc: cannot read input: " << Buf.getError().message() << "\n";
+    return 1;
+  }
+
+  std::vector<T> Vals(NumCols);
+  llvm::SmallVector<llvm::StringRef, 8> Fields;
+  // Blank lines are rows too, the rows of an expression without variables.
+  for (llvm::line_iterator Line(**Buf, /*SkipBlanks=*/false); !Line.is_at_end(); ++Line) {
+    Fields.clear();
+    Line->split(Fields, ',');
+    if (Fields.size() != NumCols && !(NumCols == 0 && Line->trim().empty())) {
+      llvm::errs() << "calc: line " << Line.line_number() << ": expected "
+                   << NumCols << " values\n";
+      return 1;
+    }
+    for (unsigned I = 0; I < NumCols; ++I)
+      if (parseValue(Fields[I].trim(), Vals[I])) {
+        llvm::errs() << "calc: line " << Line.line_number()
+                     << ": invalid value: " << Fields[I] << "\n";
+        return 1;
+      }
+    Row(Vals.data());
+  }
+  return 0;
+}
+
+// Print the result of a row, or that it overflowed, whose count is kept in
+// NumOverflows.
+template <typename T>
+static void printRow(T V, bool Overflow, size_t &NumOverflows) {
+  if (Overflow) {
+    llvm::outs() << "overflow\n";
+    ++NumOverflows;
+    return;
+  }
+  printValue(llvm::outs(), V);
+  llvm::outs() << "\n";
+}
+
+// Report the rows that overflowed and return the exit code.
+static int reportOverflows(size_t NumOverflows) {
+  if (!NumOverflows)
+    return 0;
+  llvm::errs() << "calc: " << NumOverflows << " rows overflowed\n";
+  return 1;
+}
+
+// Read comma-separated rows of values of type T from stdin, evaluate the
+// batch function at Addr over them and print one result per row. A checked
+// function (see CodeGenOptions::Checked) also returns the overflows.
+template <typename T>
+static int runBatch(llvm::JITTargetAddress Addr, unsigned NumCols, bool IsChecked) {
+  // Split the input into one column per 'with' variable.
+  std::vector<std::vector<T>> Cols(NumCols);
+  size_t NumRows = 0;
+  if (int Res = readRows<T>(NumCols, [&](const T *Vals) {
+        for (unsigned I = 0; I < NumCols; ++I)
+          Cols[I].push_back(Vals[I]);
+        ++NumRows;
+      }))
+    return Res;
+
+  std::vector<const T *> ColPtrs;
+  for (auto &Col : Cols)
+    ColPtrs.push_back(Col.data());
+  std::vector<T> Out(NumRows);
+  std::vector<uint8_t> Overflows(IsChecked ? NumRows : 0);
+  if (IsChecked)
+    llvm::jitTargetAddressToFunction<CalcJIT::CheckedBatchFn<T>>(Addr)(
+        ColPtrs.data(), Out.data(), NumRows, Overflows.data());
+  else
+    llvm::jitTargetAddressToFunction<CalcJIT::BatchFn<T>>(Addr)(ColPtrs.data(),
+                                                                Out.data(), NumRows);
+
+  size_t NumOverflows = 0;
+  for (size_t I = 0; I < NumRows; ++I)
+    printRow(Out[I], IsChecked && Overflows[I], NumOverflows);
+  return reportOverflows(NumOverflows);
+}
+
+template <typename T>
+static int runBatch(CalcJIT &JIT, llvm::orc::JITDylib &JD, llvm::StringRef Name) {
+  unsigned NumCols;
+  llvm::Expected<CalcJIT::BatchFn<T>> Fn = JIT.lookupBatch<T>(JD, NumCols, Name);
+  if (!Fn)
+    return reportError(Fn.takeError());
+  return runBatch<T>(llvm::pointerToJITTargetAddress(*Fn), NumCols, Checked);
+}
+
+// Run the batch function compiled for the value type selected with -type.
+static int runBatch(CalcJIT &JIT, llvm::orc::JITDylib &JD,
+                    llvm::StringRef Name = "calc_batch") {
+  switch (Type) {
+  case ValueType::I32:
+    return runBatch<int32_t>(JIT, JD, Name);
+  case ValueType::I64:
+    return runBatch<int64_t>(JIT, JD, Name);
+  case ValueType::F32:
+    return runBatch<float>(JIT, JD, Name);
+  case ValueType::F64:
+    return runBatch<double>(JIT, JD, Name);
+  }
+  llvm_unreachable("Unknown value type");
+}
+
+// Compile the input with the JIT and run it. Expressions that were compiled
+// before are taken from the cache without running the front end at all.
+static int runJIT() {
+  std::unique_ptr<DiskObjectCache> ObjCache;
+  if (!CacheDir.empty())
+    ObjCache = std::make_unique<DiskObjectCache>(CacheDir);
+
+  auto JIT = CalcJIT::create(OptLevel, ObjCache.get());
+  if (!JIT)
+    return reportError(JIT.takeError());
+  // A run compiles one expression, so only the disk cache can hit; programs
+  // compiling many keep them in memory with CalcSession.
+  ExprCache Cache(**JIT, 1, ObjCache.get());
+  auto TM = CodeGen::createHostTargetMachine(OptLevel);
+  if (!TM)
+    return reportError(TM.takeError());
+  CodeGen CodeGenerator(getCodeGenOptions(), TM->get());
+
+  // The cache key only needs the token stream, and the options of the code
+  // generator and of the front end, which may change the generated code.
+  std::string Variant = getCodeGenOptions().getKey();
+  if (Simplify)
+    Variant += "-simplify";
+  if (CSE)
+    Variant += "-cse";
+  if (Flat)
+    Variant += "-flat";
+  ExprKey Key = ExprKey::compute(Input, Variant);
+  llvm::Expected<CompiledExpr> Code = [&] {
+    PhaseTimer Timer("cache", "Cache lookup", TimePhases);
+    return Cache.lookup(Key, CodeGenerator.getEntryName());
+  }();
+  if (!Code)
+    return reportError(Code.takeError());
+
+  // On a miss, run the whole pipeline and add the result to the cache.
+  if (!*Code) {
+    ASTContext Ctx(CSE);
+    FlatAST FlatTree;
+    AST *Tree = parseInput(Input, Ctx, Flat ? &FlatTree : nullptr);
+    if (!Tree)
+      return 1;
+    llvm::orc::ThreadSafeModule TSM = Flat ? CodeGenerator.generate(FlatTree)
+                                           : CodeGenerator.generate(Tree);
+    // Adding the module compiles it to native code.
+    PhaseTimer Timer("jit", "JIT compilation", TimePhases);
+    Code = Cache.add(Key, std::move(TSM), CodeGenerator.getEntryName());
+    if (!Code)
+      return reportError(Code.takeError());
+  }
+
+  PhaseTimer Timer("run", "Running the generated code", TimePhases);
+  int Res;
+  if (Batch)
+    Res = runBatch(**JIT, *Code->JD);
+  else
+    Res = llvm::jitTargetAddressToFunction<CalcJIT::MainFnTy>(Code->Entry)(0, nullptr);
+  if (CacheStats)
+    Cache.printStats(llvm::errs());
+  return writeProfile(Res);
+}
+
+// Compile the formula on every line of stdin as a new version of the last
+// one, and print its value. Lines with errors are reported and skipped.
+static int runIncremental() {
+  auto JIT = CalcJIT::create(OptLevel);
+  if (!JIT)
+    return reportError(JIT.takeError());
+  auto JD = (*JIT)->createDylib("incremental");
+  if (!JD)
+    return reportError(JD.takeError());
+  auto TM = CodeGen::createHostTargetMachine(OptLevel);
+  if (!TM)
+    return reportError(TM.takeError());
+  IncrementalCompiler Compiler(**JIT, *JD, getCodeGenOptions(), TM->get());
+
+  auto Buf = llvm::MemoryBuffer::getSTDIN();
+  if (!Buf) {
+    llvm::errs() << "calc: cannot read input: " << Buf.getError().message() << "\n";
+    return 1;
+  }
+
+  // Variables without a value given are 0.
+  std::vector<int32_t> Values(Args.begin(), Args.end());
+  int Res = 0;
+  // Blank lines are rows too, the rows of an expression without variables.
+  for (llvm::line_iterator Line(**Buf, /*SkipBlanks=*/false); !Line.is_at_end(); ++Line) {
+    llvm::Expected<IncrementalCompiler::EvalFnTy> Fn = Compiler.update(*Line);
+    if (!Fn) {
+      Res = reportError(Fn.takeError());
+      continue;
+    }
+    if (Values.size() < Compiler.getNumVars())
+      Values.resize(Compiler.getNumVars());
+    PhaseTimer Timer("run", "Running the generated code", TimePhases);
+    llvm::outs() << (*Fn)(Values.data()) << "\n";
+  }
+  return Res;
+}
+
+// Evaluate the input over the CSV rows of stdin with the tiered engine, and
+// print one result per row. The first rows are interpreted; later ones run
+// the compiled code as soon as it is ready.
+static int runTiered() {
+  auto Engine = TieredEngine::create(getCodeGenOptions(), TierThreshold, NumThreads);
+  if (!Engine)
+    return reportError(Engine.takeError());
+  llvm::Expected<TieredEngine::Expression &> E = (*Engine)->add(Input);
+  if (!E)
+    return reportError(E.takeError());
+
+  return readRows<int32_t>(E->getNumVars(), [&](const int32_t *Vals) {
+    llvm::outs() << (*Engine)->evaluate(*E, Vals) << "\n";
+  });
+}
+
+// Run a function of a bytecode file over the CSV rows of stdin.
+template <typename T> static int runBytecode(const bytecode::Function &F) {
+  std::vector<T> Regs(F.NumRegs);
+  return readRows<T>(F.NumArgs, [&](const T *Vals) {
+    printValue(llvm::outs(), F.run(Vals, Regs.data()));
+    llvm::outs() << "\n";
+  });
+}
+
+// Load the bytecode file given with -vm and run the function selected with
+// -entry, which may be left out if there is only one.
+static int runVM() {
+  auto File = BytecodeFile::open(VMFile);
+  if (!File)
+    return reportError(File.takeError());
+  const bytecode::Function *F = nullptr;
+  if (!EntryName.empty())
+    F = (*File)->lookup(EntryName);
+  else if ((*File)->functions().size() == 1)
+    F = &(*File)->functions().front();
+  if (!F) {
+    llvm::errs() << "calc: " << VMFile << ": "
+                 << (EntryName.empty() ? "select a function with -entry"
+                                       : "no function " + EntryName)
+                 << "\n";
+    return 1;
+  }
+  switch ((*File)->getType()) {
+  case ValueType::I32:
+    return runBytecode<int32_t>(*F);
+  case ValueType::I64:
+    return runBytecode<int64_t>(*F);
+  case ValueType::F32:
+    return runBytecode<float>(*F);
+  case ValueType::F64:
+    return runBytecode<double>(*F);
+  }
+  llvm_unreachable("Unknown value type");
+}
+
+// Run a calc_batch or calc_eval function over the CSV rows of stdin.
+template <typename T>
+static int runEntry(llvm::JITTargetAddress Addr, unsigned NumVars, bool IsBatch,
+                    bool IsChecked) {
+  if (IsBatch)
+    return runBatch<T>(Addr, NumVars, IsChecked);
+  size_t NumOverflows = 0;
+  if (int Res = readRows<T>(NumVars, [&](const T *Vals) {
+        uint8_t Overflow = 0;
+        T V = IsChecked
+                  ? llvm::jitTargetAddressToFunction<CalcJIT::CheckedEvalFn<T>>(Addr)(
+                        Vals, &Overflow)
+                  : llvm::jitTargetAddressToFunction<CalcJIT::EvalFn<T>>(Addr)(Vals);
+        printRow(V, Overflow, NumOverflows);
+      }))
+    return Res;
+  return reportOverflows(NumOverflows);
+}
+
+static int runEntry(ValueType Ty, llvm::JITTargetAddress Addr, unsigned NumVars,
+                    bool IsBatch, bool IsChecked) {
+  switch (Ty) {
+  case ValueType::I32:
+    return runEntry<int32_t>(Addr, NumVars, IsBatch, IsChecked);
+  case ValueType::I64:
+    return runEntry<int64_t>(Addr, NumVars, IsBatch, IsChecked);
+  case ValueType::F32:
+    return runEntry<float>(Addr, NumVars, IsBatch, IsChecked);
+  case ValueType::F64:
+    return runEntry<double>(Addr, NumVars, IsBatch, IsChecked);
+  }
+  llvm_unreachable("Unknown value type");
+}
+
+// Load the catalog given with -load-catalog and run the entry selected with
+// -entry. Only the code of that entry is linked.
+static int runPrecompiledCatalog() {
+  if (EntryName.empty()) {
+    llvm::errs() << "calc: -load-catalog requires -entry\n";
+    return 1;
+  }
+  auto JIT = CalcJIT::create(OptLevel);
+  if (!JIT)
+    return reportError(JIT.takeError());
+  auto Catalog = [&] {
+    PhaseTimer Timer("load", "Loading the precompiled catalog", TimePhases);
+    return PrecompiledCatalog::open(LoadCatalog, **JIT);
+  }();
+  if (!Catalog)
+    return reportError(Catalog.takeError());
+  const PrecompiledCatalog::Entry *E = (*Catalog)->find(EntryName);
+  if (!E) {
+    llvm::errs() << "calc: " << LoadCatalog << ": no entry " << EntryName << "\n";
+    return 1;
+  }
+  auto Addr = (*Catalog)->lookup(EntryName);
+  if (!Addr)
+    return reportError(Addr.takeError());
+
+  PhaseTimer Timer("run", "Running the generated code", TimePhases);
+  if (!(*Catalog)->isBatch() && !(*Catalog)->isEval())
+    return writeProfile(llvm::jitTargetAddressToFunction<CalcJIT::MainFnTy>(*Addr)(0, nullptr));
+  return writeProfile(runEntry((*Catalog)->getType(), *Addr, E->Vars.size(),
+                               (*Catalog)->isBatch(), (*Catalog)->isChecked()));
+}
+
+// Compile the expressions to bytecode and write the file given with -o.
+static int writeBytecode(llvm::ArrayRef<CatalogEntry> Entries) {
+  return writeOutput([&](llvm::raw_ostream &OS) {
+    BytecodeBuilder Builder(Type);
+    Builder.add(Entries);
+    Builder.write(OS);
+    return llvm::Error::success();
+  });
+}
+
+// Compile a whole catalog with the JIT and run the entry selected by -entry.
+static int runCatalogJIT(llvm::ArrayRef<CatalogEntry> Entries,
+                         CodeGen &CodeGenerator) {
+  auto JIT = CalcJIT::create(OptLevel);
+  if (!JIT)
+    return reportError(JIT.takeError());
+  auto JD = (*JIT)->createDylib("catalog");
+  if (!JD)
+    return reportError(JD.takeError());
+  // Each shard is a module of its own in the dylib.
+  auto Shards = CodeGenerator.generateShards(Entries, NumThreads);
+  if (!Shards)
+    return reportError(Shards.takeError());
+  for (auto &Shard : *Shards)
+    if (auto Err = (*JIT)->addModule(*JD, std::move(Shard)))
+      return reportError(std::move(Err));
+
+  if (Batch)
+    return writeProfile(runBatch(**JIT, *JD, EntryName));
+  auto Addr = (*JIT)->lookup(*JD, EntryName);
+  if (!Addr)
+    return reportError(Addr.takeError());
+  if (Eval) {
+    // The lookup succeeded, so the entry exists.
+    auto *E = llvm::find_if(Entries, [](const CatalogEntry &E) { return E.Name == EntryName; });
+    auto *W = llvm::dyn_cast<WithDecl>(E->Tree);
+    return writeProfile(
+        runEntry(Type, *Addr, W ? W->getVars().size() : 0, /*IsBatch=*/false, Checked));
+  }
+  return writeProfile(llvm::jitTargetAddressToFunction<CalcJIT::MainFnTy>(*Addr)(0, nullptr));
+}
+
+// Check the input expression, or the catalog file given with -catalog, with
+// -verify-only.
+static int verifyOnly() {
+  std::unique_ptr<llvm::MemoryBuffer> Buf;
+  if (CatalogFile.empty()) {
+    Buf = llvm::MemoryBuffer::getMemBuffer(Input, "<input>", /*RequiresNullTerminator=*/false);
+  } else {
+    // Mapped like the catalogs that are compiled.
+    auto File = llvm::MemoryBuffer::getFileOrSTDIN(CatalogFile, /*IsText=*/false,
+                                                   /*RequiresNullTerminator=*/false);
+    if (!File) {
+      llvm::errs() << "calc: cannot read " << CatalogFile << ": "
+                   << File.getError().message() << "\n";
+      return 1;
+    }
+    Buf = std::move(*File);
+  }
+  llvm::MemoryBufferRef Ref = Buf->getMemBufferRef();
+  llvm::SourceMgr SrcMgr;
+  SrcMgr.AddNewSourceBuffer(std::move(Buf), llvm::SMLoc());
+
+  PhaseTimer Timer("verify", "Verifying", TimePhases);
+  ASTContext Ctx;  // Stays empty.
+  Lexer Lex(Ref);
+  Parser Parser(Lex, Ctx, &SrcMgr);
+  if (CatalogFile.empty())
+    Parser.verify(Type);
+  else
+    Parser.verifyCatalog(Type);
+  if (Parser.hasError())
+    llvm::errs() << "Syntax errors occured\n";
+  if (Parser.hasSemanticError())
+    llvm::errs() << "Semantic errors occured\n";
+  return Parser.hasError() || Parser.hasSemanticError();
+}
+
+// Compile the catalog file given with -catalog.
+static int compileCatalog() {
+  // Large files are mapped into memory instead of being read. The lexer does
+  // not need a NUL terminator, which would force a copy of files whose size
+  // is a multiple of the page size.
+  auto Buf = llvm::MemoryBuffer::getFileOrSTDIN(CatalogFile, /*IsText=*/false,
+                                                /*RequiresNullTerminator=*/false);
+  if (!Buf) {
+    llvm::errs() << "calc: cannot read " << CatalogFile << ": "
+                 << Buf.getError().message() << "\n";
+    return 1;
+  }
+
+  ASTContext Ctx(CSE);
+  llvm::SmallVector<CatalogEntry, 0> Entries;
+  if (!parseCatalog((*Buf)->getMemBufferRef(), Ctx, Entries))
+    return 1;
+
+  if (Emit == EmitKind::CalcBytecode)
+    return writeBytecode(Entries);
+  if (Emit == EmitKind::PrecompiledCatalog)
+    return writeOutput([&](llvm::raw_ostream &OS) {
+      return PrecompiledCatalog::write(Entries, getCodeGenOptions(), NumThreads, OS);
+    });
+
+  auto TM = CodeGen::createHostTargetMachine(OptLevel);
+  if (!TM)
+    return reportError(TM.takeError());
+  CodeGen CodeGenerator(getCodeGenOptions(), TM->get());
+  if (Jit) {
+    if (EntryName.empty()) {
+      llvm::errs() << "calc: -jit with -catalog requires -entry\n";
+      return 1;
+    }
+    return runCatalogJIT(Entries, CodeGenerator);
+  }
+  if (NumThreads == 1)
+    return writeOutput([&](llvm::raw_ostream &OS) {
+      return CodeGenerator.compile(Entries, Emit, OS);
+    });
+
+  // Generate and optimize the shards in parallel. The linked module is
+  // written out as a whole.
+  llvm::LLVMContext LLVMCtx;
+  auto M = CodeGenerator.generateParallel(Entries, NumThreads, LLVMCtx);
+  if (!M)
+    return reportError(M.takeError());
+  return writeOutput([&](llvm::raw_ostream &OS) {
+    return CodeGenerator.emit(**M, Emit, OS);
+  });
+}
+
+// Print the statistics requested with LLVM's -stats or -stats-json option.
+// A release build of LLVM does not print statistics on exit, but reports
+// that they are disabled instead. Calc prints them itself and switches the
+// options off afterwards, so they are never reported twice.
+static void printStatistics() {
+  llvm::StringMap<llvm::cl::Option *> &Opts = llvm::cl::getRegisteredOptions();
+  auto *Stats = static_cast<llvm::cl::opt<bool, true> *>(Opts.lookup("stats"));
+  auto *StatsJSON = static_cast<llvm::cl::opt<bool, true> *>(Opts.lookup("stats-json"));
+  if (!Stats || !*Stats)
+    return;
+
+  // The JSON output also contains the values of all timers.
+  if (StatsJSON && *StatsJSON)
+    llvm::PrintStatisticsJSON(llvm::errs());
+  else
+    llvm::PrintStatistics(llvm::errs());
+  Stats->setValue(false);
+}
+
 // The main function drives the compilation process.
 int main(int argc, const char **argv) {
   // Initialize the LLVM environment with command-line arguments.
@@ -20,35 +879,87 @@ int main(int argc, const char **argv) {
   // This processes the input expression provided via the command line.
   llvm::cl::ParseCommandLineOptions(
       argc, argv, "calc - the expression compiler\n");  // Displays the name and description for the tool.
+  auto ReportStatistics = llvm::make_scope_exit(printStatistics);
 
-  // Step 1: Lexical Analysis
-  // The lexer takes the input expression and breaks it into tokens.
-  Lexer Lex(Input);
+  // Only calc_batch and calc_eval return their overflows.
+  if (Checked && (!(Batch || Eval) || Incremental || Tiered || !VMFile.empty() ||
+                  Emit == EmitKind::CalcBytecode)) {
+    llvm::errs() << "calc: -checked requires -batch or -eval, and code generated "
+                    "with LLVM\n";
+    return 1;
+  }
 
-  // Step 2: Parsing
-  // The parser takes the tokens from the lexer and produces an Abstract Syntax Tree (AST).
-  Parser Parser(Lex);
-  AST *Tree = Parser.parse();  // Parse the input and get the AST.
-  
-  // Check if the parsing resulted in any errors or if the AST is null.
-  if (!Tree || Parser.hasError()) {
-    llvm::errs() << "Syntax errors occured\n";  // Report syntax errors if found.
-    return 1;  // Exit with an error code.
+  // The values are recorded by, and specialized for in, code generated with
+  // LLVM, and only integers are.
+  if ((Instrument || !ProfileUse.empty()) &&
+      (isFloatType(Type) || Incremental || Tiered || !VMFile.empty() ||
+       Emit == EmitKind::CalcBytecode)) {
+    llvm::errs() << "calc: -instrument and -profile-use require an integer type, "
+                    "and code generated with LLVM\n";
+    return 1;
+  }
+  if (Instrument && !ProfileUse.empty()) {
+    llvm::errs() << "calc: -instrument cannot be used with -profile-use\n";
+    return 1;
+  }
+  if (!ProfileUse.empty()) {
+    auto P = ValueProfile::read(ProfileUse);
+    if (!P)
+      return reportError(P.takeError());
+    Profile = std::move(*P);
   }
 
-  // Step 3: Semantic Analysis
-  // Perform semantic analysis to ensure correctness (e.g., all variables are declared).
-  Sema Semantic;
-  if (Semantic.semantic(Tree)) {
-    llvm::errs() << "Semantic errors occured\n";  // Report semantic errors if found.
+  if (VerifyOnly)
+    return verifyOnly();
+
+  if (!CatalogFile.empty())
+    return compileCatalog();
+
+  if (Incremental)
+    return runIncremental();
+
+  if (!LoadCatalog.empty())
+    return runPrecompiledCatalog();
+
+  if (!VMFile.empty())
+    return runVM();
+
+  if (Tiered)
+    return runTiered();
+
+  // With -jit, run the generated code directly instead of printing it.
+  if (Jit && Eval) {
+    llvm::errs() << "calc: -eval code cannot be run with -jit\n";
+    return 1;
+  }
+  if (Jit)
+    return runJIT();
+
+  ASTContext Ctx(CSE);  // Owns the AST until the end of the compilation.
+  FlatAST FlatTree;
+  AST *Tree = parseInput(Input, Ctx, Flat ? &FlatTree : nullptr);
+  if (!Tree)
     return 1;  // Exit with an error code.
+
+  if (Emit == EmitKind::PrecompiledCatalog) {
+    llvm::errs() << "calc: -emit=pcat requires -catalog\n";
+    return 1;
   }
 
+  // Bytecode is compiled from the AST, without LLVM.
+  if (Emit == EmitKind::CalcBytecode)
+    return writeBytecode(CatalogEntry{"calc_eval", Tree, {}});
+
   // Step 4: Code Generation
-  // If the syntax and semantics are correct, generate the LLVM IR code.
-  CodeGen CodeGenerator;
-  CodeGenerator.compile(Tree);  // Compile the AST to LLVM IR and print the generated code.
+  // If the syntax and semantics are correct, generate the LLVM IR code for the host.
+  auto TM = CodeGen::createHostTargetMachine(OptLevel);
+  if (!TM)
+    return reportError(TM.takeError());
+  CodeGen CodeGenerator(getCodeGenOptions(), TM->get());
 
-  return 0;  // Return 0 to indicate success.
+  // Compile the AST and write the generated code.
+  return writeOutput([&](llvm::raw_ostream &OS) {
+    return Flat ? CodeGenerator.compile(FlatTree, Emit, OS)
+                : CodeGenerator.compile(Tree, Emit, OS);
+  });
 }
-
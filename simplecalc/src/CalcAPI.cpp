@@ -0,0 +1,126 @@
+#include "CalcAPI.h"
+#include "Session.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+using namespace llvm;
+
+static_assert(CALC_I32 == static_cast<int>(ValueType::I32) &&
+                  CALC_I64 == static_cast<int>(ValueType::I64) &&
+                  CALC_F32 == static_cast<int>(ValueType::F32) &&
+                  CALC_F64 == static_cast<int>(ValueType::F64),
+              "calc_value_type and ValueType must agree");
+
+struct calc_session {
+  std::unique_ptr<CalcSession> Session;
+  std::mutex Mutex;                     // Serializes compiling and disposing.
+  SmallPtrSet<calc_expr *, 16> Exprs;   // Not disposed yet.
+};
+
+struct calc_expr {
+  calc_session *Owner;
+  CompiledExpr Code;  // Its variables are the slots.
+};
+
+// Store the message of an error in *Error, if it is given.
+static void setError(Error Err, char **ErrorMsg) {
+  std::string Msg = toString(std::move(Err));
+  if (ErrorMsg)
+    *ErrorMsg = strdup(Msg.c_str());
+}
+
+calc_session *calc_session_create(calc_value_type type, unsigned opt_level,
+                                  size_t cache_size, char **error) {
+  if (type < CALC_I32 || type > CALC_F64) {
+    setError(createStringError(inconvertibleErrorCode(), "unknown value type %d", type),
+             error);
+    return nullptr;
+  }
+  if (opt_level > 3) {
+    setError(createStringError(inconvertibleErrorCode(),
+                               "invalid optimization level %u", opt_level),
+             error);
+    return nullptr;
+  }
+  CodeGenOptions Opts;
+  Opts.Eval = true;
+  Opts.Type = static_cast<ValueType>(type);
+  Opts.OptLevel = opt_level;
+  auto Session = CalcSession::create(Opts, cache_size);
+  if (!Session) {
+    setError(Session.takeError(), error);
+    return nullptr;
+  }
+  calc_session *S = new calc_session;
+  S->Session = std::move(*Session);
+  return S;
+}
+
+void calc_session_dispose(calc_session *session) {
+  if (!session)
+    return;
+  // Destroying the session's JIT frees the code of all expressions.
+  for (calc_expr *E : session->Exprs)
+    delete E;
+  delete session;
+}
+
+calc_expr *calc_session_compile(calc_session *session, const char *source,
+                                char **error) {
+  std::lock_guard<std::mutex> Lock(session->Mutex);
+  auto Code = session->Session->compileJIT(source);
+  if (!Code) {
+    setError(Code.takeError(), error);
+    return nullptr;
+  }
+  calc_expr *E = new calc_expr{session, std::move(*Code)};
+  session->Exprs.insert(E);
+  return E;
+}
+
+void calc_expr_dispose(calc_expr *expr) {
+  if (!expr)
+    return;
+  calc_session *S = expr->Owner;
+  std::lock_guard<std::mutex> Lock(S->Mutex);
+  if (Error Err = S->Session->release(expr->Code))
+    logAllUnhandledErrors(std::move(Err), errs(), "calc: ");
+  S->Exprs.erase(expr);
+  delete expr;
+}
+
+size_t calc_expr_num_slots(const calc_expr *expr) { return expr->Code.Vars.size(); }
+
+const char *calc_expr_slot_name(const calc_expr *expr, size_t slot) {
+  return slot < expr->Code.Vars.size() ? expr->Code.Vars[slot].c_str() : nullptr;
+}
+
+// Return the entry point of an expression if its session computes with Ty.
+template <typename T>
+static CalcJIT::EvalFn<T> getEvalFn(const calc_expr *Expr, ValueType Ty) {
+  // The type is fixed when the session is created, so reading the options
+  // needs no lock.
+  if (Expr->Owner->Session->getOptions().Type != Ty)
+    return nullptr;
+  return reinterpret_cast<CalcJIT::EvalFn<T>>(Expr->Code.Entry);
+}
+
+calc_eval_i32_fn calc_expr_i32(const calc_expr *expr) {
+  return getEvalFn<int32_t>(expr, ValueType::I32);
+}
+
+calc_eval_i64_fn calc_expr_i64(const calc_expr *expr) {
+  return getEvalFn<int64_t>(expr, ValueType::I64);
+}
+
+calc_eval_f32_fn calc_expr_f32(const calc_expr *expr) {
+  return getEvalFn<float>(expr, ValueType::F32);
+}
+
+calc_eval_f64_fn calc_expr_f64(const calc_expr *expr) {
+  return getEvalFn<double>(expr, ValueType::F64);
+}
+
+void calc_error_dispose(char *error) { free(error); }
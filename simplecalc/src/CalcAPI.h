@@ -0,0 +1,85 @@
+#ifndef CALCAPI_H
+#define CALCAPI_H
+
+// The C interface of calc, for programs that evaluate expressions from many
+// threads, e.g. a pool of request handlers.
+//
+// A session compiles expressions with the JIT into pure functions,
+//
+//   T calc_eval(const T *slots);
+//
+// with one input slot per variable of the expression's 'with' declaration,
+// in the order of their declaration. The functions read only their slots and
+// neither call the runtime nor touch any global state, so any number of
+// threads may call them at once, and the same function with different slots,
+// without locking. A function stays valid until its expression is disposed.
+//
+// The functions of a session (compiling and disposing) are serialized by a
+// lock of the session; they may be called from any thread, but compiling
+// many expressions in parallel needs a session per thread.
+//
+// Functions that can fail return NULL and, if error is not NULL, store a
+// message in *error, which the caller frees with calc_error_dispose.
+// Syntax and semantic errors are also reported on stderr.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The value type of a session; the same as ValueType.
+typedef enum {
+  CALC_I32,
+  CALC_I64,
+  CALC_F32,
+  CALC_F64
+} calc_value_type;
+
+typedef struct calc_session calc_session;
+typedef struct calc_expr calc_expr;
+
+typedef int32_t (*calc_eval_i32_fn)(const int32_t *slots);
+typedef int64_t (*calc_eval_i64_fn)(const int64_t *slots);
+typedef float (*calc_eval_f32_fn)(const float *slots);
+typedef double (*calc_eval_f64_fn)(const double *slots);
+
+// Create a session compiling for the given type at the given optimization
+// level (0-3). The session keeps the code of up to cache_size expressions,
+// so compiling an expression again, even formatted differently, returns its
+// code without compiling it; expressions that are not disposed yet are never
+// dropped. A cache_size of 0 disables the cache.
+calc_session *calc_session_create(calc_value_type type, unsigned opt_level,
+                                  size_t cache_size, char **error);
+
+// Dispose a session and the code of all its expressions that have not been
+// disposed yet. No thread may be calling such code any more.
+void calc_session_dispose(calc_session *session);
+
+// Compile an expression.
+calc_expr *calc_session_compile(calc_session *session, const char *source,
+                                char **error);
+
+// Free the code of an expression, or return it to the cache of its session.
+// No thread may be calling it any more.
+void calc_expr_dispose(calc_expr *expr);
+
+// The number of input slots of an expression, and the name of each.
+size_t calc_expr_num_slots(const calc_expr *expr);
+const char *calc_expr_slot_name(const calc_expr *expr, size_t slot);
+
+// The compiled function of an expression, or NULL if the session has another
+// value type.
+calc_eval_i32_fn calc_expr_i32(const calc_expr *expr);
+calc_eval_i64_fn calc_expr_i64(const calc_expr *expr);
+calc_eval_f32_fn calc_expr_f32(const calc_expr *expr);
+calc_eval_f64_fn calc_expr_f64(const calc_expr *expr);
+
+void calc_error_dispose(char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,11 +1,37 @@
 #include "CodeGen.h"
-#include "llvm/ADT/StringMap.h"       // StringMap for tracking variable bindings (name to LLVM value).
+#include "JIT.h"                      // In-process execution of the generated code.
+#include "Phases.h"                   // Timers for the code generation phases.
+#include "Profile.h"                  // The values to specialize for.
+#include "ProfileRuntime.h"           // The layout of the records of instrumented code.
+#include "llvm/ADT/DenseMap.h"        // The values of common subexpressions.
+#include "llvm/ADT/STLExtras.h"       // zip() over names and symbols.
+#include "llvm/ADT/StringExtras.h"    // utohexstr() for the key of a profile.
+#include "llvm/ADT/Statistic.h"       // Counters reported with -stats.
 #include "llvm/IR/IRBuilder.h"        // IRBuilder is used to generate LLVM instructions.
 #include "llvm/IR/LLVMContext.h"      // LLVMContext provides a context for the generated IR.
+#include "llvm/IR/MDBuilder.h"        // Weights of the branches to specialized code.
+#include "llvm/Bitcode/BitcodeReader.h" // Moving shards between contexts.
+#include "llvm/Bitcode/BitcodeWriter.h" // Writing bitcode.
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h" // Detecting the host target.
+#include "llvm/IR/LegacyPassManager.h" // The code generator still runs on the legacy pass manager.
+#include "llvm/Linker/Linker.h"      // Linking the shards of a catalog.
+#include "llvm/Passes/PassBuilder.h"  // The new pass manager's default pipelines.
+#include "llvm/Passes/StandardInstrumentations.h" // -time-passes and friends.
+#include "llvm/Support/ThreadPool.h"  // Worker threads for parallel compilation.
+#include "llvm/Support/TargetSelect.h" // Native target initialization.
 #include "llvm/Support/raw_ostream.h" // For printing IR and debugging.
+#include <algorithm>
+#include <mutex>
 
 using namespace llvm;  // Import the LLVM namespace for easier access to LLVM types and functions.
 
+#define DEBUG_TYPE "calc-codegen"
+
+ALWAYS_ENABLED_STATISTIC(NumFunctions, "Number of functions generated");
+ALWAYS_ENABLED_STATISTIC(NumInstructions, "Number of IR instructions emitted");
+
+static Value *emitInvalidDivision(IRBuilderBase &Builder, Value *Left, Value *Right);
+
 namespace {
 
 // ToIRVisitor class is responsible for visiting AST nodes and generating corresponding LLVM IR.
@@ -16,112 +42,1153 @@ class ToIRVisitor : public ASTVisitor {
   Type *Int32Ty;            // LLVM type representing 32-bit integers.
   PointerType *PtrTy;       // LLVM type representing a generic pointer.
   Constant *Int32Zero;      // Constant representing the integer value 0 in 32-bit form.
+  ValueType ValTy;          // The type the expression computes with.
+  Type *ValueTy;            // Its LLVM type: i32, i64, float or double.
+  PointerType *ValuePtrTy;  // LLVM type representing a pointer to values.
 
   Value *V;                 // Current LLVM Value being generated (result of evaluating expressions).
-  StringMap<Value *> nameMap;  // Map from variable names to LLVM values (used for tracking variables).
+  // Values of the variables, indexed by symbol ID. The table is shared by all
+  // functions generated for a module; Bound lists the entries to clear again.
+  std::vector<Value *> &SymValues;
+  SmallVector<uint32_t, 8> Bound;
+
+  // The values of the shared operations emitted so far. An operation with
+  // several parents, i.e. a common subexpression, is emitted only once.
+  DenseMap<Expr *, Value *> Emitted;
+
+  StringRef FnName;         // Name of the generated function.
+
+  // State used when generating 'calc_batch' instead of 'main'.
+  bool Batch;               // Generate the batch entry point.
+  BasicBlock *EntryBB = nullptr;  // Entry block of calc_batch, for loop-invariant code.
+  Value *Cols = nullptr;    // The 'cols' argument: one pointer per 'with' variable.
+  Value *Row = nullptr;     // The current row index inside the loop.
+  unsigned NumCols = 0;     // Number of columns read by the expression.
+
+  // State used when generating 'main' for the bulk runtime, or 'calc_eval'.
+  bool Bulk;                // Read the variables with calc_read_bulk.
+  bool Eval;                // Generate the calc_eval entry point.
+  Value *RowBuf = nullptr;  // The buffer calc_read_bulk reads a row into, or
+                            // the argument array of calc_eval.
+
+  // State used when checking calc_batch or calc_eval for overflow.
+  bool Checked;             // Check the integer operations.
+  Value *Overflow = nullptr;  // The flag of the operations emitted so far,
+                              // nullptr for none.
+
+  // State used when generating code that wraps around (see CodeGenOptions).
+  bool Wrapping;            // Wrap around and guard the divisions.
+  BasicBlock *DivErrorBB = nullptr; // The block calling calc_div_error.
+
+  // State used when instrumenting, or specializing for a value profile.
+  StringRef ProfileName;    // The name of the function in the profile.
+  bool Instrument;          // Record the values of the variables.
+  const ValueProfile *Profile;
+  // The variables the specialized code is folded for, by index, with their values.
+  SmallVector<std::pair<unsigned, int64_t>, 4> Folded;
+  bool Specialized = false; // Emitting the specialized loop of calc_batch.
 
 public:
   // Constructor for the ToIRVisitor, initializes types and constants.
-  ToIRVisitor(Module *M) : M(M), Builder(M->getContext()) {
+  // Several visitors can add functions with different names to one module.
+  ToIRVisitor(Module *M, const CodeGenOptions &Opts, StringRef FnName,
+              StringRef ProfileName, std::vector<Value *> &SymValues)
+      : M(M), Builder(M->getContext()), ValTy(Opts.Type), SymValues(SymValues),
+        FnName(FnName), Batch(Opts.Batch),
+        Bulk(!Opts.Batch && !Opts.Eval && Opts.Runtime == RuntimeKind::Bulk),
+        Eval(!Opts.Batch && Opts.Eval), Checked(Opts.Checked && (Opts.Batch || Opts.Eval)),
+        Wrapping(Opts.Wrapping && !Checked), ProfileName(ProfileName), Instrument(Opts.Instrument && !isFloatType(Opts.Type)),
+        Profile(Opts.Instrument || isFloatType(Opts.Type) ? nullptr : Opts.Profile) {
     // Initialize common LLVM types and constants.
     VoidTy = Type::getVoidTy(M->getContext());      // Void type.
     Int32Ty = Type::getInt32Ty(M->getContext());    // 32-bit integer type.
-    PtrTy = PointerType::getUnqual(M->getContext()); // Generic pointer type.
+    // Pointer types are built from their element type, which yields 'ptr' with
+    // opaque pointers and still gives valid IR for typed-pointer LLVM releases.
+    PtrTy = PointerType::getUnqual(Type::getInt8Ty(M->getContext())); // Generic pointer type.
     Int32Zero = ConstantInt::get(Int32Ty, 0, true); // Constant 0 for return in main.
+    ValueTy = CodeGen::getValueType(M->getContext(), ValTy);
+    ValuePtrTy = PointerType::getUnqual(ValueTy);
+  }
+
+  // Clear the values bound by this function; they belong to its body.
+  ~ToIRVisitor() {
+    for (uint32_t Sym : Bound)
+      SymValues[Sym] = nullptr;
   }
 
   // Runs the code generation process for the entire AST.
   void run(AST *Tree) {
+    if (auto *Decl = dyn_cast<WithDecl>(Tree))
+      planSpecialization(*Decl);
+    run([&] { Tree->accept(*this); });  // Visit the root of the AST to generate code for it.
+  }
+
+  // Runs the code generation process for the flat encoding of an AST.
+  void run(const FlatAST &Flat) {
+    run([&] {
+      bindVars(Flat.getVars(), Flat.getVarSymbols());
+      V = emitFlat(Flat);
+    });
+  }
+
+private:
+  // Generates the entry point; EmitBody generates the code computing 'V'.
+  void run(function_ref<void()> EmitBody) {
+    if (Batch) {
+      runBatch(EmitBody);
+      return;
+    }
+    if (Bulk) {
+      runBulk(EmitBody);
+      return;
+    }
+    if (Eval) {
+      runEval(EmitBody);
+      return;
+    }
+
     // Define the 'main' function with signature: int main(int, char**)
     FunctionType *MainFty = FunctionType::get(Int32Ty, {Int32Ty, PtrTy}, false);
-    Function *MainFn = Function::Create(MainFty, GlobalValue::ExternalLinkage, "main", M);
+    Function *MainFn = Function::Create(MainFty, GlobalValue::ExternalLinkage, FnName, M);
     BasicBlock *BB = BasicBlock::Create(M->getContext(), "entry", MainFn);
     Builder.SetInsertPoint(BB);  // Set the insertion point for IR generation in the entry block.
 
-    // Visit the root of the AST to generate code for it.
-    Tree->accept(*this);
+    EmitBody();
 
-    // Declare an external function 'calc_write(int)' and generate a call to it with the result 'V'.
-    FunctionType *CalcWriteFnTy = FunctionType::get(VoidTy, {Int32Ty}, false);
-    Function *CalcWriteFn = Function::Create(CalcWriteFnTy, GlobalValue::ExternalLinkage, "calc_write", M);
-    Builder.CreateCall(CalcWriteFnTy, CalcWriteFn, {V});
+    // Declare an external function 'calc_write(int)' (or its variant for the value type)
+    // and generate a call to it with the result 'V'.
+    // The declaration is shared by all functions of the module.
+    FunctionCallee CalcWriteFn = M->getOrInsertFunction(
+        CodeGen::getRuntimeName("calc_write", ValTy),
+        FunctionType::get(VoidTy, {ValueTy}, false));
+    Builder.CreateCall(CalcWriteFn, {V});
 
     // Return 0 from the 'main' function.
     Builder.CreateRet(Int32Zero);
   }
 
+  // Generates the batch entry point, which evaluates the expression once per row:
+  //   void calc_batch(const T *const *cols, T *out, size_t n)
+  // where T is the value type. Column k holds the values of the k-th 'with'
+  // variable. The loop body is straight-line code, so the loop vectorizer can
+  // turn it into SIMD code with as many lanes as T allows.
+  // With overflow checks, the flag of each row is stored in a fourth
+  // argument, uint8_t *overflow.
+  // Code specialized for a profile has a second copy of the loop, with the
+  // folded variables as constants, which runs if a first pass over their
+  // columns finds no other values.
+  void runBatch(function_ref<void()> EmitBody) {
+    LLVMContext &Ctx = M->getContext();
+    Type *SizeTy = M->getDataLayout().getIntPtrType(Ctx);  // size_t.
+    SmallVector<Type *, 4> Params = {PointerType::getUnqual(ValuePtrTy), ValuePtrTy, SizeTy};
+    if (Checked)
+      Params.push_back(PtrTy);
+    FunctionType *BatchFty = FunctionType::get(VoidTy, Params, false);
+    Function *BatchFn = Function::Create(BatchFty, GlobalValue::ExternalLinkage, FnName, M);
+    // The columns are only read and the output does not alias them, which
+    // saves the vectorizer from emitting runtime alias checks.
+    BatchFn->addParamAttr(0, Attribute::NoCapture);
+    BatchFn->addParamAttr(0, Attribute::ReadOnly);
+    BatchFn->addParamAttr(1, Attribute::NoAlias);
+    BatchFn->addParamAttr(1, Attribute::NoCapture);
+    BatchFn->addParamAttr(1, Attribute::WriteOnly);
+    if (Checked) {
+      BatchFn->addParamAttr(3, Attribute::NoAlias);
+      BatchFn->addParamAttr(3, Attribute::NoCapture);
+      BatchFn->addParamAttr(3, Attribute::WriteOnly);
+    }
+    Cols = BatchFn->getArg(0);
+    Value *Out = BatchFn->getArg(1);
+    Value *N = BatchFn->getArg(2);
+    Value *Flags = Checked ? BatchFn->getArg(3) : nullptr;
+
+    EntryBB = BasicBlock::Create(Ctx, "entry", BatchFn);
+    BasicBlock *ExitBB = BasicBlock::Create(Ctx, "exit", BatchFn);
+    BasicBlock *GuardBB = nullptr, *GuardDoneBB = nullptr, *SpecializedBB = nullptr;
+    if (!Folded.empty()) {
+      GuardBB = BasicBlock::Create(Ctx, "guard", BatchFn, ExitBB);
+      GuardDoneBB = BasicBlock::Create(Ctx, "guard.done", BatchFn, ExitBB);
+      Specialized = true;
+      SpecializedBB = emitBatchLoop(EmitBody, Out, Flags, N, GuardDoneBB, ExitBB,
+                                    "loop.specialized");
+      Specialized = false;
+    }
+    BasicBlock *LoopBB = emitBatchLoop(EmitBody, Out, Flags, N,
+                                       GuardDoneBB ? GuardDoneBB : EntryBB, ExitBB, "loop");
+    if (GuardBB)
+      emitBatchGuard(N, GuardBB, GuardDoneBB, SpecializedBB, LoopBB);
+
+    // Skip the loop entirely for an empty batch.
+    Builder.SetInsertPoint(EntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(N, ConstantInt::get(SizeTy, 0)), ExitBB,
+                         GuardBB ? GuardBB : LoopBB);
+
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateRetVoid();
+
+    // Export the number of columns, so callers can check their input.
+    new GlobalVariable(*M, Int32Ty, /*isConstant=*/true, GlobalValue::ExternalLinkage,
+                       ConstantInt::get(Int32Ty, NumCols), FnName + "_columns");
+  }
+
+  // Emits a loop of calc_batch over the rows, entered from PredBB, and
+  // returns its header.
+  BasicBlock *emitBatchLoop(function_ref<void()> EmitBody, Value *Out, Value *Flags,
+                            Value *N, BasicBlock *PredBB, BasicBlock *ExitBB,
+                            const Twine &Name) {
+    Type *SizeTy = N->getType();
+    BasicBlock *LoopBB = BasicBlock::Create(M->getContext(), Name, ExitBB->getParent(), ExitBB);
+
+    // The row counter runs from 0 to n - 1.
+    Builder.SetInsertPoint(LoopBB);
+    PHINode *Phi = Builder.CreatePHI(SizeTy, 2, "row");
+    Row = Phi;
+
+    // Generate the loop body.
+    NumCols = 0;
+    Emitted.clear();
+    Overflow = nullptr;
+    EmitBody();
+
+    // Store the result and advance to the next row.
+    Builder.CreateStore(V, Builder.CreateInBoundsGEP(ValueTy, Out, Row));
+    if (Flags)
+      storeOverflow(Builder.CreateInBoundsGEP(Builder.getInt8Ty(), Flags, Row));
+    Value *Next = Builder.CreateNUWAdd(Row, ConstantInt::get(SizeTy, 1), "row.next");
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Next, N), ExitBB, LoopBB);
+    BasicBlock *LatchBB = Builder.GetInsertBlock();
+
+    Phi->addIncoming(ConstantInt::get(SizeTy, 0), PredBB);
+    Phi->addIncoming(Next, LatchBB);
+    return LoopBB;
+  }
+
+  // Emits the pass over the columns of the folded variables that selects the
+  // loop of calc_batch. It ors the bits in which the values differ from the
+  // constants into one value, a reduction the loop vectorizer handles.
+  void emitBatchGuard(Value *N, BasicBlock *GuardBB, BasicBlock *GuardDoneBB,
+                      BasicBlock *SpecializedBB, BasicBlock *LoopBB) {
+    Type *SizeTy = N->getType();
+    IRBuilder<> EntryBuilder(EntryBB);
+    Builder.SetInsertPoint(GuardBB);
+    PHINode *Phi = Builder.CreatePHI(SizeTy, 2, "guard.row");
+    PHINode *Acc = Builder.CreatePHI(ValueTy, 2, "guard.acc");
+    Value *Diff = Acc;
+    for (auto [Var, Val] : Folded) {
+      Value *ColPtr = EntryBuilder.CreateLoad(
+          ValuePtrTy, EntryBuilder.CreateConstInBoundsGEP1_64(ValuePtrTy, Cols, Var));
+      Value *Col = Builder.CreateLoad(ValueTy, Builder.CreateInBoundsGEP(ValueTy, ColPtr, Phi));
+      Diff = Builder.CreateOr(Diff, Builder.CreateXor(Col, ConstantInt::get(ValueTy, Val, true)));
+    }
+    Value *Next = Builder.CreateNUWAdd(Phi, ConstantInt::get(SizeTy, 1));
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Next, N), GuardDoneBB, GuardBB);
+    Phi->addIncoming(ConstantInt::get(SizeTy, 0), EntryBB);
+    Phi->addIncoming(Next, GuardBB);
+    Acc->addIncoming(ConstantInt::get(ValueTy, 0), EntryBB);
+    Acc->addIncoming(Diff, GuardBB);
+
+    Builder.SetInsertPoint(GuardDoneBB);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(Diff, ConstantInt::get(ValueTy, 0)),
+                         SpecializedBB, LoopBB);
+  }
+
+  // Generates 'main' for the bulk runtime, which evaluates the expression once
+  // per row of the input:
+  //   calc_bulk_open(argc, argv);
+  //   while (calc_read_bulk(row, n)) calc_write_bulk(<expression>);
+  //   return calc_bulk_close();
+  void runBulk(function_ref<void()> EmitBody) {
+    LLVMContext &Ctx = M->getContext();
+    FunctionType *MainFty = FunctionType::get(Int32Ty, {Int32Ty, PtrTy}, false);
+    Function *MainFn = Function::Create(MainFty, GlobalValue::ExternalLinkage, FnName, M);
+    EntryBB = BasicBlock::Create(Ctx, "entry", MainFn);
+    BasicBlock *ReadBB = BasicBlock::Create(Ctx, "read", MainFn);
+    BasicBlock *RowBB = BasicBlock::Create(Ctx, "row", MainFn);
+    BasicBlock *ExitBB = BasicBlock::Create(Ctx, "exit", MainFn);
+
+    Builder.SetInsertPoint(EntryBB);
+    FunctionCallee OpenFn = M->getOrInsertFunction(
+        "calc_bulk_open", FunctionType::get(VoidTy, {Int32Ty, PtrTy}, false));
+    Builder.CreateCall(OpenFn, {MainFn->getArg(0), MainFn->getArg(1)});
+
+    // The body comes first: it allocates the row buffer, whose size the call
+    // reading the row needs.
+    Builder.SetInsertPoint(RowBB);
+    EmitBody();
+    FunctionCallee WriteFn = M->getOrInsertFunction(
+        CodeGen::getRuntimeName("calc_write_bulk", ValTy),
+        FunctionType::get(VoidTy, {ValueTy}, false));
+    Builder.CreateCall(WriteFn, {V});
+    Builder.CreateBr(ReadBB);
+
+    Builder.SetInsertPoint(ReadBB);
+    FunctionCallee ReadFn = M->getOrInsertFunction(
+        CodeGen::getRuntimeName("calc_read_bulk", ValTy),
+        FunctionType::get(Int32Ty, {ValuePtrTy, Int32Ty}, false));
+    Value *Buf = RowBuf ? RowBuf : ConstantPointerNull::get(ValuePtrTy);
+    Value *More = Builder.CreateCall(ReadFn, {Buf, ConstantInt::get(Int32Ty, NumCols)});
+    Builder.CreateCondBr(Builder.CreateICmpEQ(More, Int32Zero), ExitBB, RowBB);
+
+    Builder.SetInsertPoint(EntryBB);
+    Builder.CreateBr(ReadBB);
+
+    Builder.SetInsertPoint(ExitBB);
+    FunctionCallee CloseFn =
+        M->getOrInsertFunction("calc_bulk_close", FunctionType::get(Int32Ty, false));
+    Builder.CreateRet(Builder.CreateCall(CloseFn));
+  }
+
+  // Generates the entry point that returns the value of the expression for
+  // the arguments in an array: T calc_eval(const T *args). It calls no
+  // runtime function and only reads the arguments, which the attributes
+  // tell callers even without optimization; wrapping code may call
+  // calc_div_error instead of returning. With overflow checks, the flag
+  // is stored in a second argument, uint8_t *overflow.
+  void runEval(function_ref<void()> EmitBody) {
+    SmallVector<Type *, 2> Params = {ValuePtrTy};
+    if (Checked)
+      Params.push_back(PtrTy);
+    FunctionType *EvalFty = FunctionType::get(ValueTy, Params, false);
+    Function *EvalFn = Function::Create(EvalFty, GlobalValue::ExternalLinkage, FnName, M);
+    EvalFn->addFnAttr(Attribute::NoUnwind);
+    if (!Wrapping)
+      EvalFn->addFnAttr(Attribute::ArgMemOnly);
+    EvalFn->addParamAttr(0, Attribute::NoCapture);
+    EvalFn->addParamAttr(0, Attribute::ReadOnly);
+    if (Checked) {
+      EvalFn->addParamAttr(1, Attribute::NoAlias);
+      EvalFn->addParamAttr(1, Attribute::NoCapture);
+      EvalFn->addParamAttr(1, Attribute::WriteOnly);
+    }
+    RowBuf = EvalFn->getArg(0);
+    EntryBB = BasicBlock::Create(M->getContext(), "entry", EvalFn);
+    Builder.SetInsertPoint(EntryBB);
+    EmitBody();
+    if (Checked)
+      storeOverflow(EvalFn->getArg(1));
+    Builder.CreateRet(V);
+  }
+
+  // Store the overflow flag of the expression as a byte, 0 or 1.
+  void storeOverflow(Value *Ptr) {
+    Value *Flag = Overflow ? Overflow : Builder.getFalse();
+    Builder.CreateStore(Builder.CreateZExt(Flag, Builder.getInt8Ty()), Ptr);
+  }
+
+  // Make the values of the declared variables available in 'SymValues'.
+  void bindVars(ArrayRef<StringRef> Vars, ArrayRef<uint32_t> Syms) {
+    if (Vars.empty())
+      return;
+    uint32_t MaxSym = *std::max_element(Syms.begin(), Syms.end());
+    if (MaxSym >= SymValues.size())
+      SymValues.resize(MaxSym + 1);
+    Bound.append(Syms.begin(), Syms.end());
+
+    if (Batch) {
+      // Bind each variable to its column. The column pointers are loaded once
+      // in the entry block, the values are loaded for every row.
+      // The specialized loop reads no column of a folded variable.
+      IRBuilder<> EntryBuilder(EntryBB);
+      for (auto [Var, Sym] : zip(Vars, Syms)) {
+        unsigned Col = NumCols++;
+        if (Value *C = getFoldedValue(Col)) {
+          SymValues[Sym] = C;
+          continue;
+        }
+        Value *ColPtr = EntryBuilder.CreateLoad(
+            ValuePtrTy, EntryBuilder.CreateConstInBoundsGEP1_64(ValuePtrTy, Cols, Col),
+            Twine(Var).concat(".col"));
+        Value *Val = Builder.CreateLoad(
+            ValueTy, Builder.CreateInBoundsGEP(ValueTy, ColPtr, Row), Var);
+        SymValues[Sym] = Val;
+        emitProfile(Var, Val);
+      }
+      return;
+    }
+
+    if (Bulk || Eval) {
+      // Bind each variable to its slot of the argument array, or of the row
+      // buffer, which is allocated at the start of main and filled by
+      // calc_read_bulk.
+      NumCols = Vars.size();
+      if (Bulk) {
+        IRBuilder<> EntryBuilder(EntryBB, EntryBB->begin());
+        RowBuf = EntryBuilder.CreateAlloca(ValueTy, ConstantInt::get(Int32Ty, NumCols), "row.buf");
+      }
+      for (unsigned I = 0; I < NumCols; ++I) {
+        SymValues[Syms[I]] = Builder.CreateLoad(
+            ValueTy, Builder.CreateConstInBoundsGEP1_64(ValueTy, RowBuf, I), Vars[I]);
+        emitProfile(Vars[I], SymValues[Syms[I]]);
+      }
+      return;
+    }
+
+    // Declare an external function 'calc_read(char*)' to read variable values from input.
+    FunctionCallee ReadFn = M->getOrInsertFunction(
+        CodeGen::getRuntimeName("calc_read", ValTy),
+        FunctionType::get(ValueTy, {PtrTy}, false));
+
+    // For each variable in the "with" declaration, read its value.
+    for (auto [Var, Sym] : zip(Vars, Syms)) {
+      // Generate a call to 'calc_read' to read the variable's value and store it in 'SymValues'.
+      CallInst *Call = Builder.CreateCall(ReadFn, {getString(Var)});
+      SymValues[Sym] = Call;  // Store the result of the read for future lookups.
+      emitProfile(Var, Call);
+    }
+  }
+
+  // A global string constant for a name, shared by all functions of the
+  // module.
+  Constant *getString(StringRef Text) {
+    std::string StrName = (Text + ".str").str();
+    GlobalVariable *Str = M->getNamedGlobal(StrName);
+    if (!Str) {
+      Constant *StrText = ConstantDataArray::getString(M->getContext(), Text);
+      Str = new GlobalVariable(*M, StrText->getType(), /*isConstant=*/true, GlobalValue::PrivateLinkage, StrText, StrName);
+    }
+    return ConstantExpr::getPointerCast(Str, PtrTy);
+  }
+
+  // Record the value of a variable with calc_profile, in the record of the
+  // variable (see ProfileRuntime.h), which the copies of the loop of
+  // calc_batch share.
+  void emitProfile(StringRef Var, Value *Val) {
+    if (!Instrument)
+      return;
+    LLVMContext &Ctx = M->getContext();
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    std::string Name = (ProfileName + "." + Var + ".profile").str();
+    GlobalVariable *Record = M->getNamedGlobal(Name);
+    if (!Record) {
+      StructType *RecordTy = StructType::getTypeByName(Ctx, "calc.value_profile");
+      ArrayType *SlotsTy = ArrayType::get(I64Ty, CALC_PROFILE_VALUES);
+      if (!RecordTy)
+        RecordTy = StructType::create({PtrTy, PtrTy, PtrTy, I64Ty, I64Ty, I64Ty, I64Ty,
+                                       SlotsTy, SlotsTy},
+                                      "calc.value_profile");
+      Constant *Init = ConstantStruct::get(
+          RecordTy, {getString(ProfileName), getString(Var), ConstantPointerNull::get(PtrTy),
+                     ConstantInt::get(I64Ty, 0), ConstantInt::get(I64Ty, 0),
+                     ConstantInt::get(I64Ty, 0), ConstantInt::get(I64Ty, 0),
+                     ConstantAggregateZero::get(SlotsTy), ConstantAggregateZero::get(SlotsTy)});
+      Record = new GlobalVariable(*M, RecordTy, /*isConstant=*/false,
+                                  GlobalValue::PrivateLinkage, Init, Name);
+    }
+    FunctionCallee ProfileFn = M->getOrInsertFunction(
+        "calc_profile", FunctionType::get(VoidTy, {PtrTy, I64Ty}, false));
+    Builder.CreateCall(ProfileFn, {Builder.CreatePointerCast(Record, PtrTy),
+                                   Builder.CreateSExt(Val, I64Ty)});
+  }
+
+  // The fraction of the values of a variable that must be equal for the
+  // scalar entry points to fold it. A guard that fails costs a branch.
+  static constexpr double DominantFraction = 0.99;
+
+  // Decide which variables of a declaration to fold into the specialized
+  // code: those that had one value often enough.
+  void planSpecialization(WithDecl &Decl) {
+    if (!Profile)
+      return;
+    ArrayRef<StringRef> Vars = Decl.getVars();
+    unsigned Width = ValueTy->getIntegerBitWidth();
+    for (unsigned I = 0; I < Vars.size(); ++I) {
+      // A batch that has a single other value fails the guard, so a variable
+      // of calc_batch must have had just one value.
+      const ValueProfile::Variable *P = Profile->lookup(ProfileName, Vars[I]);
+      Optional<int64_t> C;
+      if (P)
+        C = P->getDominantValue(Batch ? 1.0 : DominantFraction);
+      if (C && isIntN(Width, *C))  // Not e.g. recorded by code computing with i64.
+        Folded.push_back({I, *C});
+    }
+  }
+
+  // The constant a variable of the specialized loop of calc_batch is folded
+  // into, or nullptr.
+  Value *getFoldedValue(unsigned Var) {
+    if (!Specialized)
+      return nullptr;
+    for (auto [I, Val] : Folded)
+      if (I == Var)
+        return ConstantInt::get(ValueTy, Val, true);
+    return nullptr;
+  }
+
+  // Emit the expression of a declaration twice, with the folded variables as
+  // constants in the first copy, which runs if they all have their values.
+  void emitGuarded(WithDecl &Decl) {
+    LLVMContext &Ctx = M->getContext();
+    ArrayRef<uint32_t> Syms = Decl.getSymbols();
+    Value *Cond = nullptr;
+    SmallVector<Value *, 4> Saved;
+    for (auto [Var, Val] : Folded) {
+      Value *Sym = SymValues[Syms[Var]];
+      Value *Eq = Builder.CreateICmpEQ(Sym, ConstantInt::get(ValueTy, Val, true));
+      Cond = Cond ? Builder.CreateAnd(Cond, Eq) : Eq;
+      Saved.push_back(Sym);
+    }
+    Function *Fn = Builder.GetInsertBlock()->getParent();
+    BasicBlock *SpecializedBB = BasicBlock::Create(Ctx, "specialized", Fn);
+    BasicBlock *GenericBB = BasicBlock::Create(Ctx, "generic", Fn);
+    BasicBlock *MergeBB = BasicBlock::Create(Ctx, "merge", Fn);
+    // The weights of __builtin_expect, as the profile says the guard holds.
+    Builder.CreateCondBr(Cond, SpecializedBB, GenericBB,
+                         MDBuilder(Ctx).createBranchWeights(2000, 1));
+
+    // Each copy has values of its own, and starts without overflows.
+    Value *Vals[2], *Flags[2];
+    BasicBlock *Ends[2];
+    for (unsigned I = 0; I < 2; ++I) {
+      for (auto [F, Sym] : zip(Folded, Saved))
+        SymValues[Syms[F.first]] = I == 0 ? ConstantInt::get(ValueTy, F.second, true) : Sym;
+      Builder.SetInsertPoint(I == 0 ? SpecializedBB : GenericBB);
+      Emitted.clear();
+      Overflow = nullptr;
+      Decl.getExpr()->accept(*this);
+      Vals[I] = V;
+      Flags[I] = Overflow ? Overflow : Builder.getFalse();
+      Ends[I] = Builder.GetInsertBlock();
+      Builder.CreateBr(MergeBB);
+    }
+    Emitted.clear();
+
+    Builder.SetInsertPoint(MergeBB);
+    PHINode *Phi = Builder.CreatePHI(ValueTy, 2);
+    Phi->addIncoming(Vals[0], Ends[0]);
+    Phi->addIncoming(Vals[1], Ends[1]);
+    V = Phi;
+    if (Checked) {
+      PHINode *Flag = Builder.CreatePHI(Builder.getInt1Ty(), 2);
+      Flag->addIncoming(Flags[0], Ends[0]);
+      Flag->addIncoming(Flags[1], Ends[1]);
+      Overflow = Flag;
+    }
+  }
+
+  Value *emitNumber(StringRef Text) { return CodeGen::emitNumber(ValueTy, Text); }
+
+  Value *emitBinary(BinaryOp::Operator Op, Value *Left, Value *Right) {
+    if (Wrapping && Left->getType()->isIntegerTy())
+      return emitWrapping(Op, Left, Right);
+    return CodeGen::emitBinary(Builder, Op, Left, Right, Checked ? &Overflow : nullptr);
+  }
+
+  // An integer operation that wraps around. A division branches to
+  // calc_div_error for an invalid divisor, unless it is a constant that
+  // cannot be one.
+  Value *emitWrapping(BinaryOp::Operator Op, Value *Left, Value *Right) {
+    switch (Op) {
+    case BinaryOp::Plus:
+      return Builder.CreateAdd(Left, Right);
+    case BinaryOp::Minus:
+      return Builder.CreateSub(Left, Right);
+    case BinaryOp::Mul:
+      return Builder.CreateMul(Left, Right);
+    case BinaryOp::Div:
+      break;
+    default:
+      return CodeGen::emitBinary(Builder, Op, Left, Right);
+    }
+    auto *C = dyn_cast<ConstantInt>(Right);
+    if (!C || C->isZero() || C->isMinusOne()) {
+      BasicBlock *ValidBB = BasicBlock::Create(M->getContext(), "div.valid",
+                                               Builder.GetInsertBlock()->getParent());
+      Builder.CreateCondBr(emitInvalidDivision(Builder, Left, Right), getDivErrorBlock(),
+                           ValidBB);
+      Builder.SetInsertPoint(ValidBB);
+    }
+    return Builder.CreateSDiv(Left, Right);
+  }
+
+  // The block of the current function that reports an invalid division.
+  BasicBlock *getDivErrorBlock() {
+    if (DivErrorBB)
+      return DivErrorBB;
+    IRBuilderBase::InsertPointGuard Guard(Builder);
+    DivErrorBB = BasicBlock::Create(M->getContext(), "div.error",
+                                    Builder.GetInsertBlock()->getParent());
+    Builder.SetInsertPoint(DivErrorBB);
+    FunctionCallee DivErrorFn =
+        M->getOrInsertFunction("calc_div_error", FunctionType::get(VoidTy, false));
+    if (auto *Fn = dyn_cast<Function>(DivErrorFn.getCallee())) {
+      Fn->setDoesNotReturn();
+      Fn->setDoesNotThrow();
+      Fn->addFnAttr(Attribute::Cold);
+    }
+    Builder.CreateCall(DivErrorFn)->setDoesNotReturn();
+    Builder.CreateUnreachable();
+    return DivErrorBB;
+  }
+
+  // Generate code for a flat AST with one pass over its nodes. The operands of
+  // a node always precede it, so their values are already in 'Vals'.
+  Value *emitFlat(const FlatAST &Flat) {
+    SmallVector<Value *, 32> Vals;
+    Vals.reserve(Flat.nodes().size());
+    for (const FlatAST::Node &N : Flat.nodes()) {
+      switch (N.Op) {
+      case FlatAST::Ident:
+        Vals.push_back(SymValues[Flat.getSymbol(N)]);
+        break;
+      case FlatAST::Number:
+        Vals.push_back(emitNumber(Flat.getText(N)));
+        break;
+      case FlatAST::Select:
+        Vals.push_back(CodeGen::emitSelect(Builder, Vals[N.Cond], Vals[N.LHS], Vals[N.RHS]));
+        break;
+      default:
+        Vals.push_back(emitBinary(N.getOperator(), Vals[N.LHS], Vals[N.RHS]));
+        break;
+      }
+    }
+    return Vals.back();
+  }
+
+public:
   // Visit a Factor node (which could be an identifier or a literal).
   virtual void visit(Factor &Node) override {
     if (Node.getKind() == Factor::Ident) {
-      // If the Factor is an identifier, look it up in the nameMap and assign the corresponding value to 'V'.
-      V = nameMap[Node.getVal()];
+      // If the Factor is an identifier, look up the value of its symbol and assign it to 'V'.
+      V = SymValues[Node.getSymbol()];
     } else {
-      // If the Factor is a number, convert the string to an integer and create a constant LLVM value.
-      int intval;
-      Node.getVal().getAsInteger(10, intval);  // Convert string to an integer.
-      V = ConstantInt::get(Int32Ty, intval, true);  // Create a constant integer in LLVM IR.
+      // If the Factor is a number, create a constant LLVM value.
+      V = emitNumber(Node.getVal());
     }
   }
 
+  // Emit an operation or conditional and the operations below it without
+  // recursion, the left operand first.
+  Value *emitOperands(Expr *E) {
+    return evaluatePostOrder<Value *>(
+        E,
+        [&](Factor *F) {
+          F->accept(*this);
+          return V;
+        },
+        [&](BinaryOp *B, Value *Left, Value *Right) {
+          Value *Res = emitBinary(B->getOperator(), Left, Right);
+          if (B->isShared())
+            Emitted[B] = Res;
+          return Res;
+        },
+        [&](SelectOp *S, Value *C, Value *Then, Value *Else) {
+          Value *Res = CodeGen::emitSelect(Builder, C, Then, Else);
+          if (S->isShared())
+            Emitted[S] = Res;
+          return Res;
+        },
+        [&](Expr *N, Value *&Res) {
+          // A shared operation is emitted once.
+          Res = N->isShared() ? Emitted.lookup(N) : nullptr;
+          return Res != nullptr;
+        });
+  }
+
   // Visit a BinaryOp node (which represents binary operations like +, -, *, /).
-  virtual void visit(BinaryOp &Node) override {
-    // First, visit the left operand and store its result in 'Left'.
-    Node.getLeft()->accept(*this);
-    Value *Left = V;  // Save the result of the left operand.
+  virtual void visit(BinaryOp &Node) override { V = emitOperands(&Node); }
+
+  // Visit a SelectOp node, a conditional 'c ? a : b'.
+  virtual void visit(SelectOp &Node) override { V = emitOperands(&Node); }
+
+  // Visit a WithDecl node (which represents a "with" declaration).
+  virtual void visit(WithDecl &Node) override {
+    // Read or load the values of the variables.
+    bindVars(Node.getVars(), Node.getSymbols());
+
+    // calc_batch guards a whole loop instead (see runBatch).
+    if (!Folded.empty() && !Batch) {
+      emitGuarded(Node);
+      return;
+    }
+
+    // Finally, visit the expression associated with the "with" declaration.
+    Node.getExpr()->accept(*this);
+  }
+};
+} // namespace
+
+StringRef CodeGen::getEntryName() const {
+  return Opts.Batch ? "calc_batch" : Opts.Eval ? "calc_eval" : "main";
+}
+
+std::string CodeGenOptions::getKey() const {
+  std::string Entry = Batch                          ? "calc_batch"
+                      : Eval                         ? "calc_eval"
+                      : Runtime == RuntimeKind::Bulk ? "main-bulk"
+                                                     : "main";
+  if (Checked && (Batch || Eval))
+    Entry += "-checked";
+  else if (Wrapping)
+    Entry += "-wrapping";
+  if (Instrument)
+    Entry += "-instrumented";
+  else if (Profile)
+    Entry += "-profile-" + utohexstr(Profile->getHash());
+  return Entry + "-O" + std::to_string(OptLevel) + "-" + getTypeName(Type).str();
+}
+
+// The host target, with position-independent code so object files can be
+// linked into any executable.
+Expected<std::unique_ptr<TargetMachine>>
+CodeGen::createHostTargetMachine(unsigned OptLevel) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB)
+    return JTMB.takeError();
+  JTMB->setRelocationModel(Reloc::PIC_);
+  JTMB->setCodeModel(CodeModel::Small);  // The JIT default may be the large model.
+  JTMB->setCodeGenOptLevel(getCodeGenOptLevel(OptLevel));
+  return JTMB->createTargetMachine();
+}
+
+CodeGenOpt::Level CodeGen::getCodeGenOptLevel(unsigned OptLevel) {
+  return OptLevel == 0   ? CodeGenOpt::None
+         : OptLevel == 1 ? CodeGenOpt::Less
+         : OptLevel == 2 ? CodeGenOpt::Default
+                         : CodeGenOpt::Aggressive;
+}
+
+// Runs the default pipeline of the new pass manager for the selected level.
+void CodeGen::optimize(Module &M) {
+  if (Opts.OptLevel == 0)
+    return;  // Keep the IR exactly as emitted.
+  PhaseTimer Timer("optimize", "LLVM optimization pipeline", Opts.TimePhases);
 
-    // Then, visit the right operand and store its result in 'Right'.
-    Node.getRight()->accept(*this);
-    Value *Right = V;  // Save the result of the right operand.
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
 
-    // Generate the appropriate LLVM instruction based on the binary operator.
-    switch (Node.getOperator()) {
+  // The target machine provides the cost model, e.g. the vector width used by
+  // the loop vectorizer.
+  // The standard instrumentations implement LLVM's -time-passes and
+  // -print-after-all style options for the pipeline.
+  PassInstrumentationCallbacks PIC;
+  StandardInstrumentations SI(/*DebugLogging=*/false);
+  SI.registerCallbacks(PIC, &FAM);
+  PassBuilder PB(TM, PipelineTuningOptions(), None, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  OptimizationLevel Level = Opts.OptLevel == 1   ? OptimizationLevel::O1
+                            : Opts.OptLevel == 2 ? OptimizationLevel::O2
+                                                 : OptimizationLevel::O3;
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level);
+  MPM.run(M, MAM);
+}
+
+Type *CodeGen::getValueType(LLVMContext &Ctx, ValueType Ty) {
+  switch (Ty) {
+  case ValueType::I32:
+    return Type::getInt32Ty(Ctx);
+  case ValueType::I64:
+    return Type::getInt64Ty(Ctx);
+  case ValueType::F32:
+    return Type::getFloatTy(Ctx);
+  case ValueType::F64:
+    return Type::getDoubleTy(Ctx);
+  }
+  llvm_unreachable("Unknown value type");
+}
+
+std::string CodeGen::getRuntimeName(StringRef Name, ValueType Ty) {
+  // The i32 functions keep their original names.
+  if (Ty == ValueType::I32)
+    return Name.str();
+  return (Name + "_" + getTypeName(Ty)).str();
+}
+
+// Convert the text of a number to a constant of the value type in LLVM IR.
+Value *CodeGen::emitNumber(Type *Ty, StringRef Text) {
+  if (Ty->isFloatingPointTy()) {
+    double Val = 0;
+    Text.getAsDouble(Val);  // Rounded to float for f32.
+    return ConstantFP::get(Ty, Val);
+  }
+  int64_t intval = 0;
+  Text.getAsInteger(10, intval);  // Convert string to an integer.
+  return ConstantInt::get(Ty, intval, true);
+}
+
+// Whether an integer division is by zero, or of the smallest value by -1.
+static Value *emitInvalidDivision(IRBuilderBase &Builder, Value *Left, Value *Right) {
+  auto *Ty = cast<IntegerType>(Left->getType());
+  Value *Min = ConstantInt::get(Ty, APInt::getSignedMinValue(Ty->getBitWidth()));
+  return Builder.CreateOr(
+      Builder.CreateICmpEQ(Right, ConstantInt::get(Ty, 0)),
+      Builder.CreateAnd(Builder.CreateICmpEQ(Left, Min),
+                        Builder.CreateICmpEQ(Right, ConstantInt::getSigned(Ty, -1))));
+}
+
+// An integer operation checked for overflow, without a branch. The overflow
+// intrinsics return a pair, which keeps the loop vectorizer away from
+// calc_batch, so they are used only where nothing else would vectorize
+// either, for i64 multiplications: additions and subtractions compare the
+// signs of their operands and result, and i32 multiplications are computed
+// in i64. A division replaces invalid divisors by 1, so it cannot trap. The
+// result wraps around on overflow.
+static Value *emitChecked(IRBuilderBase &Builder, BinaryOp::Operator Op,
+                          Value *Left, Value *Right, Value *&Overflow) {
+  Value *Res, *Flag;
+  if (Op == BinaryOp::Div) {
+    auto *Ty = cast<IntegerType>(Left->getType());
+    auto *C = dyn_cast<ConstantInt>(Right);
+    if (C && !C->isZero() && !C->isMinusOne())
+      return Builder.CreateSDiv(Left, Right);  // Cannot overflow.
+    Flag = emitInvalidDivision(Builder, Left, Right);
+    Res = Builder.CreateSDiv(Left, Builder.CreateSelect(Flag, ConstantInt::get(Ty, 1), Right));
+  } else if (Op != BinaryOp::Mul) {
+    // The sum overflows if its sign differs from the signs of both operands,
+    // the difference if the operands have different signs and its sign
+    // differs from that of the minuend.
+    Res = Op == BinaryOp::Plus ? Builder.CreateAdd(Left, Right) : Builder.CreateSub(Left, Right);
+    Value *Sign = Builder.CreateAnd(Builder.CreateXor(Res, Left),
+                                    Builder.CreateXor(Op == BinaryOp::Plus ? Res : Left, Right));
+    Flag = Builder.CreateICmpSLT(Sign, ConstantInt::get(Left->getType(), 0));
+  } else if (Left->getType()->getIntegerBitWidth() == 32) {
+    Type *WideTy = Builder.getInt64Ty();
+    Value *Wide = Builder.CreateNSWMul(Builder.CreateSExt(Left, WideTy),
+                                       Builder.CreateSExt(Right, WideTy));
+    Res = Builder.CreateTrunc(Wide, Left->getType());
+    Flag = Builder.CreateICmpNE(Builder.CreateSExt(Res, WideTy), Wide);
+  } else {
+    Value *Pair = Builder.CreateBinaryIntrinsic(Intrinsic::smul_with_overflow, Left, Right);
+    Res = Builder.CreateExtractValue(Pair, 0);
+    Flag = Builder.CreateExtractValue(Pair, 1);
+  }
+  Overflow = Overflow ? Builder.CreateOr(Overflow, Flag) : Flag;
+  return Res;
+}
+
+// A comparison, or min or max, which select the smaller or greater operand
+// instead of branching. A comparison is 1 if it holds and 0 otherwise; for
+// floating-point values, comparisons with a NaN do not hold, except '!='.
+static Value *emitCompare(IRBuilderBase &Builder, BinaryOp::Operator Op,
+                          Value *Left, Value *Right) {
+  bool IsFloat = Left->getType()->isFloatingPointTy();
+  CmpInst::Predicate Pred;
+  switch (Op) {
+  case BinaryOp::Lt:
+  case BinaryOp::Min:
+    Pred = IsFloat ? CmpInst::FCMP_OLT : CmpInst::ICMP_SLT;
+    break;
+  case BinaryOp::Le:
+    Pred = IsFloat ? CmpInst::FCMP_OLE : CmpInst::ICMP_SLE;
+    break;
+  case BinaryOp::Gt:
+  case BinaryOp::Max:
+    Pred = IsFloat ? CmpInst::FCMP_OGT : CmpInst::ICMP_SGT;
+    break;
+  case BinaryOp::Ge:
+    Pred = IsFloat ? CmpInst::FCMP_OGE : CmpInst::ICMP_SGE;
+    break;
+  case BinaryOp::Eq:
+    Pred = IsFloat ? CmpInst::FCMP_OEQ : CmpInst::ICMP_EQ;
+    break;
+  case BinaryOp::Ne:
+    Pred = IsFloat ? CmpInst::FCMP_UNE : CmpInst::ICMP_NE;
+    break;
+  default:
+    llvm_unreachable("Not a comparison");
+  }
+  Value *Cmp = Builder.CreateCmp(Pred, Left, Right);
+  if (Op == BinaryOp::Min || Op == BinaryOp::Max)
+    return Builder.CreateSelect(Cmp, Left, Right);
+  return IsFloat ? Builder.CreateUIToFP(Cmp, Left->getType())
+                 : Builder.CreateZExt(Cmp, Left->getType());
+}
+
+// Generate the appropriate LLVM instruction based on the binary operator.
+// The operations are the native ones of the value type.
+Value *CodeGen::emitBinary(IRBuilderBase &Builder, BinaryOp::Operator Op,
+                           Value *Left, Value *Right, Value **Overflow) {
+  if (BinaryOp::isComparison(Op) || Op == BinaryOp::Min || Op == BinaryOp::Max)
+    return emitCompare(Builder, Op, Left, Right);
+  if (Left->getType()->isFloatingPointTy()) {
+    switch (Op) {
     case BinaryOp::Plus:
-      V = Builder.CreateNSWAdd(Left, Right);  // Create a no-signed-wrap addition.
-      break;
+      return Builder.CreateFAdd(Left, Right);
     case BinaryOp::Minus:
-      V = Builder.CreateNSWSub(Left, Right);  // Create a no-signed-wrap subtraction.
-      break;
+      return Builder.CreateFSub(Left, Right);
     case BinaryOp::Mul:
-      V = Builder.CreateNSWMul(Left, Right);  // Create a no-signed-wrap multiplication.
-      break;
+      return Builder.CreateFMul(Left, Right);
     case BinaryOp::Div:
-      V = Builder.CreateSDiv(Left, Right);    // Create a signed division.
+      return Builder.CreateFDiv(Left, Right);
+    default:
       break;
     }
+    llvm_unreachable("Unknown binary operator");
+  }
+  if (Overflow)
+    return emitChecked(Builder, Op, Left, Right, *Overflow);
+  switch (Op) {
+  case BinaryOp::Plus:
+    return Builder.CreateNSWAdd(Left, Right);  // Create a no-signed-wrap addition.
+  case BinaryOp::Minus:
+    return Builder.CreateNSWSub(Left, Right);  // Create a no-signed-wrap subtraction.
+  case BinaryOp::Mul:
+    return Builder.CreateNSWMul(Left, Right);  // Create a no-signed-wrap multiplication.
+  case BinaryOp::Div:
+    return Builder.CreateSDiv(Left, Right);    // Create a signed division.
+  default:
+    break;
+  }
+  llvm_unreachable("Unknown binary operator");
+}
+
+// A conditional is a select on whether the condition is nonzero; both of its
+// arms have been computed.
+Value *CodeGen::emitSelect(IRBuilderBase &Builder, Value *Cond, Value *Then,
+                           Value *Else) {
+  Value *Zero = Constant::getNullValue(Cond->getType());
+  Value *Holds = Cond->getType()->isFloatingPointTy()
+                     ? Builder.CreateFCmpUNE(Cond, Zero)
+                     : Builder.CreateICmpNE(Cond, Zero);
+  return Builder.CreateSelect(Holds, Then, Else);
+}
+
+// Runs the ToIRVisitor on the tree (an AST or its flat encoding) to add the
+// entry point to the module.
+template <typename TreeT>
+static void emitCode(Module *M, const CodeGenOptions &Opts, StringRef EntryName,
+                     TreeT &Tree) {
+  std::vector<Value *> SymValues;
+  // A single expression has the same name in a profile whatever its entry point.
+  ToIRVisitor ToIR(M, Opts, EntryName, "expr", SymValues);  // Create a ToIRVisitor instance to generate the IR.
+  ToIR.run(Tree);                      // Run the code generation process on the given tree.
+}
+
+// Adds one function per catalog entry, named after the entry.
+static void emitCode(Module *M, const CodeGenOptions &Opts, StringRef,
+                     ArrayRef<CatalogEntry> &Entries) {
+  // The entries share one value table, which every visitor leaves cleared.
+  std::vector<Value *> SymValues;
+  for (const CatalogEntry &Entry : Entries) {
+    ToIRVisitor ToIR(M, Opts, Entry.Name, Entry.Name, SymValues);
+    ToIR.run(Entry.Tree);
   }
+}
 
-  // Visit a WithDecl node (which represents a "with" declaration).
-  virtual void visit(WithDecl &Node) override {
-    // Declare an external function 'calc_read(char*)' to read variable values from input.
-    FunctionType *ReadFty = FunctionType::get(Int32Ty, {PtrTy}, false);
-    Function *ReadFn = Function::Create(ReadFty, GlobalValue::ExternalLinkage, "calc_read", M);
+// Creates a module in the given context, fills it with the code for the
+// tree and optimizes it.
+template <typename TreeT>
+static std::unique_ptr<Module> generateModule(CodeGen &CG, const CodeGenOptions &Opts,
+                                              TargetMachine *TM, TreeT &Tree,
+                                              LLVMContext &Ctx) {
+  auto M = std::make_unique<Module>("calc.expr", Ctx);  // Module holding the generated code.
+  if (TM) {
+    M->setTargetTriple(TM->getTargetTriple().str());
+    M->setDataLayout(TM->createDataLayout());
+  }
+  {
+    PhaseTimer Timer("irgen", "IR generation", Opts.TimePhases);
+    emitCode(M.get(), Opts, CG.getEntryName(), Tree);
+  }
+  for (Function &F : *M)
+    if (!F.isDeclaration())
+      ++NumFunctions;
+  NumInstructions += M->getInstructionCount();
+  CG.optimize(*M);
+  return M;
+}
 
-    // For each variable in the "with" declaration, read its value.
-    for (auto I = Node.begin(), E = Node.end(); I != E; ++I) {
-      StringRef Var = *I;  // Get the variable name.
+std::unique_ptr<Module> CodeGen::generate(AST *Tree, LLVMContext &Ctx) {
+  return generateModule(*this, Opts, TM, Tree, Ctx);
+}
+
+std::unique_ptr<Module> CodeGen::generate(const FlatAST &Flat, LLVMContext &Ctx) {
+  return generateModule(*this, Opts, TM, Flat, Ctx);
+}
+
+std::unique_ptr<Module> CodeGen::generate(ArrayRef<CatalogEntry> Entries,
+                                          LLVMContext &Ctx) {
+  return generateModule(*this, Opts, TM, Entries, Ctx);
+}
+
+// Generates the module in its own context, which the JIT takes ownership of.
+orc::ThreadSafeModule CodeGen::generate(AST *Tree) {
+  auto Ctx = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> M = generate(Tree, *Ctx);
+  return orc::ThreadSafeModule(std::move(M), std::move(Ctx));
+}
+
+orc::ThreadSafeModule CodeGen::generate(const FlatAST &Flat) {
+  auto Ctx = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> M = generate(Flat, *Ctx);
+  return orc::ThreadSafeModule(std::move(M), std::move(Ctx));
+}
+
+orc::ThreadSafeModule CodeGen::generate(ArrayRef<CatalogEntry> Entries) {
+  auto Ctx = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> M = generate(Entries, *Ctx);
+  return orc::ThreadSafeModule(std::move(M), std::move(Ctx));
+}
 
-      // Create a global string constant for the variable name.
-      Constant *StrText = ConstantDataArray::getString(M->getContext(), Var);
-      GlobalVariable *Str = new GlobalVariable(*M, StrText->getType(), /*isConstant=*/true, GlobalValue::PrivateLinkage, StrText, Twine(Var).concat(".str"));
+Expected<std::vector<orc::ThreadSafeModule>>
+CodeGen::generateShards(ArrayRef<CatalogEntry> Entries, unsigned NumThreads) {
+  if (NumThreads == 0)
+    NumThreads = heavyweight_hardware_concurrency().compute_thread_count();
+  unsigned NumShards = std::max(1u, std::min<unsigned>(NumThreads, Entries.size()));
+  std::vector<orc::ThreadSafeModule> Shards(NumShards);
 
-      // Generate a call to 'calc_read' to read the variable's value and store it in 'nameMap'.
-      CallInst *Call = Builder.CreateCall(ReadFty, ReadFn, {Str});
-      nameMap[Var] = Call;  // Store the result of the read in the nameMap for future lookups.
+  // Timers cannot run on several threads at once, so the workers are timed
+  // as a whole.
+  PhaseTimer Timer("parallel", "Parallel IR generation and optimization",
+                   Opts.TimePhases);
+  CodeGenOptions WorkerOpts = Opts;
+  WorkerOpts.TimePhases = false;
+
+  // The AST is only read during code generation, so the workers can share it.
+  // Everything they create is private: a target machine is not thread-safe,
+  // so each worker uses its own.
+  std::mutex ErrorMutex;
+  Error Err = Error::success();
+  ThreadPool Pool(heavyweight_hardware_concurrency(NumShards));
+  size_t ShardSize = (Entries.size() + NumShards - 1) / NumShards;
+  for (unsigned I = 0; I < NumShards; ++I) {
+    ArrayRef<CatalogEntry> Shard =
+        Entries.slice(std::min(I * ShardSize, Entries.size()))
+            .take_front(ShardSize);
+    Pool.async([&, Shard, I] {
+      std::unique_ptr<TargetMachine> WorkerTM;
+      if (TM) {
+        auto HostTM = createHostTargetMachine(Opts.OptLevel);
+        if (!HostTM) {
+          std::lock_guard<std::mutex> Lock(ErrorMutex);
+          Err = joinErrors(std::move(Err), HostTM.takeError());
+          return;
+        }
+        WorkerTM = std::move(*HostTM);
+      }
+      CodeGen Worker(WorkerOpts, WorkerTM.get());
+      Shards[I] = Worker.generate(Shard);
+    });
+  }
+  Pool.wait();
+  if (Err)
+    return std::move(Err);
+  return std::move(Shards);
+}
+
+Expected<std::unique_ptr<Module>>
+CodeGen::generateParallel(ArrayRef<CatalogEntry> Entries, unsigned NumThreads,
+                          LLVMContext &Ctx) {
+  auto Shards = generateShards(Entries, NumThreads);
+  if (!Shards)
+    return Shards.takeError();
+  PhaseTimer Timer("link", "Linking the shards", Opts.TimePhases);
+
+  // Modules cannot be linked across contexts. The shards are moved into Ctx
+  // with a bitcode round-trip, the cheapest serialization LLVM has.
+  std::unique_ptr<Module> Res;
+  for (orc::ThreadSafeModule &Shard : *Shards) {
+    SmallVector<char, 0> Buffer;
+    Shard.withModuleDo([&](Module &M) {
+      raw_svector_ostream OS(Buffer);
+      WriteBitcodeToFile(M, OS);
+    });
+    Shard = orc::ThreadSafeModule();  // Free the worker's context.
+
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), "calc.expr"), Ctx);
+    if (!M)
+      return M.takeError();
+    if (!Res) {
+      Res = std::move(*M);
+      continue;
     }
+    if (Linker::linkModules(*Res, std::move(*M)))
+      return createStringError(inconvertibleErrorCode(),
+                               "cannot link the catalog shards");
+  }
+  return std::move(Res);
+}
 
-    // Finally, visit the expression associated with the "with" declaration.
-    Node.getExpr()->accept(*this);
+// Writes the module in the requested format. IR and bitcode are written
+// directly; native code is produced by the target's code generator, which
+// avoids the round-trip through textual IR and an external llc.
+Error CodeGen::emit(Module &M, EmitKind Kind, raw_ostream &OS) {
+  switch (Kind) {
+  case EmitKind::LLVMIR:
+    M.print(OS, nullptr);  // Print the generated LLVM IR to the output stream.
+    return Error::success();
+  case EmitKind::Bitcode:
+    WriteBitcodeToFile(M, OS);
+    return Error::success();
+  case EmitKind::Assembly:
+  case EmitKind::Object:
+    break;
+  case EmitKind::CalcBytecode:
+    return createStringError(inconvertibleErrorCode(),
+                             "calc bytecode is compiled from the AST, not from IR");
+  case EmitKind::PrecompiledCatalog:
+    return createStringError(inconvertibleErrorCode(),
+                             "a precompiled catalog has an object per entry");
   }
-};
-} // namespace
+
+  if (!TM)
+    return createStringError(inconvertibleErrorCode(),
+                             "no target machine to generate native code");
+
+  PhaseTimer Timer("emit", "Native code generation", Opts.TimePhases);
+
+  // Object file writers may need to seek back, which a pipe like stdout
+  // cannot do. The code is collected in memory and written out at once.
+  SmallVector<char, 0> Buffer;
+  raw_svector_ostream BOS(Buffer);
+
+  legacy::PassManager PM;
+  CodeGenFileType FileType =
+      Kind == EmitKind::Assembly ? CGFT_AssemblyFile : CGFT_ObjectFile;
+  if (TM->addPassesToEmitFile(PM, BOS, nullptr, FileType))
+    return createStringError(inconvertibleErrorCode(),
+                             "target cannot emit a file of this type");
+  PM.run(M);
+  OS << BOS.str();
+  return Error::success();
+}
 
 // The 'compile' function drives the code generation process.
-// It creates an LLVM context and module, runs the ToIRVisitor on the AST, and prints the generated IR.
-void CodeGen::compile(AST *Tree) {
-  LLVMContext Ctx;                     // Create an LLVM context.
-  Module *M = new Module("calc.expr", Ctx);  // Create a new LLVM module to hold the generated code.
-  ToIRVisitor ToIR(M);                 // Create a ToIRVisitor instance to generate the IR.
-  ToIR.run(Tree);                      // Run the code generation process on the given AST.
-  M->print(outs(), nullptr);           // Print the generated LLVM IR to the output stream.
+// It creates an LLVM context and module, generates the code, and writes it.
+Error CodeGen::compile(AST *Tree, EmitKind Kind, raw_ostream &OS) {
+  LLVMContext Ctx;                         // Create an LLVM context.
+  std::unique_ptr<Module> M = generate(Tree, Ctx);
+  return emit(*M, Kind, OS);
+}
+
+Error CodeGen::compile(const FlatAST &Flat, EmitKind Kind, raw_ostream &OS) {
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = generate(Flat, Ctx);
+  return emit(*M, Kind, OS);
+}
+
+Error CodeGen::compile(ArrayRef<CatalogEntry> Entries, EmitKind Kind,
+                       raw_ostream &OS) {
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = generate(Entries, Ctx);
+  return emit(*M, Kind, OS);
 }
 
+// The 'execute' function compiles the AST with the ORC JIT and calls the
+// generated 'main' directly in this process.
+Expected<int> CodeGen::execute(AST *Tree) {
+  if (Opts.Batch || Opts.Eval)
+    return createStringError(inconvertibleErrorCode(),
+                             "%s code has no main function to execute",
+                             getEntryName().str().c_str());
+  auto JIT = CalcJIT::create(Opts.OptLevel);
+  if (!JIT)
+    return JIT.takeError();
+
+  if (auto Err = (*JIT)->addModule(generate(Tree)))
+    return std::move(Err);
+
+  auto Main = (*JIT)->lookupMain();
+  if (!Main)
+    return Main.takeError();
+  return (*Main)(0, nullptr);
+}
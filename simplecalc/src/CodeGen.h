@@ -2,11 +2,186 @@
 #define CODEGEN_H
 
 #include "AST.h"
+#include "FlatAST.h"
+#include "ValueType.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class IRBuilderBase;
+}
+class ValueProfile;
+
+// The output format of the compiler.
+enum class EmitKind {
+ LLVMIR,    // Textual IR (.ll).
+ Bitcode,   // LLVM bitcode (.bc), cheap to write and read back in LLVM tools.
+ Assembly,  // Native assembly (.s).
+ Object,    // Native object file (.o), ready to be linked with the runtime.
+ CalcBytecode, // Calc bytecode for the VM (see Bytecode.h), not generated from IR.
+ PrecompiledCatalog // One object per catalog entry (see PrecompiledCatalog.h).
+};
+
+// The runtime that the generated 'main' calls.
+enum class RuntimeKind {
+ Interactive,  // Prompt for every variable with calc_read, print with calc_write.
+ Bulk          // Evaluate over the rows of an input file (see BulkRuntime.h).
+};
+
+// Options controlling the generated code.
+struct CodeGenOptions {
+ // Generate 'calc_batch', which evaluates the expression over columns of
+ // input rows, instead of the interactive 'main'.
+ bool Batch = false;
+
+ // Generate 'calc_eval' instead of 'main': T calc_eval(const T *args), which
+ // returns the value of the expression for the 'with' variables in args, in
+ // the order of their declaration. It only reads args and touches no global
+ // state, so any number of threads may call it at once. Batch takes
+ // precedence.
+ bool Eval = false;
+
+ // Check the integer operations of calc_batch and calc_eval for overflow.
+ // Every row gets one overflow flag, the or of the flags of all its
+ // operations, with no branch per operation; a division by zero, or of the
+ // smallest value by -1, counts as an overflow instead of trapping. The flag
+ // is an extra argument, one byte per row:
+ //   void calc_batch(const T *const *cols, T *out, size_t n, uint8_t *overflow)
+ //   T calc_eval(const T *args, uint8_t *overflow)
+ // The results of rows that overflow wrap around. 'main' is never checked.
+ bool Checked = false;
+
+ // Give unchecked integer code the semantics of the bytecode VM (see
+ // Arith.h) instead of leaving overflows undefined: additions, subtractions
+ // and multiplications wrap around, and a division by zero, or of the
+ // smallest value by -1, calls calc_div_error, which does not return. The
+ // tiered engine compiles with it, so both of its tiers agree.
+ bool Wrapping = false;
+
+ // Record the values of the 'with' variables of integer code with
+ // calc_profile (see ProfileRuntime.h), to specialize for them later.
+ bool Instrument = false;
+
+ // Specialize integer code for the values of the 'with' variables recorded
+ // in the profile, unless instrumenting. Variables that nearly always had
+ // one value are folded into a copy of the expression, which runs if they
+ // have it and falls back to the generic code otherwise. calc_batch checks
+ // the columns of a whole batch before it runs a copy of the loop, so its
+ // variables must always have had the value. An AST that is not a 'with'
+ // declaration, or its flat encoding, is not specialized. The variables of
+ // a single expression are recorded as those of 'expr', and those of a
+ // catalog entry under its name, whatever the entry point.
+ const ValueProfile *Profile = nullptr;
+
+ // The runtime of 'main'; calc_batch does not call the runtime.
+ RuntimeKind Runtime = RuntimeKind::Interactive;
+
+ // Level (0-3) of the LLVM optimization pipeline run over the generated
+ // module. 0 leaves the IR as emitted.
+ unsigned OptLevel = 0;
+
+ // The type the expression computes with.
+ ValueType Type = ValueType::I32;
+
+ // Time the code generation phases (see PhaseTimer).
+ bool TimePhases = false;
+
+ // A short string identifying the options, so code generated for the same
+ // source with different options can be told apart (e.g. by the cache).
+ std::string getKey() const;
+};
 
 class CodeGen
 {
+ CodeGenOptions Opts;
+ llvm::TargetMachine *TM;  // Target to generate code for; nullptr for generic IR.
+
 public:
- void compile(AST *Tree);
+ CodeGen(CodeGenOptions Opts = CodeGenOptions(), llvm::TargetMachine *TM = nullptr)
+     : Opts(Opts), TM(TM) {}
+
+ const CodeGenOptions &getOptions() const { return Opts; }
+
+ // Create a target machine for the host, e.g. to pass to the constructor.
+ static llvm::Expected<std::unique_ptr<llvm::TargetMachine>>
+ createHostTargetMachine(unsigned OptLevel);
+
+ // The level of the target's code generator for an -O level (0-3).
+ static llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned OptLevel);
+
+ // Name of the generated entry point: 'main', 'calc_batch' or 'calc_eval'.
+ llvm::StringRef getEntryName() const;
+
+ // Generate the LLVM module for the AST in the given context and run the
+ // optimization pipeline selected by the options over it.
+ std::unique_ptr<llvm::Module> generate(AST *Tree, llvm::LLVMContext &Ctx);
+ std::unique_ptr<llvm::Module> generate(const FlatAST &Flat, llvm::LLVMContext &Ctx);
+
+ // Generate one module for a whole catalog. Every entry becomes a function
+ // named after it, with the signature of 'main' (or 'calc_batch' in batch
+ // mode), and all functions share the runtime declarations.
+ std::unique_ptr<llvm::Module> generate(llvm::ArrayRef<CatalogEntry> Entries,
+                                        llvm::LLVMContext &Ctx);
+
+ // Generate the module in a fresh context, ready to be handed to the JIT.
+ llvm::orc::ThreadSafeModule generate(AST *Tree);
+ llvm::orc::ThreadSafeModule generate(const FlatAST &Flat);
+ llvm::orc::ThreadSafeModule generate(llvm::ArrayRef<CatalogEntry> Entries);
+
+ // Generate a catalog on NumThreads worker threads. The entries are split
+ // into one shard per thread, and each worker generates and optimizes its
+ // shard in its own context. The shards can be added to the JIT as they are.
+ // The errors of all workers are returned together.
+ llvm::Expected<std::vector<llvm::orc::ThreadSafeModule>>
+ generateShards(llvm::ArrayRef<CatalogEntry> Entries, unsigned NumThreads);
+
+ // Generate a catalog on NumThreads worker threads and link the shards into
+ // one module in the given context.
+ llvm::Expected<std::unique_ptr<llvm::Module>>
+ generateParallel(llvm::ArrayRef<CatalogEntry> Entries, unsigned NumThreads,
+                  llvm::LLVMContext &Ctx);
+
+ // Run the optimization pipeline for the selected level over the module.
+ void optimize(llvm::Module &M);
+
+ // Write the module to OS in the given format. Native code requires a
+ // target machine.
+ llvm::Error emit(llvm::Module &M, EmitKind Kind, llvm::raw_ostream &OS);
+
+ // Generate the module and write it to OS in the given format.
+ llvm::Error compile(AST *Tree, EmitKind Kind, llvm::raw_ostream &OS);
+ llvm::Error compile(const FlatAST &Flat, EmitKind Kind, llvm::raw_ostream &OS);
+ llvm::Error compile(llvm::ArrayRef<CatalogEntry> Entries, EmitKind Kind,
+                     llvm::raw_ostream &OS);
+
+ // Generate the module, JIT-compile it and run it in-process.
+ // Returns the exit code of the generated main function.
+ llvm::Expected<int> execute(AST *Tree);
+
+ // The LLVM type of a value type.
+ static llvm::Type *getValueType(llvm::LLVMContext &Ctx, ValueType Ty);
+
+ // The name of a runtime function for the value type, e.g. calc_read_f64.
+ static std::string getRuntimeName(llvm::StringRef Name, ValueType Ty);
+
+ // Emit the value of a number literal of type Ty, the instructions of a
+ // binary operator and those of a conditional, for generators of calc code
+ // outside of CodeGen. If Overflow is given, integer operations are checked,
+ // and their overflow flag is or-ed into *Overflow, which may be nullptr for
+ // none yet; comparisons, min and max cannot overflow. Conditionals, min and
+ // max become selects, not branches.
+ static llvm::Value *emitNumber(llvm::Type *Ty, llvm::StringRef Text);
+ static llvm::Value *emitBinary(llvm::IRBuilderBase &Builder, BinaryOp::Operator Op,
+                                llvm::Value *Left, llvm::Value *Right,
+                                llvm::Value **Overflow = nullptr);
+ static llvm::Value *emitSelect(llvm::IRBuilderBase &Builder, llvm::Value *Cond,
+                                llvm::Value *Then, llvm::Value *Else);
 
 };
-#endif
\ No newline at end of file
+#endif
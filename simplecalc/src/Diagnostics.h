@@ -0,0 +1,22 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/SMLoc.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Report an error of the parser or of the semantic analysis. If Loc points
+// into a buffer of SrcMgr, the message is printed with the file, line and
+// column, and the source line with a caret; otherwise just the message is
+// printed. SrcMgr may be null, e.g. for the expressions of a session, which
+// come from no file.
+inline void printDiagnostic(const llvm::SourceMgr *SrcMgr, llvm::SMLoc Loc,
+                            const llvm::Twine &Msg) {
+  if (SrcMgr && Loc.isValid() && SrcMgr->FindBufferContainingLoc(Loc))
+    SrcMgr->PrintMessage(llvm::errs(), Loc, llvm::SourceMgr::DK_Error, Msg);
+  else
+    llvm::errs() << Msg << "\n";
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "FlatAST.h"
+
+namespace {
+
+// Flattener converts an AST into post-order without recursion. Visiting a node
+// either emits it (Factor) or schedules its operands and itself (BinaryOp,
+// SelectOp). An operation shared by several parents is emitted once, and its
+// index is used for all of them.
+class Flattener : public ASTVisitor {
+  // A pending node: an expression still to visit, or an operation whose
+  // operands have been emitted already.
+  struct WorkItem {
+    Expr *E;
+    Expr *Done;
+  };
+
+  FlatAST &Flat;
+  llvm::SmallVector<WorkItem, 32> Work;      // Nodes still to process.
+  llvm::SmallVector<uint32_t, 32> Operands;  // Indices of emitted, unused operands.
+  llvm::DenseMap<Expr *, uint32_t> Emitted;  // Index of the emitted shared nodes.
+
+public:
+  Flattener(FlatAST &Flat) : Flat(Flat) {}
+
+  // Emit the expression rooted at E.
+  void run(Expr *E) {
+    Work.push_back({E, nullptr});
+    while (!Work.empty()) {
+      WorkItem Item = Work.pop_back_val();
+      if (Item.Done) {
+        // The operands are on the operand stack, the last one on top.
+        uint32_t Index;
+        uint32_t RHS = Operands.pop_back_val();
+        uint32_t LHS = Operands.pop_back_val();
+        if (auto *B = llvm::dyn_cast<BinaryOp>(Item.Done))
+          Index = Flat.addBinary(B->getOperator(), LHS, RHS);
+        else
+          Index = Flat.addSelect(Operands.pop_back_val(), LHS, RHS);
+        if (Item.Done->isShared())
+          Emitted[Item.Done] = Index;
+        Operands.push_back(Index);
+      } else {
+        auto It = Item.E->isShared() ? Emitted.find(Item.E) : Emitted.end();
+        if (It != Emitted.end())
+          Operands.push_back(It->second);
+        else
+          Item.E->accept(*this);
+      }
+    }
+  }
+
+  virtual void visit(Factor &Node) override {
+    FlatAST::Tag Op =
+        Node.getKind() == Factor::Ident ? FlatAST::Ident : FlatAST::Number;
+    Operands.push_back(Flat.addLeaf(Op, Node.getVal(), Node.getSymbol()));
+  }
+
+  virtual void visit(BinaryOp &Node) override {
+    // Emit the operator after its operands; the left operand is emitted first.
+    Work.push_back({nullptr, &Node});
+    Work.push_back({Node.getRight(), nullptr});
+    Work.push_back({Node.getLeft(), nullptr});
+  }
+
+  virtual void visit(SelectOp &Node) override {
+    // Emit the conditional after its condition and its arms, in this order.
+    Work.push_back({nullptr, &Node});
+    Work.push_back({Node.getElse(), nullptr});
+    Work.push_back({Node.getThen(), nullptr});
+    Work.push_back({Node.getCond(), nullptr});
+  }
+
+  // Records the declared variables and flattens the expression.
+  virtual void visit(WithDecl &Node) override {
+    for (size_t I = 0, E = Node.getVars().size(); I != E; ++I)
+      Flat.addVar(Node.getVars()[I], Node.getSymbols()[I]);
+    run(Node.getExpr());
+  }
+};
+
+} // namespace
+
+FlatAST FlatAST::build(AST *Tree) {
+  FlatAST Flat;
+  Flattener F(Flat);
+  // A WithDecl is only valid at the root, where it flattens its expression.
+  Tree->accept(F);
+  return Flat;
+}
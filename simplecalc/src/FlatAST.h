@@ -0,0 +1,102 @@
+#ifndef FLATAST_H
+#define FLATAST_H
+
+#include "AST.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+// FlatAST is a compact, pointer-free encoding of an AST. The nodes of the
+// expression are stored contiguously in post-order, so the operands of a node
+// always come before the node itself and the root is the last node. Passes
+// can process the expression with a single linear loop instead of a recursive
+// walk with virtual calls. A common subexpression of the AST is stored once,
+// and is the operand of all nodes that use it.
+class FlatAST {
+public:
+  // The kind of a node. The binary operators use the same values as
+  // BinaryOp::Operator.
+  enum Tag : uint8_t {
+    Plus = BinaryOp::Plus,
+    Minus = BinaryOp::Minus,
+    Mul = BinaryOp::Mul,
+    Div = BinaryOp::Div,
+    Lt = BinaryOp::Lt,
+    Le = BinaryOp::Le,
+    Gt = BinaryOp::Gt,
+    Ge = BinaryOp::Ge,
+    Eq = BinaryOp::Eq,
+    Ne = BinaryOp::Ne,
+    Min = BinaryOp::Min,
+    Max = BinaryOp::Max,
+    Number,
+    Ident,
+    Select
+  };
+
+  struct Node {
+    Tag Op;
+    // For binary operators, the indices of the left and right operand.
+    // For Select, the indices of the values if the condition holds or not.
+    // For Number and Ident, LHS is the index of the text in getText().
+    // For Ident, RHS is the symbol ID of the name.
+    uint32_t LHS;
+    uint32_t RHS;
+    uint32_t Cond = 0;  // For Select, the index of the condition.
+
+    bool isBinary() const { return Op < Number; }
+    BinaryOp::Operator getOperator() const { return BinaryOp::Operator(Op); }
+  };
+
+private:
+  llvm::SmallVector<Node, 32> Nodes;              // The expression in post-order.
+  llvm::SmallVector<llvm::StringRef, 16> Texts;   // Texts of numbers and identifiers.
+  llvm::SmallVector<llvm::StringRef, 8> Vars;     // Variables declared by 'with'.
+  llvm::SmallVector<uint32_t, 8> VarSyms;         // Their symbol IDs.
+
+public:
+  // Convert the AST into the flat encoding. The conversion uses an explicit
+  // work list, so it does not recurse on deeply nested expressions.
+  static FlatAST build(AST *Tree);
+
+  // Append a Number or Ident node and return its index.
+  uint32_t addLeaf(Tag Op, llvm::StringRef Text, uint32_t Sym = 0) {
+    Texts.push_back(Text);
+    Nodes.push_back({Op, uint32_t(Texts.size() - 1), Sym});
+    return Nodes.size() - 1;
+  }
+
+  // Append a binary operator whose operands were added before.
+  uint32_t addBinary(BinaryOp::Operator Op, uint32_t LHS, uint32_t RHS) {
+    Nodes.push_back({Tag(Op), LHS, RHS});
+    return Nodes.size() - 1;
+  }
+
+  // Append a conditional whose operands were added before.
+  uint32_t addSelect(uint32_t Cond, uint32_t Then, uint32_t Else) {
+    Nodes.push_back({Select, Then, Else, Cond});
+    return Nodes.size() - 1;
+  }
+
+  // Declare a variable.
+  void addVar(llvm::StringRef Var, uint32_t Sym) {
+    Vars.push_back(Var);
+    VarSyms.push_back(Sym);
+  }
+
+  llvm::ArrayRef<Node> nodes() const { return Nodes; }
+  llvm::ArrayRef<llvm::StringRef> getVars() const { return Vars; }
+  llvm::ArrayRef<uint32_t> getVarSymbols() const { return VarSyms; }
+
+  // The text of a Number or Ident node.
+  llvm::StringRef getText(const Node &N) const { return Texts[N.LHS]; }
+
+  // The symbol ID of an Ident node.
+  uint32_t getSymbol(const Node &N) const { return N.RHS; }
+
+  // Index of the root of the expression.
+  uint32_t getRoot() const { return Nodes.size() - 1; }
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "Incremental.h"
+#include "Parser.h"
+#include "Phases.h"
+#include "Simplify.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/IRBuilder.h"
+#include <algorithm>
+#include <iterator>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "calc-incremental"
+
+ALWAYS_ENABLED_STATISTIC(NumVersions, "Number of formula versions compiled");
+ALWAYS_ENABLED_STATISTIC(NumFragmentsEmitted, "Number of fragments generated");
+ALWAYS_ENABLED_STATISTIC(NumFragmentsReused,
+                         "Number of calls to fragments of earlier versions");
+
+namespace {
+
+// Generates the functions of one version. Every function binds the variables
+// it reads to its own values, and emits the nodes of its fragment; a
+// fragment below is a call, passing on the variables it needs.
+class FragmentEmitter {
+  Module &M;
+  IRBuilder<> Builder;
+  function_ref<unsigned(Expr *)> GetFragment;
+  function_ref<ArrayRef<uint32_t>(Expr *)> GetVars;
+  DenseMap<uint32_t, Value *> VarValues;  // The variables of the current function.
+  DenseMap<Expr *, Value *> Emitted;      // Its common subexpressions.
+
+public:
+  unsigned NumReused = 0;  // Calls to fragments compiled before.
+  unsigned FirstNew;       // The first fragment of this version.
+
+  FragmentEmitter(Module &M, function_ref<unsigned(Expr *)> GetFragment,
+                  function_ref<ArrayRef<uint32_t>(Expr *)> GetVars,
+                  unsigned FirstNew)
+      : M(M), Builder(M.getContext()), GetFragment(GetFragment),
+        GetVars(GetVars), FirstNew(FirstNew) {}
+
+  static std::string getName(unsigned Fragment) {
+    return "calc.frag." + std::to_string(Fragment);
+  }
+
+  // Declare (or return) the function of a fragment: i32 (i32 var...).
+  Function *getFunction(unsigned Fragment, size_t NumVars) {
+    std::string Name = getName(Fragment);
+    if (Function *F = M.getFunction(Name))
+      return F;
+    Type *Int32Ty = Builder.getInt32Ty();
+    auto *FnTy = FunctionType::get(
+        Int32Ty, SmallVector<Type *, 8>(NumVars, Int32Ty), false);
+    return Function::Create(FnTy, GlobalValue::ExternalLinkage, Name, M);
+  }
+
+  Value *remember(Expr *E, Value *V) {
+    if (E->isShared())
+      Emitted[E] = V;
+    return V;
+  }
+
+  // Emit the nodes of E; fragments below E become calls. E itself is
+  // emitted inline if Inline is set, and called otherwise.
+  Value *emitExpr(Expr *E, bool Inline) {
+    if (auto *F = dyn_cast<Factor>(E)) {
+      if (F->getKind() == Factor::Ident)
+        return VarValues.lookup(F->getSymbol());
+      return CodeGen::emitNumber(Builder.getInt32Ty(), F->getVal());
+    }
+    if (E->isShared())
+      if (Value *Prev = Emitted.lookup(E))
+        return Prev;
+    unsigned Fragment = GetFragment(E);
+    if (!Inline && Fragment != IncrementalCompiler::NoFragment) {
+      ArrayRef<uint32_t> Vars = GetVars(E);
+      SmallVector<Value *, 8> Args;
+      for (uint32_t Sym : Vars)
+        Args.push_back(VarValues.lookup(Sym));
+      if (Fragment < FirstNew)
+        ++NumReused;
+      return remember(E, Builder.CreateCall(getFunction(Fragment, Vars.size()), Args));
+    }
+    if (auto *S = dyn_cast<SelectOp>(E)) {
+      Value *C = emitExpr(S->getCond(), false);
+      Value *Then = emitExpr(S->getThen(), false);
+      Value *Else = emitExpr(S->getElse(), false);
+      return remember(S, CodeGen::emitSelect(Builder, C, Then, Else));
+    }
+    auto *B = cast<BinaryOp>(E);
+    Value *L = emitExpr(B->getLeft(), false);
+    Value *R = emitExpr(B->getRight(), false);
+    return remember(B, CodeGen::emitBinary(Builder, B->getOperator(), L, R));
+  }
+
+  // Define the function of a fragment rooted at E.
+  void emitFragment(Expr *E) {
+    ArrayRef<uint32_t> Vars = GetVars(E);
+    Function *F = getFunction(GetFragment(E), Vars.size());
+    Builder.SetInsertPoint(BasicBlock::Create(M.getContext(), "entry", F));
+    VarValues.clear();
+    Emitted.clear();
+    for (size_t I = 0; I < Vars.size(); ++I)
+      VarValues[Vars[I]] = F->getArg(I);
+    Builder.CreateRet(emitExpr(E, true));
+  }
+
+  // Define the entry function of a version: i32 (const i32 *Args).
+  void emitEntry(AST *Tree, StringRef Name) {
+    Type *Int32Ty = Builder.getInt32Ty();
+    Type *Int32PtrTy = PointerType::getUnqual(Int32Ty);
+    Function *F = Function::Create(FunctionType::get(Int32Ty, {Int32PtrTy}, false),
+                                   GlobalValue::ExternalLinkage, Name, M);
+    Builder.SetInsertPoint(BasicBlock::Create(M.getContext(), "entry", F));
+    VarValues.clear();
+    Emitted.clear();
+    Expr *E;
+    if (auto *W = dyn_cast<WithDecl>(Tree)) {
+      ArrayRef<uint32_t> Syms = W->getSymbols();
+      for (size_t I = 0; I < Syms.size(); ++I)
+        VarValues[Syms[I]] = Builder.CreateLoad(
+            Int32Ty, Builder.CreateConstInBoundsGEP1_64(Int32Ty, F->getArg(0), I),
+            W->getVars()[I]);
+      E = W->getExpr();
+    } else {
+      E = cast<Expr>(Tree);
+    }
+    Builder.CreateRet(emitExpr(E, false));
+  }
+};
+
+// Returns the union of two sorted lists of symbols.
+SmallVector<uint32_t, 8> mergeVars(ArrayRef<uint32_t> A, ArrayRef<uint32_t> B) {
+  SmallVector<uint32_t, 8> Res;
+  std::set_union(A.begin(), A.end(), B.begin(), B.end(), std::back_inserter(Res));
+  return Res;
+}
+
+} // namespace
+
+// Compute the fragment structure of E and of all nodes below it that are new.
+// The walk stops at nodes seen in earlier versions.
+void IncrementalCompiler::analyze(Expr *E) {
+  auto Remember = [&](Expr *E, const NodeInfo &Info) {
+    NewNodes.push_back(E);
+    Infos.try_emplace(E, Info);
+    return Info;
+  };
+  // An operation or conditional is in the fragment of its operands that are
+  // in no fragment of their own, and reads the variables of all operands.
+  auto Combine = [&](Expr *N, std::initializer_list<const NodeInfo *> Operands) {
+    NodeInfo Info{1, NoFragment, {}};
+    SmallVector<uint32_t, 8> Vars;
+    for (const NodeInfo *Op : Operands) {
+      Info.Size += Op->Fragment == NoFragment ? Op->Size : 0;
+      Vars = mergeVars(Vars, Op->Vars);
+    }
+    // Share the list of an operand that reads all of the variables.
+    auto Same = llvm::find_if(Operands, [&](const NodeInfo *Op) { return Vars == Op->Vars; });
+    Info.Vars = Same != Operands.end() ? (*Same)->Vars : Ctx.copy<uint32_t>(Vars);
+    if (Info.Size >= FragmentSize) {
+      Info.Fragment = NumFragments++;
+      NewFragments.push_back(N);
+    }
+    return Remember(N, Info);
+  };
+  evaluatePostOrder<NodeInfo>(
+      E,
+      [&](Factor *F) {
+        auto It = Infos.find(F);
+        if (It != Infos.end())
+          return It->second;
+        NodeInfo Info{1, NoFragment, {}};
+        if (F->getKind() == Factor::Ident) {
+          uint32_t Sym = F->getSymbol();
+          Info.Vars = Ctx.copy(ArrayRef<uint32_t>(Sym));
+        }
+        return Remember(F, Info);
+      },
+      [&](BinaryOp *B, const NodeInfo &L, const NodeInfo &R) {
+        return Combine(B, {&L, &R});
+      },
+      [&](SelectOp *S, const NodeInfo &C, const NodeInfo &Then, const NodeInfo &Else) {
+        return Combine(S, {&C, &Then, &Else});
+      },
+      [&](Expr *N, NodeInfo &Res) {
+        auto It = Infos.find(N);
+        if (It == Infos.end())
+          return false;
+        Res = It->second;
+        return true;
+      });
+}
+
+// Generate the new fragments and the entry function, and add them to the JIT.
+Error IncrementalCompiler::emit(AST *Tree, StringRef EntryName) {
+  auto LLVMCtx = std::make_unique<LLVMContext>();
+  auto M = std::make_unique<Module>(EntryName, *LLVMCtx);
+  M->setDataLayout(JIT.getDataLayout());
+  if (TM)
+    M->setTargetTriple(TM->getTargetTriple().getTriple());
+
+  {
+    PhaseTimer Timer("irgen", "IR generation", CG.getOptions().TimePhases);
+    unsigned FirstNew = NumFragments - NewFragments.size();
+    auto GetFragment = [&](Expr *E) { return Infos.lookup(E).Fragment; };
+    auto GetVars = [&](Expr *E) { return Infos.lookup(E).Vars; };
+    FragmentEmitter Emitter(*M, GetFragment, GetVars, FirstNew);
+    for (Expr *E : NewFragments)
+      Emitter.emitFragment(E);
+    Emitter.emitEntry(Tree, EntryName);
+    NumFragmentsEmitted += NewFragments.size();
+    NumFragmentsReused += Emitter.NumReused;
+  }
+  CG.optimize(*M);
+  return JIT.addModule(JD, orc::ThreadSafeModule(std::move(M), std::move(LLVMCtx)));
+}
+
+Expected<IncrementalCompiler::EvalFnTy>
+IncrementalCompiler::update(StringRef Text) {
+  if (CG.getOptions().Type != ValueType::I32)
+    return createStringError(inconvertibleErrorCode(),
+                             "Incremental compilation supports only i32 values");
+  bool TimePhases = CG.getOptions().TimePhases;
+  AST *Tree;
+  {
+    PhaseTimer Timer("parse", "Lexing and parsing", TimePhases);
+    Lexer Lex(Text);
+    Parser P(Lex, Ctx);
+    Tree = P.parse();
+    if (!Tree || P.hasError())
+      return createStringError(inconvertibleErrorCode(), "Syntax errors occured");
+  }
+  {
+    PhaseTimer Timer("sema", "Semantic analysis", TimePhases);
+    if (Semantic.semantic(Tree))
+      return createStringError(inconvertibleErrorCode(), "Semantic errors occured");
+  }
+  {
+    // The simplified nodes are unique as well, so they are reused, too.
+    PhaseTimer Timer("simplify", "AST simplification", TimePhases);
+    Tree = Simplifier(Ctx, ValueType::I32, CG.getOptions().Checked).run(Tree);
+  }
+
+  NewNodes.clear();
+  NewFragments.clear();
+  analyze(isa<WithDecl>(Tree) ? cast<WithDecl>(Tree)->getExpr() : cast<Expr>(Tree));
+
+  std::string EntryName = "calc.entry." + std::to_string(Version++);
+  if (Error Err = emit(Tree, EntryName)) {
+    // Forget the new nodes, so the next version generates their fragments.
+    for (Expr *E : NewNodes)
+      Infos.erase(E);
+    return std::move(Err);
+  }
+  ++NumVersions;
+
+  PhaseTimer Timer("jit", "JIT compilation", TimePhases);
+  auto Addr = JIT.lookup(JD, EntryName);
+  if (!Addr)
+    return Addr.takeError();
+  auto *Decl = dyn_cast<WithDecl>(Tree);
+  NumVars = Decl ? Decl->getVars().size() : 0;
+  return jitTargetAddressToFunction<EvalFnTy>(*Addr);
+}
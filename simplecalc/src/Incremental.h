@@ -0,0 +1,86 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "AST.h"
+#include "CodeGen.h"
+#include "JIT.h"
+#include "Sema.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Error.h"
+#include <vector>
+
+// IncrementalCompiler compiles successive versions of one formula, as an
+// editor submits them on every keystroke, and only generates code for the
+// parts that changed.
+//
+// All versions are parsed into one uniquing ASTContext, so a subtree that is
+// unchanged is the very same node as in the previous version. The expression
+// is cut into fragments of about FragmentSize nodes. Each fragment becomes a
+// function of its free variables, which calls the functions of the fragments
+// below it, and is compiled only once. A new version therefore only generates
+// the fragments on the paths from the edits to the root, plus an entry
+// function, and hands them to the JIT as one module.
+class IncrementalCompiler {
+public:
+  // Signature of the compiled formula. Args holds the values of the 'with'
+  // variables in the order of their declaration.
+  using EvalFnTy = int32_t (*)(const int32_t *Args);
+
+  // The fragment number of the nodes that do not start a fragment.
+  static constexpr unsigned NoFragment = ~0u;
+
+private:
+  // What is known about an expression node. Nodes never change, so this
+  // stays valid for all versions.
+  struct NodeInfo {
+    unsigned Size;                  // Number of nodes not in fragments below.
+    unsigned Fragment;              // Number of the fragment rooted here, or NoFragment.
+    llvm::ArrayRef<uint32_t> Vars;  // The free variables, sorted by symbol ID.
+  };
+
+  CalcJIT &JIT;
+  llvm::orc::JITDylib &JD;   // Holds the code of all versions.
+  CodeGen CG;                // Optimizes the generated modules.
+  llvm::TargetMachine *TM;
+  unsigned FragmentSize;
+
+  ASTContext Ctx{/*Uniquing=*/true};
+  Sema Semantic;
+  llvm::DenseMap<Expr *, NodeInfo> Infos;
+  unsigned NumFragments = 0;
+  unsigned Version = 0;
+  unsigned NumVars = 0;     // The 'with' variables of the last version.
+
+  // The nodes first seen by the current update, and the fragments among
+  // them, which still need code.
+  std::vector<Expr *> NewNodes;
+  llvm::SmallVector<Expr *, 8> NewFragments;
+
+  void analyze(Expr *E);
+  llvm::Error emit(AST *Tree, llvm::StringRef EntryName);
+
+public:
+  // Compile into JD, which must be a dylib of its own, e.g. one created with
+  // CalcJIT::createDylib. Opts selects the optimization level; the batch
+  // entry point and value types other than i32 are not supported.
+  IncrementalCompiler(CalcJIT &JIT, llvm::orc::JITDylib &JD,
+                      CodeGenOptions Opts, llvm::TargetMachine *TM,
+                      unsigned FragmentSize = 64)
+      : JIT(JIT), JD(JD), CG(Opts, TM), TM(TM), FragmentSize(FragmentSize),
+        Semantic(nullptr, Opts.Type) {}
+
+  IncrementalCompiler(const IncrementalCompiler &) = delete;
+  IncrementalCompiler &operator=(const IncrementalCompiler &) = delete;
+
+  // Compile the next version of the formula and return its code. Syntax and
+  // semantic errors are reported on llvm::errs(), like in the compiler, and
+  // returned as an error; the code of earlier versions stays valid.
+  llvm::Expected<EvalFnTy> update(llvm::StringRef Text);
+
+  // The number of 'with' variables of the last version compiled, the length
+  // of the arguments of its code.
+  unsigned getNumVars() const { return NumVars; }
+};
+
+#endif
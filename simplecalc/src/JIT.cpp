@@ -0,0 +1,165 @@
+#include "JIT.h"
+#include "BulkRuntime.h"                      // The bulk runtime, in-process as well.
+#include "CodeGen.h"                          // The code generation level of -O.
+#include "ProfileRuntime.h"                   // The runtime of instrumented code.
+#include "Runtime.h"                          // In-process calc_read/calc_write.
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"  // Compiler that uses the object cache.
+#include "llvm/ExecutionEngine/Orc/Core.h"    // absoluteSymbols() and symbol maps.
+#include "llvm/Support/TargetSelect.h"        // Native target initialization.
+#include <cstring>                            // memcpy and memset for the generated code.
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Create the JIT, making sure the native target is available first.
+Expected<std::unique_ptr<CalcJIT>> CalcJIT::create(unsigned OptLevel,
+                                                   ObjectCache *ObjCache) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  auto JTMB = JITTargetMachineBuilder::detectHost();
+  if (!JTMB)
+    return JTMB.takeError();
+  JTMB->setCodeGenOptLevel(CodeGen::getCodeGenOptLevel(OptLevel));
+  LLJITBuilder Builder;
+  Builder.setJITTargetMachineBuilder(std::move(*JTMB));
+  if (ObjCache)
+    Builder.setCompileFunctionCreator(
+        [ObjCache](JITTargetMachineBuilder JTMB)
+            -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+          auto TM = JTMB.createTargetMachine();
+          if (!TM)
+            return TM.takeError();
+          return std::make_unique<TMOwningSimpleCompiler>(std::move(*TM),
+                                                          ObjCache);
+        });
+  auto J = Builder.create();
+  if (!J)
+    return J.takeError();
+
+  std::unique_ptr<CalcJIT> JIT(new CalcJIT(std::move(*J)));
+  if (auto Err = JIT->addRuntimeSymbols())
+    return std::move(Err);
+  return std::move(JIT);
+}
+
+// Bind the names used by the generated code to the runtime in this process.
+Error CalcJIT::addRuntimeSymbols() {
+  MangleAndInterner Mangle(J->getExecutionSession(), J->getDataLayout());
+  SymbolMap Symbols;
+  auto Define = [&](StringRef Name, auto *Fn) {
+    Symbols[Mangle(Name)] = JITEvaluatedSymbol(pointerToJITTargetAddress(Fn),
+                                               JITSymbolFlags::Exported);
+  };
+  Define("calc_read", &calc_read);
+  Define("calc_write", &calc_write);
+  Define("calc_read_i64", &calc_read_i64);
+  Define("calc_write_i64", &calc_write_i64);
+  Define("calc_read_f32", &calc_read_f32);
+  Define("calc_write_f32", &calc_write_f32);
+  Define("calc_read_f64", &calc_read_f64);
+  Define("calc_write_f64", &calc_write_f64);
+  Define("calc_div_error", &calc_div_error);
+  Define("calc_bulk_open", &calc_bulk_open);
+  Define("calc_bulk_close", &calc_bulk_close);
+  Define("calc_read_bulk", &calc_read_bulk);
+  Define("calc_write_bulk", &calc_write_bulk);
+  Define("calc_read_bulk_i64", &calc_read_bulk_i64);
+  Define("calc_write_bulk_i64", &calc_write_bulk_i64);
+  Define("calc_read_bulk_f32", &calc_read_bulk_f32);
+  Define("calc_write_bulk_f32", &calc_write_bulk_f32);
+  Define("calc_read_bulk_f64", &calc_read_bulk_f64);
+  Define("calc_write_bulk_f64", &calc_write_bulk_f64);
+  Define("calc_profile", &calc_profile);
+  // The optimizer turns batch loops that copy or fill the output into calls.
+  Define("memcpy", &memcpy);
+  Define("memset", &memset);
+  return J->getMainJITDylib().define(absoluteSymbols(std::move(Symbols)));
+}
+
+Expected<JITDylib &> CalcJIT::createDylib(StringRef Name) {
+  auto JD = J->createJITDylib(Name.str());
+  if (!JD)
+    return JD.takeError();
+  JD->addToLinkOrder(J->getMainJITDylib());  // Resolve the runtime symbols.
+  return *JD;
+}
+
+Error CalcJIT::removeDylib(JITDylib &JD) {
+  return J->getExecutionSession().removeJITDylib(JD);
+}
+
+Error CalcJIT::addModule(ThreadSafeModule TSM) {
+  return J->addIRModule(std::move(TSM));
+}
+
+Error CalcJIT::addModule(JITDylib &JD, ThreadSafeModule TSM) {
+  return J->addIRModule(JD, std::move(TSM));
+}
+
+Error CalcJIT::addObject(JITDylib &JD, std::unique_ptr<MemoryBuffer> Obj) {
+  return J->addObjectFile(JD, std::move(Obj));
+}
+
+// Called by a stub whose function could not be linked.
+static void reportLazyCallError() {
+  report_fatal_error("calc: cannot link a lazily loaded function");
+}
+
+Error CalcJIT::addLazyObject(JITDylib &StubJD, JITDylib &ImplJD,
+                             std::unique_ptr<MemoryBuffer> Obj,
+                             ArrayRef<StringRef> Functions, ArrayRef<StringRef> Data) {
+  if (!LCTM) {
+    auto CallThrough = createLocalLazyCallThroughManager(
+        getTargetTriple(), J->getExecutionSession(),
+        pointerToJITTargetAddress(&reportLazyCallError));
+    if (!CallThrough)
+      return CallThrough.takeError();
+    LCTM = std::move(*CallThrough);
+    ISM = createLocalIndirectStubsManagerBuilder(getTargetTriple())();
+  }
+
+  SymbolFlagsMap Symbols;
+  SymbolAliasMap Stubs;
+  for (StringRef Name : Functions) {
+    SymbolStringPtr Sym = J->mangleAndIntern(Name);
+    JITSymbolFlags Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    Symbols[Sym] = Flags;
+    Stubs[Sym] = SymbolAliasMapEntry(Sym, Flags);
+  }
+  for (StringRef Name : Data)
+    Symbols[J->mangleAndIntern(Name)] = JITSymbolFlags::Exported;
+  if (Error Err = J->getObjLinkingLayer().add(
+          ImplJD, std::move(Obj), MaterializationUnit::Interface(std::move(Symbols), nullptr)))
+    return Err;
+  // One unit per object, so a call links only the object it needs.
+  return StubJD.define(lazyReexports(*LCTM, *ISM, ImplJD, std::move(Stubs)));
+}
+
+Expected<CalcJIT::MainFnTy> CalcJIT::lookupMain() {
+  return lookupMain(J->getMainJITDylib());
+}
+
+Expected<JITTargetAddress> CalcJIT::lookup(JITDylib &JD, StringRef Name) {
+  auto Sym = J->lookup(JD, Name);
+  if (!Sym)
+    return Sym.takeError();
+  return Sym->getAddress();
+}
+
+Expected<CalcJIT::MainFnTy> CalcJIT::lookupMain(JITDylib &JD) {
+  auto Addr = lookup(JD, "main");
+  if (!Addr)
+    return Addr.takeError();
+  return jitTargetAddressToFunction<MainFnTy>(*Addr);
+}
+
+Expected<JITTargetAddress> CalcJIT::lookupBatchAddress(JITDylib &JD,
+                                                      unsigned &NumCols,
+                                                      StringRef Name) {
+  auto Cols = lookup(JD, (Name + "_columns").str());
+  if (!Cols)
+    return Cols.takeError();
+  NumCols = *jitTargetAddressToPointer<const int32_t *>(*Cols);
+  return lookup(JD, Name);
+}
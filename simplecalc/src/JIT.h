@@ -0,0 +1,120 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "llvm/ExecutionEngine/ObjectCache.h"            // Optional cache for compiled objects.
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"   // Stubs of lazily linked functions.
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"      // Calls that link a function first.
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"              // ORC's ready-made JIT stack.
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"   // Modules handed over to the JIT.
+#include "llvm/Support/Error.h"                          // Expected<T> / Error for reporting failures.
+#include <memory>
+
+// CalcJIT wraps an LLJIT instance that runs the code produced by CodeGen
+// in-process. The runtime functions `calc_read` and `calc_write`, and their
+// variants for the other value types, are resolved to the implementations in
+// Runtime.cpp.
+class CalcJIT {
+  std::unique_ptr<llvm::orc::LLJIT> J;  // The underlying ORC JIT.
+
+  // Created by the first addLazyObject.
+  std::unique_ptr<llvm::orc::LazyCallThroughManager> LCTM;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> ISM;
+
+  CalcJIT(std::unique_ptr<llvm::orc::LLJIT> J) : J(std::move(J)) {}
+
+  // Define the runtime functions in the main JITDylib.
+  llvm::Error addRuntimeSymbols();
+
+  llvm::Expected<llvm::JITTargetAddress>
+  lookupBatchAddress(llvm::orc::JITDylib &JD, unsigned &NumCols,
+                     llvm::StringRef Name);
+
+public:
+  // Signature of the generated `main` function.
+  using MainFnTy = int (*)(int, char **);
+
+  // Signature of the generated `calc_batch` function, for values of type T.
+  template <typename T>
+  using BatchFn = void (*)(const T *const *Cols, T *Out, size_t N);
+  using BatchFnTy = BatchFn<int32_t>;
+
+  // Signature of the generated `calc_eval` function, for values of type T.
+  template <typename T> using EvalFn = T (*)(const T *Args);
+
+  // The same functions generated with overflow checks (see
+  // CodeGenOptions::Checked).
+  template <typename T>
+  using CheckedBatchFn = void (*)(const T *const *Cols, T *Out, size_t N,
+                                  uint8_t *Overflow);
+  template <typename T> using CheckedEvalFn = T (*)(const T *Args, uint8_t *Overflow);
+
+  // Create a JIT for the host process, whose code generator runs at the
+  // level OptLevel (0-3) of the -O option. If an object cache is given, it is
+  // consulted before compiling a module and notified of every new object.
+  static llvm::Expected<std::unique_ptr<CalcJIT>>
+  create(unsigned OptLevel = 2, llvm::ObjectCache *ObjCache = nullptr);
+
+  // The data layout the JIT expects modules to be compiled for.
+  const llvm::DataLayout &getDataLayout() const { return J->getDataLayout(); }
+
+  // Create a separate dylib, so that several expressions can each define
+  // their own `main`. The runtime functions are visible from it.
+  llvm::Expected<llvm::orc::JITDylib &> createDylib(llvm::StringRef Name);
+
+  // Remove a dylib created with createDylib and free its code.
+  llvm::Error removeDylib(llvm::orc::JITDylib &JD);
+
+  // Hand a module over to the JIT. Code is compiled lazily on lookup.
+  llvm::Error addModule(llvm::orc::ThreadSafeModule TSM);
+  llvm::Error addModule(llvm::orc::JITDylib &JD, llvm::orc::ThreadSafeModule TSM);
+
+  // Add an already compiled object file.
+  llvm::Error addObject(llvm::orc::JITDylib &JD,
+                        std::unique_ptr<llvm::MemoryBuffer> Obj);
+
+  // Add an object file that is linked only when one of its functions is
+  // first called. StubJD gets a stub for each of Functions, whose address can
+  // be looked up without touching the object; ImplJD gets the object. The
+  // symbols the object defines are taken from Functions and Data instead of
+  // its symbol table, so it is not even read before the first call.
+  llvm::Error addLazyObject(llvm::orc::JITDylib &StubJD, llvm::orc::JITDylib &ImplJD,
+                            std::unique_ptr<llvm::MemoryBuffer> Obj,
+                            llvm::ArrayRef<llvm::StringRef> Functions,
+                            llvm::ArrayRef<llvm::StringRef> Data = {});
+
+  // The triple of the code the JIT runs.
+  const llvm::Triple &getTargetTriple() const { return J->getTargetTriple(); }
+
+  // Look up the address of a symbol defined in the given dylib.
+  llvm::Expected<llvm::JITTargetAddress> lookup(llvm::orc::JITDylib &JD,
+                                                llvm::StringRef Name);
+
+  // Look up the address of the generated `main` function.
+  llvm::Expected<MainFnTy> lookupMain();
+  llvm::Expected<MainFnTy> lookupMain(llvm::orc::JITDylib &JD);
+
+  // Look up a generated batch function (by default `calc_batch`) and its
+  // column count. T must match the value type it was compiled for.
+  template <typename T = int32_t>
+  llvm::Expected<BatchFn<T>> lookupBatch(llvm::orc::JITDylib &JD,
+                                         unsigned &NumCols,
+                                         llvm::StringRef Name = "calc_batch") {
+    auto Addr = lookupBatchAddress(JD, NumCols, Name);
+    if (!Addr)
+      return Addr.takeError();
+    return llvm::jitTargetAddressToFunction<BatchFn<T>>(*Addr);
+  }
+
+  // Look up a batch function generated with overflow checks.
+  template <typename T = int32_t>
+  llvm::Expected<CheckedBatchFn<T>>
+  lookupCheckedBatch(llvm::orc::JITDylib &JD, unsigned &NumCols,
+                     llvm::StringRef Name = "calc_batch") {
+    auto Addr = lookupBatchAddress(JD, NumCols, Name);
+    if (!Addr)
+      return Addr.takeError();
+    return llvm::jitTargetAddressToFunction<CheckedBatchFn<T>>(*Addr);
+  }
+};
+
+#endif
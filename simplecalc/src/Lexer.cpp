@@ -1,51 +1,163 @@
 #include "Lexer.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSwitch.h"    // Recognizing the keywords.
+#include "llvm/Support/MathExtras.h"  // countTrailingZeros() for the SIMD masks.
+#include <cstdint>
+
+// The lexer skips runs of whitespace, letters and digits with SIMD
+// instructions where the target has them.
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CALC_LEXER_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define CALC_LEXER_NEON
+#endif
+
+#define DEBUG_TYPE "calc-lexer"
+
+ALWAYS_ENABLED_STATISTIC(NumTokens, "Number of tokens lexed");
 
 // Namespace containing utility functions for character classification.
 namespace charinfo {
 
-  // Returns true if the character is considered whitespace.
-  // Whitespace characters: ' ', '\t', '\f', '\v', '\r', '\n'.
-  LLVM_READNONE inline bool isWhitespace(char c) {
-    return c == ' ' || c == '\t' || c == '\f' || c == '\v' ||
-           c == '\r' || c == '\n';
+  // Character classes, as bits in the classification table.
+  enum : uint8_t {
+    CHAR_WHITESPACE = 0x01,  // ' ', '\t', '\f', '\v', '\r', '\n'
+    CHAR_DIGIT = 0x02,       // '0' to '9'
+    CHAR_LETTER = 0x04       // 'a' to 'z' and 'A' to 'Z'
+  };
+
+  // The classes of all 256 characters, computed at compile time. One table
+  // lookup replaces a chain of comparisons.
+  struct CharTable {
+    uint8_t Info[256];
+
+    constexpr CharTable() : Info() {
+      for (unsigned C = 0; C < 256; ++C) {
+        if (C == ' ' || C == '\t' || C == '\f' || C == '\v' || C == '\r' ||
+            C == '\n')
+          Info[C] = CHAR_WHITESPACE;
+        else if (C >= '0' && C <= '9')
+          Info[C] = CHAR_DIGIT;
+        else if ((C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z'))
+          Info[C] = CHAR_LETTER;
+      }
+    }
+  };
+  constexpr CharTable Table;
+
+  // Returns true if the character belongs to one of the classes.
+  LLVM_READNONE inline bool is(char c, uint8_t Classes) {
+    return Table.Info[static_cast<unsigned char>(c)] & Classes;
   }
 
+  // Returns true if the character is considered whitespace.
+  LLVM_READNONE inline bool isWhitespace(char c) { return is(c, CHAR_WHITESPACE); }
+
   // Returns true if the character is a digit ('0' to '9').
-  LLVM_READNONE inline bool isDigit(char c) {
-    return c >= '0' && c <= '9';
-  }
+  LLVM_READNONE inline bool isDigit(char c) { return is(c, CHAR_DIGIT); }
 
   // Returns true if the character is a letter ('a' to 'z' or 'A' to 'Z').
-  LLVM_READNONE inline bool isLetter(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  LLVM_READNONE inline bool isLetter(char c) { return is(c, CHAR_LETTER); }
+
+#if defined(CALC_LEXER_SSE2) || defined(CALC_LEXER_NEON)
+  // Returns a bit mask of the characters in the 16 bytes at Ptr that belong
+  // to Class, with bit I set for the character Ptr[I]. Each class is a range
+  // check on unsigned bytes, which needs no table: (c - Lo) <= (Hi - Lo).
+#if defined(CALC_LEXER_SSE2)
+  template <uint8_t Class> inline unsigned classify16(const char *Ptr) {
+    __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Ptr));
+    // Unsigned A <= B is min(A, B) == A; SSE2 has no unsigned comparison.
+    auto InRange = [](__m128i V, char Lo, char Len) {
+      __m128i D = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+      return _mm_cmpeq_epi8(_mm_min_epu8(D, _mm_set1_epi8(Len)), D);
+    };
+    __m128i M;
+    if (Class == CHAR_WHITESPACE)
+      M = _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')),
+                       InRange(V, '\t', '\r' - '\t'));
+    else if (Class == CHAR_DIGIT)
+      M = InRange(V, '0', 9);
+    else // Setting bit 5 maps upper case to lower case letters.
+      M = InRange(_mm_or_si128(V, _mm_set1_epi8(0x20)), 'a', 25);
+    return _mm_movemask_epi8(M);
+  }
+#else
+  template <uint8_t Class> inline unsigned classify16(const char *Ptr) {
+    uint8x16_t V = vld1q_u8(reinterpret_cast<const uint8_t *>(Ptr));
+    auto InRange = [](uint8x16_t V, uint8_t Lo, uint8_t Len) {
+      return vcleq_u8(vsubq_u8(V, vdupq_n_u8(Lo)), vdupq_n_u8(Len));
+    };
+    uint8x16_t M;
+    if (Class == CHAR_WHITESPACE)
+      M = vorrq_u8(vceqq_u8(V, vdupq_n_u8(' ')),
+                   InRange(V, '\t', '\r' - '\t'));
+    else if (Class == CHAR_DIGIT)
+      M = InRange(V, '0', 9);
+    else
+      M = InRange(vorrq_u8(V, vdupq_n_u8(0x20)), 'a', 25);
+    // NEON has no movemask: keep one bit per byte and add up the bits of
+    // each half.
+    static const uint8_t Bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                     1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t B = vandq_u8(M, vld1q_u8(Bits));
+    return vaddv_u8(vget_low_u8(B)) | (vaddv_u8(vget_high_u8(B)) << 8);
+  }
+#endif
+#endif
+
+  // Returns the first character in [Ptr, End) that does not belong to
+  // Class. Long runs, like indentation or long numbers, are skipped 16 bytes
+  // at a time; the common short runs end within the first two characters,
+  // so those are checked with the table first.
+  template <uint8_t Class>
+  inline const char *skip(const char *Ptr, const char *End) {
+    for (int I = 0; I < 2; ++I, ++Ptr)
+      if (Ptr == End || !is(*Ptr, Class))
+        return Ptr;
+#if defined(CALC_LEXER_SSE2) || defined(CALC_LEXER_NEON)
+    for (; End - Ptr >= 16; Ptr += 16) {
+      unsigned Mask = classify16<Class>(Ptr);
+      if (Mask != 0xFFFF)
+        return Ptr + llvm::countTrailingZeros(~Mask);
+    }
+#endif
+    while (Ptr != End && is(*Ptr, Class))
+      ++Ptr;
+    return Ptr;
   }
 }
 
 // Function that advances the lexer to the next token in the input.
 void Lexer::next(Token &token) {
   // Skip over any whitespace characters at the current buffer position.
-  while (*BufferPtr && charinfo::isWhitespace(*BufferPtr)) {
-    ++BufferPtr;  // Move to the next character in the buffer.
-  }
+  BufferPtr = charinfo::skip<charinfo::CHAR_WHITESPACE>(BufferPtr, BufferEnd);
 
   // If we reach the end of the buffer, set the token kind to `eoi` (end of input).
-  if (!*BufferPtr) {
+  // A NUL character is an ordinary (unknown) character.
+  if (BufferPtr == BufferEnd) {
     token.Kind = Token::eoi;
+    token.Text = llvm::StringRef(BufferEnd, 0);
     return;
   }
 
   // Check if the next token is an identifier (which starts with a letter).
   if (charinfo::isLetter(*BufferPtr)) {
     // Start scanning for a sequence of letters.
-    const char *end = BufferPtr + 1;  // Move one position after the current.
-    while (charinfo::isLetter(*end))  // Keep advancing while characters are letters.
-      ++end;
+    // Keep advancing while characters are letters.
+    const char *end = charinfo::skip<charinfo::CHAR_LETTER>(BufferPtr + 1, BufferEnd);
     
     // Create a string from the current token's text (from BufferPtr to end).
     llvm::StringRef Name(BufferPtr, end - BufferPtr);
 
-    // Check if the identifier is the keyword "with", otherwise it's a generic identifier.
-    Token::TokenKind kind = (Name == "with") ? Token::KW_with : Token::ident;
+    // Check if the identifier is a keyword, otherwise it's a generic identifier.
+    Token::TokenKind kind = llvm::StringSwitch<Token::TokenKind>(Name)
+                                .Case("with", Token::KW_with)
+                                .Case("min", Token::KW_min)
+                                .Case("max", Token::KW_max)
+                                .Case("abs", Token::KW_abs)
+                                .Default(Token::ident);
 
     // Form the token with the identified kind.
     formToken(token, end, kind);
@@ -54,9 +166,8 @@ void Lexer::next(Token &token) {
   // Check if the next token is a number (starts with a digit).
   } else if (charinfo::isDigit(*BufferPtr)) {
     // Start scanning for a sequence of digits.
-    const char *end = BufferPtr + 1;
-    while (charinfo::isDigit(*end))  // Keep advancing while characters are digits.
-      ++end;
+    // Keep advancing while characters are digits.
+    const char *end = charinfo::skip<charinfo::CHAR_DIGIT>(BufferPtr + 1, BufferEnd);
 
     // Form the token as a `number` token.
     formToken(token, end, Token::number);
@@ -79,9 +190,36 @@ case ch: formToken(token, BufferPtr + 1, tok); break
     CASE(')', Token::Token::r_paren);
     CASE(':', Token::Token::colon);
     CASE(',', Token::Token::comma);
+    CASE(';', Token::semi);
+    CASE('?', Token::question);
 
 #undef CASE  // End the macro definition.
 
+    // The comparisons, which may be followed by '='.
+    case '<':
+    case '>':
+    case '=':
+    case '!': {
+      bool Equal = BufferPtr + 1 != BufferEnd && BufferPtr[1] == '=';
+      Token::TokenKind Kind;
+      switch (*BufferPtr) {
+      case '<':
+        Kind = Equal ? Token::lessequal : Token::less;
+        break;
+      case '>':
+        Kind = Equal ? Token::greaterequal : Token::greater;
+        break;
+      case '=':
+        Kind = Equal ? Token::equalequal : Token::equal;
+        break;
+      default:  // A '!' on its own is unknown.
+        Kind = Equal ? Token::exclaimequal : Token::unknown;
+        break;
+      }
+      formToken(token, BufferPtr + (Equal ? 2 : 1), Kind);
+      break;
+    }
+
     // If the character doesn't match any known token, mark it as `unknown`.
     default:
       formToken(token, BufferPtr + 1, Token::unknown);
@@ -90,12 +228,18 @@ case ch: formToken(token, BufferPtr + 1, tok); break
   }
 }
 
+// The tokens are counted locally, so the shared counter is updated only once
+// per lexer instead of once per token.
+Lexer::~Lexer() { NumTokens += TokenCount; }
+
 // Helper function to create a token and advance the buffer pointer.
 // `Tok`: The token to fill in.
 // `TokEnd`: The position in the buffer where the token ends.
 // `Kind`: The kind of token being formed.
 void Lexer::formToken(Token &Tok, const char *TokEnd,
                       Token::TokenKind Kind) {
+  ++TokenCount;
+
   // Set the token's kind (type).
   Tok.Kind = Kind;
 
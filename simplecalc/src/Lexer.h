@@ -4,6 +4,7 @@
 // Including LLVM's utility classes for efficient string manipulation and memory management.
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SMLoc.h"
 
 // Forward declaration of the Lexer class, allowing Token to declare Lexer as a friend.
 class Lexer;
@@ -22,13 +23,25 @@ public:
     number,    // Numeric literals
     comma,     // ','
     colon,     // ':'
+    equal,     // '=' (catalog files)
+    semi,      // ';' (catalog files)
     plus,      // '+'
     minus,     // '-'
     star,      // '*'
     slash,     // '/'
     l_paren,   // '('
     r_paren,   // ')'
-    KW_with    // Keyword "with"
+    less,      // '<'
+    lessequal, // '<='
+    greater,   // '>'
+    greaterequal, // '>='
+    equalequal,   // '=='
+    exclaimequal, // '!='
+    question,  // '?'
+    KW_with,   // Keyword "with"
+    KW_min,    // Builtin "min"
+    KW_max,    // Builtin "max"
+    KW_abs     // Builtin "abs"
   };
 
 private:
@@ -44,6 +57,12 @@ public:
     return Text;
   }
 
+  // The location of the token in the buffer, for diagnostics. The end of
+  // input is located at the end of the buffer.
+  llvm::SMLoc getLocation() const {
+    return llvm::SMLoc::getFromPointer(Text.data());
+  }
+
   // Utility function to check if the token is of a specific kind.
   bool is(TokenKind K) const { return Kind == K; }
 
@@ -61,17 +80,29 @@ public:
 };
 
 // Lexer class is responsible for processing the input buffer and generating tokens.
+// The buffer does not need to be NUL-terminated: the end of input is found
+// with BufferEnd, so the lexer can run directly on a memory-mapped file.
+// Tokens are produced one at a time and refer to the buffer, which must
+// outlive them.
 class Lexer {
   const char *BufferStart;  // Points to the start of the input buffer.
   const char *BufferPtr;    // Points to the current position in the input buffer being processed.
+  const char *BufferEnd;    // Points one past the last character of the input buffer.
+  unsigned TokenCount = 0;  // Tokens lexed so far, for the statistics.
 
 public:
   // Constructor for Lexer, taking the input buffer (string) and initializing pointers.
   Lexer(const llvm::StringRef &Buffer) {
     BufferStart = Buffer.begin();  // Set the start of the buffer.
     BufferPtr = BufferStart;       // Initialize the current position to the start of the buffer.
+    BufferEnd = Buffer.end();      // The input ends here, not at a NUL character.
   }
 
+  // Lex the contents of a memory buffer, e.g. a mapped file.
+  Lexer(llvm::MemoryBufferRef Buffer) : Lexer(Buffer.getBuffer()) {}
+
+  ~Lexer();
+
   // Function to generate the next token from the input and store it in `token`.
   void next(Token &token);
 
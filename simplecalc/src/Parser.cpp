@@ -4,104 +4,317 @@
 // It parses the entire input, expecting the end of input (eoi) after the calculation.
 // Returns the root node of the AST.
 AST *Parser::parse() {
-  AST *Res = parseCalc();  // Parse a calculation (expression or statement).
+  AST *Res = parseCalc(Token::eoi);  // Parse a calculation (expression or statement).
   expect(Token::eoi);      // Ensure that the token stream ends after parsing.
   return Res;              // Return the AST (or nullptr if parsing failed).
 }
 
+void Parser::verify(ValueType Ty) {
+  VerifyOnly = true;
+  this->Ty = Ty;
+  parse();
+}
+
+void Parser::verifyCatalog(ValueType Ty) {
+  VerifyOnly = true;
+  this->Ty = Ty;
+  llvm::SmallVector<CatalogEntry, 0> None;  // Stays empty.
+  parseCatalog(None);
+}
+
+// Parses a catalog of named calculations.
+void Parser::parseCatalog(llvm::SmallVectorImpl<CatalogEntry> &Entries) {
+  while (!Tok.is(Token::eoi)) {
+    // Each entry starts with its name, followed by '='.
+    llvm::StringRef Name = Tok.getText();
+    if (consume(Token::ident) || consume(Token::equal)) {
+      // Skip the rest of the broken entry.
+      while (!Tok.isOneOf(Token::semi, Token::eoi))
+        advance();
+    } else {
+      if (VerifyOnly && !EntryNames.insert(Name).second)
+        semanticError(llvm::SMLoc::getFromPointer(Name.data()),
+                      "Expression " + Name + " already defined");
+      const char *Start = Tok.getText().data();
+      AST *Tree = parseCalc(Token::semi);
+      // An entry with syntax errors is kept without a tree, so its name
+      // still counts for the duplicate check of Sema.
+      if (!VerifyOnly)
+        Entries.push_back({Name, Tree,
+                           llvm::StringRef(Start, Tok.getText().data() - Start)});
+    }
+
+    // The entry ends with ';', which parseCalc leaves in place.
+    if (Tok.is(Token::semi))
+      advance();
+  }
+}
+
+llvm::StringRef Parser::getSpelling(Token::TokenKind Kind) {
+  switch (Kind) {
+  case Token::eoi: return "end of input";
+  case Token::unknown: return "unknown character";
+  case Token::ident: return "identifier";
+  case Token::number: return "number";
+  case Token::comma: return "','";
+  case Token::colon: return "':'";
+  case Token::equal: return "'='";
+  case Token::semi: return "';'";
+  case Token::plus: return "'+'";
+  case Token::minus: return "'-'";
+  case Token::star: return "'*'";
+  case Token::slash: return "'/'";
+  case Token::l_paren: return "'('";
+  case Token::r_paren: return "')'";
+  case Token::less: return "'<'";
+  case Token::lessequal: return "'<='";
+  case Token::greater: return "'>'";
+  case Token::greaterequal: return "'>='";
+  case Token::equalequal: return "'=='";
+  case Token::exclaimequal: return "'!='";
+  case Token::question: return "'?'";
+  case Token::KW_with: return "'with'";
+  case Token::KW_min: return "'min'";
+  case Token::KW_max: return "'max'";
+  case Token::KW_abs: return "'abs'";
+  }
+  llvm_unreachable("unknown token kind");
+}
+
+void Parser::errorExpected(llvm::StringRef What) {
+  if (Tok.is(Token::eoi))
+    error("expected " + What + ", found end of input");
+  else
+    error("expected " + What + ", found '" + Tok.getText() + "'");
+}
+
 // Parses a "calculation" which can either be a simple expression or a "with" declaration.
-AST *Parser::parseCalc() {
-  Expr *E;
+AST *Parser::parseCalc(Token::TokenKind End) {
+  // The calculation is dropped if it has an error, reported or not.
+  bool HadError = HasError;
+  HasError = false;
+  Declared.clear();
+  Undeclared.clear();
+  OutOfRange.clear();
   llvm::SmallVector<llvm::StringRef, 8> Vars;  // A small vector to store variable names.
+  llvm::SmallVector<uint32_t, 8> Syms;         // The symbol IDs of the variables.
   
   // Check if the input starts with the "with" keyword for a variable declaration.
   if (Tok.is(Token::KW_with)) {
     advance();  // Consume the "with" keyword.
     
-    // Expect an identifier (variable name).
-    if (expect(Token::ident))
-      goto _error;  // If there's an error, jump to the error-handling section.
-    
-    Vars.push_back(Tok.getText());  // Add the variable name to the Vars list.
-    advance();  // Move to the next token.
-    
-    // Continue parsing more identifiers separated by commas (for multiple variables).
-    while (Tok.is(Token::comma)) {
-      advance();  // Consume the comma.
+    // Parse the identifiers (variable names), separated by commas.
+    for (;;) {
       if (expect(Token::ident))
-        goto _error;  // Expect another identifier after the comma.
-      Vars.push_back(Tok.getText());  // Add the variable name to the Vars list.
+        break;
+      if (VerifyOnly) {
+        if (!Declared.insert(Tok.getText()).second)
+          semanticError(Tok.getLocation(),
+                        "Variable " + Tok.getText() + " already declared");
+      } else {
+        Vars.push_back(Tok.getText());  // Add the variable name to the Vars list.
+        Syms.push_back(Ctx.getSymbols().intern(Tok.getText()));
+      }
       advance();  // Move to the next token.
+      if (!Tok.is(Token::comma))
+        break;
+      advance();  // Consume the comma.
     }
     
-    // Expect a colon after the variables list.
-    if (consume(Token::colon))
-      goto _error;  // If the colon is missing, go to error handling.
+    // Expect a colon after the variables list. After an error in the list,
+    // skip to the colon, so the errors of the expression are reported too.
+    if (!HasError)
+      expect(Token::colon);
+    while (!Tok.isOneOf(Token::colon, End, Token::eoi))
+      advance();
+    if (!Tok.is(Token::colon))
+      return nullptr;  // Nothing is left to check; HasError is set.
+    advance();  // Consume the colon.
   }
   
   // Parse the expression after "with" (or if there's no "with").
-  E = parseExpr();  // Parse the expression.
+  Expr *E = parseExpr();
   
-  // Ensure that the expression is followed by the end of input (eoi).
-  if (expect(Token::eoi))
-    goto _error;  // If not followed by eoi, handle the error.
+  // Ensure that the expression is followed by the end of input (or of the
+  // catalog entry). If not, skip the rest up to it.
+  if (expect(End)) {
+    while (!Tok.isOneOf(End, Token::eoi))
+      advance();
+  }
+
+  // A calculation with errors is not returned, so it is not checked further.
+  if (HasError)
+    return nullptr;
+  HasError = HadError;
+  if (VerifyOnly)
+    return nullptr;
   
   // If there were no "with" variables, return the parsed expression as the result.
   if (Vars.empty())
     return E;
-  else
-    // If there were "with" variables, return a WithDecl node with the variables and expression.
-    return new WithDecl(Vars, E);
-  
-// Error handling block.
-_error:
-  // If an error occurs, consume tokens until the end of input (eoi) to clean up.
-  while (Tok.getKind() != Token::eoi)
-    advance();  // Keep advancing until eoi is reached.
-  return nullptr;  // Return nullptr to indicate a failure in parsing.
+  // If there were "with" variables, return a WithDecl node with the variables and expression.
+  return Ctx.create<WithDecl>(Ctx.copy<llvm::StringRef>(Vars),
+                              Ctx.copy<uint32_t>(Syms), E);
 }
 
-// Parses an expression, which is a term followed by optional addition or subtraction operators.
-Expr *Parser::parseExpr() {
-  Expr *Left = parseTerm();  // Start by parsing the first term.
-  
-  // Continue parsing as long as the current token is a plus or minus operator.
-  while (Tok.isOneOf(Token::plus, Token::minus)) {
-    // Determine the type of binary operation (addition or subtraction).
-    BinaryOp::Operator Op = Tok.is(Token::plus) ? BinaryOp::Plus : BinaryOp::Minus;
-    advance();  // Consume the operator.
-    
-    // Parse the next term after the operator.
-    Expr *Right = parseTerm();
-    
-    // Combine the left and right terms into a binary operation node (e.g., Left + Right).
-    Left = new BinaryOp(Op, Left, Right);
+// Returns the binding strength of a binary operator token: 5 for '*' and '/',
+// 4 for '+' and '-', 3 for '<', '<=', '>' and '>=', 2 for '==' and '!=', and
+// 0 for tokens that are no binary operator. The conditional '?:' binds less
+// strongly than all of them.
+static unsigned getPrecedence(const Token &Tok) {
+  if (Tok.isOneOf(Token::star, Token::slash))
+    return 5;
+  if (Tok.isOneOf(Token::plus, Token::minus))
+    return 4;
+  if (Tok.isOneOf(Token::less, Token::lessequal, Token::greater, Token::greaterequal))
+    return 3;
+  if (Tok.isOneOf(Token::equalequal, Token::exclaimequal))
+    return 2;
+  return 0;
+}
+
+// Returns the operator of a binary operator token.
+static BinaryOp::Operator getOperator(const Token &Tok) {
+  switch (Tok.getKind()) {
+  case Token::plus: return BinaryOp::Plus;
+  case Token::minus: return BinaryOp::Minus;
+  case Token::star: return BinaryOp::Mul;
+  case Token::slash: return BinaryOp::Div;
+  case Token::less: return BinaryOp::Lt;
+  case Token::lessequal: return BinaryOp::Le;
+  case Token::greater: return BinaryOp::Gt;
+  case Token::greaterequal: return BinaryOp::Ge;
+  case Token::equalequal: return BinaryOp::Eq;
+  case Token::exclaimequal: return BinaryOp::Ne;
+  default: llvm_unreachable("not a binary operator");
   }
-  
-  return Left;  // Return the resulting expression (could be a single term or a binary operation).
 }
 
-// Parses a term, which is a factor followed by optional multiplication or division operators.
-Expr *Parser::parseTerm() {
-  Expr *Left = parseFactor();  // Start by parsing the first factor.
-  
-  // Continue parsing as long as the current token is a multiplication or division operator.
-  while (Tok.isOneOf(Token::star, Token::slash)) {
-    // Determine the type of binary operation (multiplication or division).
-    BinaryOp::Operator Op = Tok.is(Token::star) ? BinaryOp::Mul : BinaryOp::Div;
-    advance();  // Consume the operator.
-    
-    // Parse the next factor after the operator.
-    Expr *Right = parseFactor();
-    
-    // Combine the left and right factors into a binary operation node (e.g., Left * Right).
-    Left = new BinaryOp(Op, Left, Right);
+// Parses an expression: operands combined with binary operators of the
+// precedences above, and conditionals 'c ? a : b', which group to the
+// right. An operand is a number, an identifier, a parenthesized expression
+// or a call of a builtin: min(a, b), max(a, b) or abs(x). Instead of
+// recursing for every precedence level and every parenthesis, the parser
+// keeps an explicit stack of the operators still waiting for their right
+// operand (operator precedence parsing), so the nesting depth is bounded only
+// by memory.
+Expr *Parser::parseExpr() {
+  // An operator with its left operand, or a marker that operators do not
+  // combine across: an open parenthesis, the open parenthesis of a builtin
+  // before or after its comma, or a conditional before or after its ':'.
+  struct Pending {
+    enum KindTy { Binary, Paren, Call, CallNext, Question, Colon } Kind;
+    Expr *Left = nullptr;   // The left operand, first argument, or condition.
+    Expr *Then = nullptr;   // For Colon, the value if the condition holds.
+    BinaryOp::Operator Op = BinaryOp::Plus;  // For Binary, Call and CallNext.
+    unsigned Prec = 0;      // For Binary.
+  };
+  llvm::SmallVector<Pending, 16> Stack;
+
+  for (;;) {
+    // Open parentheses and builtins start a nested expression.
+    for (;;) {
+      if (Tok.is(Token::l_paren)) {
+        advance();  // Consume the left parenthesis.
+        Stack.push_back({Pending::Paren});
+      } else if (Tok.isOneOf(Token::KW_min, Token::KW_max, Token::KW_abs)) {
+        // abs(x) is max(x, 0 - x), which takes the same path as max.
+        Pending Call{Pending::Call};
+        Call.Op = Tok.is(Token::KW_min) ? BinaryOp::Min : BinaryOp::Max;
+        if (Tok.is(Token::KW_abs))
+          Call.Kind = Pending::CallNext;
+        advance();  // Consume the name; its arguments are parsed anyway.
+        consume(Token::l_paren);
+        Stack.push_back(Call);
+      } else {
+        break;
+      }
+    }
+
+    // Parse the operand, a number or identifier.
+    Expr *Operand = parseFactor();
+
+    // Combine the operand with the operators on the stack that bind at least
+    // as strongly as the next operator; left operands are combined first, so
+    // operators of equal precedence associate to the left.
+    for (;;) {
+      unsigned Prec = getPrecedence(Tok);
+      while (!Stack.empty() && Stack.back().Kind == Pending::Binary &&
+             Stack.back().Prec >= Prec) {
+        if (!VerifyOnly)
+          Operand = Ctx.getBinaryOp(Stack.back().Op, Stack.back().Left, Operand);
+        Stack.pop_back();
+      }
+
+      // An operator waits on the stack for its right operand.
+      if (Prec) {
+        Stack.push_back({Pending::Binary, Operand, nullptr, getOperator(Tok), Prec});
+        advance();  // Consume the operator.
+        break;
+      }
+
+      // A '?' makes the operand the condition of a conditional.
+      if (Tok.is(Token::question)) {
+        Stack.push_back({Pending::Question, Operand});
+        advance();  // Consume the '?'.
+        break;
+      }
+
+      // Any other token completes the conditionals waiting for their last
+      // operand, the innermost first, so they group to the right.
+      while (!Stack.empty() && Stack.back().Kind == Pending::Colon) {
+        if (!VerifyOnly)
+          Operand = Ctx.getSelectOp(Stack.back().Left, Stack.back().Then, Operand);
+        Stack.pop_back();
+      }
+
+      // A ':' continues the innermost conditional with its last operand.
+      if (!Stack.empty() && Stack.back().Kind == Pending::Question) {
+        if (Tok.is(Token::colon)) {
+          Stack.back().Kind = Pending::Colon;
+          Stack.back().Then = Operand;
+          advance();  // Consume the ':'.
+          break;
+        }
+        errorExpected("':'");
+        Stack.pop_back();  // Drop the conditional, and look at the token again.
+        continue;
+      }
+
+      // Any other token ends the expression, or the innermost nested one.
+      if (Stack.empty())
+        return Operand;
+      Pending Nested = Stack.pop_back_val();
+
+      // The first argument of min and max is followed by a comma.
+      if (Nested.Kind == Pending::Call && !consume(Token::comma)) {
+        Stack.push_back({Pending::CallNext, Operand, nullptr, Nested.Op});
+        break;
+      }
+
+      // After a parenthesized expression, ensure that it is followed by a
+      // right parenthesis.
+      if (consume(Token::r_paren))
+        skipToOperator();  // If the right parenthesis is missing, handle the error.
+
+      if (Nested.Kind == Pending::CallNext && !VerifyOnly) {
+        Expr *Left = Nested.Left;
+        if (!Left) {
+          // abs(x): x is an operand of the subtraction and of max.
+          Left = Operand;
+          if (Left && !llvm::isa<Factor>(Left))
+            Left->setShared();
+          Operand = Ctx.getBinaryOp(BinaryOp::Minus, Ctx.getFactor(Factor::Number, "0"),
+                                    Left);
+        }
+        Operand = Ctx.getBinaryOp(Nested.Op, Left, Operand);
+      }
+    }
   }
-  
-  return Left;  // Return the resulting term (could be a single factor or a binary operation).
 }
 
-// Parses a factor, which could be a number, identifier, or parenthesized expression.
+// Parses a factor: a number or an identifier. Parenthesized expressions are
+// handled by parseExpr.
 Expr *Parser::parseFactor() {
   Expr *Res = nullptr;  // Initialize the result to null.
   
@@ -110,34 +323,50 @@ Expr *Parser::parseFactor() {
   
   // If the token is a number, create a Factor node for the number.
   case Token::number:
-    Res = new Factor(Factor::Number, Tok.getText());  // Store the number's value.
+    if (!VerifyOnly)
+      Res = Ctx.getFactor(Factor::Number, Tok.getText());  // Store the number's value.
+    // When verifying, check that the number fits the value type, as Sema
+    // would: once per calculation, unless the calculation has a syntax error.
+    else if (!HasError && !isRepresentable(Tok.getText(), Ty) &&
+             OutOfRange.insert(Tok.getText()).second)
+      semanticError(Tok.getLocation(), "Number " + Tok.getText() + " out of range for " +
+                                           getTypeName(Ty));
     advance();  // Consume the number token.
     break;
   
   // If the token is an identifier, create a Factor node for the identifier.
   case Token::ident:
-    Res = new Factor(Factor::Ident, Tok.getText());  // Store the identifier's name.
+    // When verifying, check that the variable is declared, as Sema would:
+    // once per calculation, unless the calculation has a syntax error.
+    if (VerifyOnly) {
+      if (!HasError && !Declared.count(Tok.getText()) &&
+          Undeclared.insert(Tok.getText()).second)
+        semanticError(Tok.getLocation(),
+                      "Variable " + Tok.getText() + " not declared");
+    } else {
+      // Store the identifier's name and its symbol, interned once here.
+      Res = Ctx.getFactor(Factor::Ident, Tok.getText(),
+                          Ctx.getSymbols().intern(Tok.getText()));
+    }
     advance();  // Consume the identifier token.
     break;
   
-  // If the token is a left parenthesis, parse the expression inside the parentheses.
-  case Token::l_paren:
-    advance();  // Consume the left parenthesis.
-    Res = parseExpr();  // Parse the expression inside the parentheses.
-    
-    // After parsing the expression, ensure that it is followed by a right parenthesis.
-    if (!consume(Token::r_paren)) break;  // If the right parenthesis is missing, handle the error.
-  
   // Default case to handle errors.
   default:
-    if (!Res)
-      error();  // If no valid factor was parsed, report an error.
-    
-    // Advance through the tokens until one that makes sense in the context (e.g., next operator or end).
-    while (!Tok.isOneOf(Token::r_paren, Token::star, Token::plus, Token::minus, Token::slash, Token::eoi))
-      advance();  // Skip tokens until reaching a valid end point (e.g., next operator or end of input).
+    errorExpected("expression");  // No valid factor was parsed, report an error.
+    skipToOperator();
   }
   
   return Res;  // Return the resulting factor (or null if there was an error).
 }
 
+// Advance through the tokens until one that makes sense in the context (e.g.,
+// the next operator or the end).
+void Parser::skipToOperator() {
+  while (!Tok.isOneOf(Token::r_paren, Token::star, Token::plus, Token::minus, Token::slash,
+                      Token::less, Token::lessequal, Token::greater, Token::greaterequal,
+                      Token::equalequal, Token::exclaimequal, Token::question, Token::colon,
+                      Token::comma, Token::semi, Token::eoi))
+    advance();  // Skip tokens until reaching a valid end point (e.g., next operator or end of input).
+}
+
@@ -2,19 +2,51 @@
 #define PARSER_H
 
 #include "AST.h"         // Include the AST header, which defines the structures for abstract syntax tree nodes.
+#include "Diagnostics.h" // Errors reported at their source locations.
 #include "Lexer.h"       // Include the Lexer header for tokenizing input.
+#include "ValueType.h"   // The type the numbers must fit when verifying.
+#include "llvm/ADT/DenseSet.h"  // The variables in scope when verifying.
 #include "llvm/Support/raw_ostream.h"  // LLVM's output support for printing error messages or debugging.
 
 class Parser {
   Lexer &Lex;        // Reference to the Lexer object. The parser interacts with the lexer to retrieve tokens.
+  ASTContext &Ctx;   // The context owning all AST nodes created by the parser.
+  const llvm::SourceMgr *SrcMgr;  // Locates the errors in the input, if given.
   Token Tok;         // The current token that the parser is examining.
   bool HasError;     // A flag to indicate whether a parsing error has occurred.
+  unsigned NumErrors = 0;   // The number of errors reported so far.
+  llvm::SMLoc LastErrorLoc; // The token of the last error, to report one per token.
 
-  // Function to report an error when an unexpected token is encountered.
-  void error() {
-    // Output the error message along with the unexpected token text.
-    llvm::errs() << "Unexpected: " << Tok.getText() << "\n";
+  // State used by verify() and verifyCatalog(), which check the declarations
+  // while parsing instead of building the AST. The names point into the input.
+  bool VerifyOnly = false;
+  bool HasSemanticError = false;
+  llvm::DenseSet<llvm::StringRef> Declared;    // The variables of the calculation.
+  llvm::DenseSet<llvm::StringRef> Undeclared;  // The undeclared ones reported in it.
+  llvm::DenseSet<llvm::StringRef> OutOfRange;  // The numbers out of range reported in it.
+  ValueType Ty = ValueType::I32;               // The type the numbers must fit.
+  llvm::DenseSet<llvm::StringRef> EntryNames;  // The names of the catalog entries.
+
+  // Report an error at the current token. After an error, the parser skips
+  // ahead and continues, so the error that caused the skip is not reported
+  // again at the token where it stops.
+  void error(const llvm::Twine &Msg) {
     HasError = true;  // Set the error flag to true.
+    if (Tok.getLocation() == LastErrorLoc)
+      return;
+    LastErrorLoc = Tok.getLocation();
+    ++NumErrors;
+    printDiagnostic(SrcMgr, Tok.getLocation(), Msg);
+  }
+
+  // Report that the current token is not the expected one.
+  void errorExpected(llvm::StringRef What);
+
+  // Report an error of the declarations when verifying, with the message Sema
+  // would print.
+  void semanticError(llvm::SMLoc Loc, const llvm::Twine &Msg) {
+    HasSemanticError = true;
+    printDiagnostic(SrcMgr, Loc, Msg);
   }
 
   // Advance the lexer to the next token by calling `Lex.next`.
@@ -24,7 +56,7 @@ class Parser {
   // Returns true if there was an error (i.e., the token did not match the expected kind).
   bool expect(Token::TokenKind Kind) {
     if (!Tok.is(Kind)) {  // Check if the current token matches the expected kind.
-      error();            // Report an error if the token does not match.
+      errorExpected(getSpelling(Kind));  // Report an error if the token does not match.
       return true;        // Return true to indicate an error.
     }
     return false;         // No error, return false.
@@ -39,30 +71,62 @@ class Parser {
     return false;         // No error, return false.
   }
 
+  // The text of a token kind, for diagnostics.
+  static llvm::StringRef getSpelling(Token::TokenKind Kind);
+
   // Top-level function for parsing a complete calculation (e.g., an expression or statement).
-  AST *parseCalc();
+  // The calculation must be followed by the token End, which is not consumed.
+  // Returns nullptr if it has syntax errors, after reporting all of them:
+  // the parser resynchronizes at the ':' of a 'with' and at End.
+  AST *parseCalc(Token::TokenKind End);
 
-  // Parse an expression (could involve operators like '+' or '-').
+  // Parse an expression (could involve arithmetic and comparison operators,
+  // conditionals, builtin calls and parentheses), without recursion.
   Expr *parseExpr();
 
-  // Parse a term (could involve multiplication or division operators).
-  Expr *parseTerm();
-
-  // Parse a factor (basic building blocks like numbers, parentheses, etc.).
+  // Parse a factor (the basic building blocks: numbers and identifiers).
   Expr *parseFactor();
 
+  // Skip tokens after an error, up to one that may continue the expression.
+  void skipToOperator();
+
 public:
-  // Constructor that initializes the parser with a reference to a lexer.
+  // Constructor that initializes the parser with a reference to a lexer and
+  // the context that allocates the AST nodes. Errors are reported at their
+  // locations if SrcMgr holds the buffer the lexer reads (see Diagnostics.h).
   // It immediately advances the lexer to retrieve the first token.
-  Parser(Lexer &Lex) : Lex(Lex), HasError(false) {
+  Parser(Lexer &Lex, ASTContext &Ctx, const llvm::SourceMgr *SrcMgr = nullptr)
+      : Lex(Lex), Ctx(Ctx), SrcMgr(SrcMgr), HasError(false) {
     advance();  // Start the lexer and get the first token.
   }
 
   // Parse the entire input, returning the root node of the abstract syntax tree (AST).
   AST *parse();
 
+  // Parse a catalog file: a list of 'name = <calc> ;' entries. Entries with
+  // syntax errors are reported and kept without a tree, so parsing continues
+  // after them, one pass reports the errors of all entries, and their names
+  // are still checked for duplicates.
+  void parseCatalog(llvm::SmallVectorImpl<CatalogEntry> &Entries);
+
+  // Check the syntax and the declarations of the input, or of a catalog, in
+  // one pass that builds no AST: the parser checks every identifier against
+  // the variables of its 'with' as it consumes it. The errors are those of
+  // parse() and Sema, except that declarations are checked only up to the
+  // first syntax error of a calculation. The numbers must fit Ty. Besides
+  // the names of the catalog entries, memory use does not grow with the
+  // input.
+  void verify(ValueType Ty = ValueType::I32);
+  void verifyCatalog(ValueType Ty = ValueType::I32);
+
   // Check if there was any parsing error.
   bool hasError() { return HasError; }
+
+  // Check if verifying found an error in the declarations.
+  bool hasSemanticError() const { return HasSemanticError; }
+
+  // The number of errors reported.
+  unsigned getNumErrors() const { return NumErrors; }
 };
 
 #endif  // End of header guard
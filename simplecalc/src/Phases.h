@@ -0,0 +1,17 @@
+#ifndef PHASES_H
+#define PHASES_H
+
+#include "llvm/Support/Timer.h"
+
+// PhaseTimer times one phase of the compiler while it is in scope. All
+// phases are reported together in the "calc" timer group when -time-phases
+// is given, and with -stats-json as part of the JSON output. A disabled
+// timer costs nothing.
+class PhaseTimer : public llvm::NamedRegionTimer {
+public:
+  PhaseTimer(llvm::StringRef Name, llvm::StringRef Description, bool Enabled)
+      : llvm::NamedRegionTimer(Name, Description, "calc", "calc phases",
+                               Enabled) {}
+};
+
+#endif
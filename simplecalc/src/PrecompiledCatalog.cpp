@@ -0,0 +1,276 @@
+#include "PrecompiledCatalog.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include <cstring>
+#include <mutex>
+
+using namespace llvm;
+
+namespace {
+
+// The layout of a file: the header, the index of the entries, the variable
+// table, the strings, and the objects. All offsets are from the start of the
+// file, and all values are in the byte order of the host, which the target
+// triple in the header stands for.
+constexpr char Magic[8] = {'C', 'A', 'L', 'C', 'P', 'C', '\r', '\n'};
+constexpr uint32_t FormatVersion = 1;
+
+enum : uint32_t { BatchFlag = 1, EvalFlag = 2, CheckedFlag = 4 };
+
+struct FileHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Type;  // The ValueType of all entries.
+  uint32_t Flags;
+  uint32_t NumEntries;
+  uint32_t NumVars;
+  uint32_t StringsSize;
+  uint32_t KeyOffset, KeySize;        // Into the strings.
+  uint32_t TripleOffset, TripleSize;
+};
+
+struct IndexEntry {
+  uint32_t NameOffset, NameSize;  // Into the strings.
+  uint32_t FirstVar, NumVars;     // Into the variable table.
+  uint64_t ObjectOffset, ObjectSize;
+};
+
+struct VarEntry {
+  uint32_t NameOffset, NameSize;
+};
+
+constexpr uint64_t ObjectAlign = 16;
+
+static_assert(sizeof(FileHeader) % 8 == 0 && sizeof(IndexEntry) % 8 == 0 &&
+                  sizeof(VarEntry) % 8 == 0,
+              "the tables of a file are 8-byte aligned");
+
+Error makeError(const Twine &Msg) {
+  return make_error<StringError>("invalid precompiled catalog: " + Msg,
+                                 inconvertibleErrorCode());
+}
+
+} // namespace
+
+Error PrecompiledCatalog::write(ArrayRef<CatalogEntry> Entries,
+                                const CodeGenOptions &Opts, unsigned NumThreads,
+                                raw_ostream &OS) {
+  auto TM = CodeGen::createHostTargetMachine(Opts.OptLevel);
+  if (!TM)
+    return TM.takeError();
+
+  // Compile the entries in shards, one per thread. A target machine is not
+  // thread-safe, so each worker uses its own, and every entry gets a context
+  // of its own, freed as soon as its object is written.
+  if (NumThreads == 0)
+    NumThreads = heavyweight_hardware_concurrency().compute_thread_count();
+  unsigned NumShards = std::max(1u, std::min<unsigned>(NumThreads, Entries.size()));
+  size_t ShardSize = (Entries.size() + NumShards - 1) / NumShards;
+  CodeGenOptions WorkerOpts = Opts;
+  WorkerOpts.TimePhases = false;  // Timers cannot run on several threads.
+  std::vector<SmallString<0>> Objects(Entries.size());
+  std::mutex ErrorMutex;
+  Error Err = Error::success();
+  ThreadPool Pool(heavyweight_hardware_concurrency(NumShards));
+  for (unsigned I = 0; I < NumShards; ++I) {
+    size_t Begin = std::min(I * ShardSize, Entries.size());
+    size_t End = std::min(Begin + ShardSize, Entries.size());
+    Pool.async([&, Begin, End] {
+      auto Res = [&]() -> Error {
+        auto WorkerTM = CodeGen::createHostTargetMachine(WorkerOpts.OptLevel);
+        if (!WorkerTM)
+          return WorkerTM.takeError();
+        CodeGen CG(WorkerOpts, WorkerTM->get());
+        for (size_t E = Begin; E < End; ++E) {
+          LLVMContext Ctx;
+          std::unique_ptr<Module> M = CG.generate(Entries.slice(E, 1), Ctx);
+          raw_svector_ostream ObjOS(Objects[E]);
+          if (Error Err = CG.emit(*M, EmitKind::Object, ObjOS))
+            return Err;
+        }
+        return Error::success();
+      }();
+      std::lock_guard<std::mutex> Lock(ErrorMutex);
+      Err = joinErrors(std::move(Err), std::move(Res));
+    });
+  }
+  Pool.wait();
+  if (Err)
+    return Err;
+
+  // Lay out the index, the variable table and the strings.
+  FileHeader Header = {};
+  std::memcpy(Header.Magic, Magic, sizeof(Magic));
+  Header.Version = FormatVersion;
+  Header.Type = static_cast<uint32_t>(Opts.Type);
+  Header.Flags = (Opts.Batch ? uint32_t(BatchFlag) : 0u) |
+                 (!Opts.Batch && Opts.Eval ? uint32_t(EvalFlag) : 0u) |
+                 (Opts.Checked && (Opts.Batch || Opts.Eval) ? uint32_t(CheckedFlag) : 0u);
+  Header.NumEntries = Entries.size();
+  std::string Strings;
+  auto AddString = [&](StringRef S, uint32_t &Offset, uint32_t &Size) {
+    Offset = Strings.size();
+    Size = S.size();
+    Strings += S;
+  };
+  AddString(Opts.getKey(), Header.KeyOffset, Header.KeySize);
+  AddString((*TM)->getTargetTriple().str(), Header.TripleOffset, Header.TripleSize);
+
+  std::vector<IndexEntry> Index(Entries.size());
+  std::vector<VarEntry> VarTable;
+  for (size_t I = 0; I < Entries.size(); ++I) {
+    AddString(Entries[I].Name, Index[I].NameOffset, Index[I].NameSize);
+    Index[I].FirstVar = VarTable.size();
+    if (auto *W = dyn_cast<WithDecl>(Entries[I].Tree))
+      for (StringRef Var : W->getVars()) {
+        VarTable.emplace_back();
+        AddString(Var, VarTable.back().NameOffset, VarTable.back().NameSize);
+      }
+    Index[I].NumVars = VarTable.size() - Index[I].FirstVar;
+  }
+  Header.NumVars = VarTable.size();
+  Header.StringsSize = Strings.size();
+
+  uint64_t Offset = alignTo(sizeof(FileHeader) + Index.size() * sizeof(IndexEntry) +
+                                VarTable.size() * sizeof(VarEntry) + Strings.size(),
+                            ObjectAlign);
+  for (size_t I = 0; I < Entries.size(); ++I) {
+    Index[I].ObjectOffset = Offset;
+    Index[I].ObjectSize = Objects[I].size();
+    Offset = alignTo(Offset + Objects[I].size(), ObjectAlign);
+  }
+
+  uint64_t Written = 0;
+  auto Write = [&](const void *Data, size_t Size) {
+    OS.write(static_cast<const char *>(Data), Size);
+    Written += Size;
+  };
+  auto Pad = [&] {
+    uint64_t Size = alignTo(Written, ObjectAlign) - Written;
+    OS.write_zeros(Size);
+    Written += Size;
+  };
+  Write(&Header, sizeof(Header));
+  Write(Index.data(), Index.size() * sizeof(IndexEntry));
+  Write(VarTable.data(), VarTable.size() * sizeof(VarEntry));
+  Write(Strings.data(), Strings.size());
+  Pad();
+  for (const SmallString<0> &Obj : Objects) {
+    Write(Obj.data(), Obj.size());
+    Pad();
+  }
+  return Error::success();
+}
+
+Expected<std::unique_ptr<PrecompiledCatalog>>
+PrecompiledCatalog::open(StringRef Path, CalcJIT &JIT) {
+  // Large files are mapped instead of being read.
+  auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!Buf)
+    return createStringError(Buf.getError(), "cannot read %s: %s",
+                             Path.str().c_str(), Buf.getError().message().c_str());
+  std::unique_ptr<PrecompiledCatalog> Catalog(new PrecompiledCatalog(std::move(*Buf), JIT));
+  if (Error Err = Catalog->load(sys::path::filename(Path)))
+    return std::move(Err);
+  return std::move(Catalog);
+}
+
+// Check the index and add a stub and an object for every entry to the JIT.
+Error PrecompiledCatalog::load(StringRef Name) {
+  const char *Start = Buffer->getBufferStart();
+  uint64_t Size = Buffer->getBufferSize();
+  if (reinterpret_cast<uintptr_t>(Start) % 8)
+    return makeError("the buffer is not aligned");
+  FileHeader Header;
+  if (Size < sizeof(Header))
+    return makeError("the file is too short");
+  std::memcpy(&Header, Start, sizeof(Header));
+  if (std::memcmp(Header.Magic, Magic, sizeof(Magic)))
+    return makeError("bad magic number");
+  if (Header.Version != FormatVersion)
+    return makeError("unsupported version " + Twine(Header.Version));
+  if (Header.Type > static_cast<uint32_t>(ValueType::F64))
+    return makeError("unknown value type");
+  uint64_t VarsOffset = sizeof(Header) + uint64_t(Header.NumEntries) * sizeof(IndexEntry);
+  uint64_t StringsOffset = VarsOffset + uint64_t(Header.NumVars) * sizeof(VarEntry);
+  if (StringsOffset + Header.StringsSize > Size)
+    return makeError("the index is truncated");
+  StringRef Strings(Start + StringsOffset, Header.StringsSize);
+  auto GetString = [&](uint32_t Offset, uint32_t Size, StringRef &S) {
+    if (uint64_t(Offset) + Size > Strings.size())
+      return false;
+    S = Strings.substr(Offset, Size);
+    return true;
+  };
+  StringRef Triple;
+  if (!GetString(Header.KeyOffset, Header.KeySize, Key) ||
+      !GetString(Header.TripleOffset, Header.TripleSize, Triple))
+    return makeError("the header is out of bounds");
+  if (Triple != JIT.getTargetTriple().str())
+    return createStringError(inconvertibleErrorCode(),
+                             "the catalog was compiled for %s, not for %s",
+                             Triple.str().c_str(), JIT.getTargetTriple().str().c_str());
+  Type = static_cast<ValueType>(Header.Type);
+  Batch = Header.Flags & BatchFlag;
+  Eval = Header.Flags & EvalFlag;
+  Checked = Header.Flags & CheckedFlag;
+
+  auto *VarTable = reinterpret_cast<const VarEntry *>(Start + VarsOffset);
+  Vars.resize(Header.NumVars);
+  for (uint32_t I = 0; I < Header.NumVars; ++I)
+    if (!GetString(VarTable[I].NameOffset, VarTable[I].NameSize, Vars[I]))
+      return makeError("variable " + Twine(I) + " is out of bounds");
+
+  auto StubDylib = JIT.createDylib(Name);
+  if (!StubDylib)
+    return StubDylib.takeError();
+  auto ImplDylib = JIT.createDylib((Name + ".impl").str());
+  if (!ImplDylib)
+    return ImplDylib.takeError();
+  StubJD = &*StubDylib;
+  ImplJD = &*ImplDylib;
+
+  auto *Index = reinterpret_cast<const IndexEntry *>(Start + sizeof(Header));
+  Entries.resize(Header.NumEntries);
+  SmallString<32> Columns;
+  for (uint32_t I = 0; I < Header.NumEntries; ++I) {
+    const IndexEntry &IE = Index[I];
+    Entry &E = Entries[I];
+    if (!GetString(IE.NameOffset, IE.NameSize, E.Name) ||
+        uint64_t(IE.FirstVar) + IE.NumVars > Vars.size() ||
+        IE.ObjectOffset > Size || IE.ObjectSize > Size - IE.ObjectOffset)
+      return makeError("entry " + Twine(I) + " is out of bounds");
+    E.Vars = makeArrayRef(Vars).slice(IE.FirstVar, IE.NumVars);
+    if (!EntryIndex.try_emplace(E.Name, I).second)
+      return makeError("duplicate entry " + E.Name);
+
+    // The buffer only refers to the mapping. A batch function comes with
+    // its column count.
+    auto Obj = MemoryBuffer::getMemBuffer(
+        StringRef(Start + IE.ObjectOffset, IE.ObjectSize), E.Name,
+        /*RequiresNullTerminator=*/false);
+    SmallVector<StringRef, 1> Data;
+    if (Batch) {
+      Columns = E.Name;
+      Columns += "_columns";
+      Data.push_back(Columns);
+    }
+    if (Error Err = JIT.addLazyObject(*StubJD, *ImplJD, std::move(Obj), E.Name, Data))
+      return Err;
+  }
+  return Error::success();
+}
+
+const PrecompiledCatalog::Entry *PrecompiledCatalog::find(StringRef Name) const {
+  auto It = EntryIndex.find(Name);
+  return It == EntryIndex.end() ? nullptr : &Entries[It->second];
+}
+
+Expected<JITTargetAddress> PrecompiledCatalog::lookup(StringRef Name) {
+  return JIT.lookup(*StubJD, Name);
+}
@@ -0,0 +1,80 @@
+#ifndef PRECOMPILEDCATALOG_H
+#define PRECOMPILEDCATALOG_H
+
+#include "AST.h"
+#include "CodeGen.h"
+#include "JIT.h"
+#include "ValueType.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <vector>
+
+// A precompiled catalog holds the native code of every entry of a catalog in
+// an object file of its own, together with an index of the entries: their
+// names and the variables of their 'with' declarations. It is written once
+// with -emit=pcat, and loaded at startup instead of compiling the catalog.
+//
+// Loading maps the file and reads only the index. Every entry gets a stub in
+// the JIT; the first call of a stub links the entry's object and jumps to
+// it, so the cost of startup depends on the size of the index, and that of
+// the code on the entries actually used.
+class PrecompiledCatalog {
+public:
+  struct Entry {
+    llvm::StringRef Name;
+    llvm::ArrayRef<llvm::StringRef> Vars;  // In the order of their declaration.
+  };
+
+private:
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;  // The file; the objects point into it.
+  CalcJIT &JIT;
+  llvm::orc::JITDylib *StubJD = nullptr;       // The stubs, looked up by name.
+  llvm::orc::JITDylib *ImplJD = nullptr;       // The objects behind them.
+  ValueType Type = ValueType::I32;
+  bool Batch = false;
+  bool Eval = false;
+  bool Checked = false;
+  llvm::StringRef Key;
+  std::vector<llvm::StringRef> Vars;           // The variables of all entries.
+  std::vector<Entry> Entries;
+  llvm::StringMap<unsigned> EntryIndex;
+
+  PrecompiledCatalog(std::unique_ptr<llvm::MemoryBuffer> Buffer, CalcJIT &JIT)
+      : Buffer(std::move(Buffer)), JIT(JIT) {}
+
+  llvm::Error load(llvm::StringRef Name);
+
+public:
+  // Compile every entry with the given options into an object file of its
+  // own, on NumThreads threads (0: all cores), and write them with the index.
+  static llvm::Error write(llvm::ArrayRef<CatalogEntry> Entries,
+                           const CodeGenOptions &Opts, unsigned NumThreads,
+                           llvm::raw_ostream &OS);
+
+  // Map a file into memory and add its entries to the JIT, in dylibs of
+  // their own. The code must have been compiled for the host.
+  static llvm::Expected<std::unique_ptr<PrecompiledCatalog>>
+  open(llvm::StringRef Path, CalcJIT &JIT);
+
+  // The options the code was compiled with (see CodeGenOptions::getKey).
+  llvm::StringRef getKey() const { return Key; }
+  ValueType getType() const { return Type; }
+  // Whether the entries are calc_batch or calc_eval functions instead of
+  // 'main' functions.
+  bool isBatch() const { return Batch; }
+  bool isEval() const { return Eval; }
+  // Whether they return their overflows (see CodeGenOptions::Checked).
+  bool isChecked() const { return Checked; }
+
+  llvm::ArrayRef<Entry> entries() const { return Entries; }
+  const Entry *find(llvm::StringRef Name) const;
+
+  // Look up the stub of an entry. Calling it links the code first.
+  llvm::Expected<llvm::JITTargetAddress> lookup(llvm::StringRef Name);
+};
+
+#endif
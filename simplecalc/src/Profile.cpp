@@ -0,0 +1,89 @@
+#include "Profile.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/xxhash.h"  // Hash that is stable across runs.
+#include <algorithm>
+
+using namespace llvm;
+
+Optional<int64_t> ValueProfile::Variable::getDominantValue(double Fraction) const {
+  if (Count < MinCount)
+    return None;
+  for (auto [Val, N] : Values)
+    if (N >= Fraction * Count)
+      return Val;
+  return None;
+}
+
+Expected<ValueProfile> ValueProfile::read(StringRef Path) {
+  auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/true);
+  if (!Buffer)
+    return createStringError(Buffer.getError(), "cannot read the profile %s",
+                             Path.str().c_str());
+  return parse((*Buffer)->getBuffer(), Path);
+}
+
+// Parse the lines written by calc_profile_write. The lines of a variable
+// that occurs more than once, e.g. in profiles of several runs that were
+// concatenated, are merged.
+Expected<ValueProfile> ValueProfile::parse(StringRef Text, StringRef Name) {
+  ValueProfile Profile;
+  Profile.Hash = xxHash64(Text);
+  unsigned LineNo = 0;
+  for (StringRef Rest = Text; !Rest.empty();) {
+    StringRef Line;
+    std::tie(Line, Rest) = Rest.split('\n');
+    ++LineNo;
+    Line = Line.trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+    auto Invalid = [&] {
+      return createStringError(inconvertibleErrorCode(),
+                               "%s:%u: invalid profile line",
+                               Name.str().c_str(), LineNo);
+    };
+
+    SmallVector<StringRef, 16> Fields;
+    Line.split(Fields, ',');
+    Variable New;
+    if (Fields.size() < 6 || Fields[0].empty() || Fields[1].empty() ||
+        Fields[2].getAsInteger(10, New.Count) || Fields[3].getAsInteger(10, New.Min) ||
+        Fields[4].getAsInteger(10, New.Max) || Fields[5].getAsInteger(10, New.Other) ||
+        New.Min > New.Max)
+      return Invalid();
+    for (StringRef Field : makeArrayRef(Fields).drop_front(6)) {
+      auto [ValText, CountText] = Field.split(':');
+      int64_t Val;
+      uint64_t N;
+      if (ValText.getAsInteger(10, Val) || CountText.getAsInteger(10, N))
+        return Invalid();
+      New.Values.emplace_back(Val, N);
+    }
+
+    auto [It, Inserted] = Profile.Vars.try_emplace(getKey(Fields[0], Fields[1]), New);
+    if (Inserted || New.Count == 0)
+      continue;
+    Variable &Old = It->second;
+    if (Old.Count == 0) {
+      Old = New;
+      continue;
+    }
+    Old.Count += New.Count;
+    Old.Other += New.Other;
+    Old.Min = std::min(Old.Min, New.Min);
+    Old.Max = std::max(Old.Max, New.Max);
+    for (auto [Val, N] : New.Values) {
+      auto *Slot = find_if(Old.Values, [&](auto &P) { return P.first == Val; });
+      if (Slot != Old.Values.end())
+        Slot->second += N;
+      else
+        Old.Values.emplace_back(Val, N);
+    }
+  }
+  return std::move(Profile);
+}
+
+const ValueProfile::Variable *ValueProfile::lookup(StringRef Function,
+                                                   StringRef Var) const {
+  auto It = Vars.find(getKey(Function, Var));
+  return It == Vars.end() ? nullptr : &It->second;
+}
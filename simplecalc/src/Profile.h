@@ -0,0 +1,56 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <utility>
+
+// The values of the 'with' variables recorded by instrumented code (see
+// ProfileRuntime.h), read back to specialize the code generated for them
+// (see CodeGenOptions::Profile).
+class ValueProfile {
+public:
+  // The values of one variable.
+  struct Variable {
+    uint64_t Count = 0;
+    uint64_t Other = 0;  // Values without a count of their own.
+    int64_t Min = 0;
+    int64_t Max = 0;
+    llvm::SmallVector<std::pair<int64_t, uint64_t>, 8> Values;  // With their counts.
+
+    // The value that at least the given fraction of the values had, if the
+    // variable was seen often enough to tell. A fraction of 1 asks for a
+    // variable that only ever had one value.
+    llvm::Optional<int64_t> getDominantValue(double Fraction) const;
+  };
+
+  // A variable needs this many values before it is specialized for.
+  static constexpr uint64_t MinCount = 100;
+
+private:
+  llvm::StringMap<Variable> Vars;  // By function and variable, see getKey().
+  uint64_t Hash = 0;
+
+  static std::string getKey(llvm::StringRef Function, llvm::StringRef Var) {
+    return (Function + "," + Var).str();
+  }
+
+public:
+  // Read a profile written by calc_profile_write.
+  static llvm::Expected<ValueProfile> read(llvm::StringRef Path);
+  static llvm::Expected<ValueProfile> parse(llvm::StringRef Text,
+                                            llvm::StringRef Name);
+
+  // The values of a variable of a function, or nullptr if none were recorded.
+  const Variable *lookup(llvm::StringRef Function, llvm::StringRef Var) const;
+
+  // A hash of the profile, so code specialized for different profiles can be
+  // told apart.
+  uint64_t getHash() const { return Hash; }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "ProfileRuntime.h"
+#include <cinttypes> // PRId64 and PRIu64.
+#include <cstdio>
+#include <cstdlib>   // For atexit() and getenv().
+#include <cstring>
+
+namespace {
+
+// The records that saw a value, the latest first.
+calc_value_profile *Head = nullptr;
+
+void writeAtExit() {
+  if (calc_profile_write(nullptr))
+    std::fprintf(stderr, "calc: cannot write the value profile\n");
+}
+
+} // namespace
+
+extern "C" {
+
+void calc_profile(calc_value_profile *P, int64_t Val) {
+  if (P->Count++ == 0) {
+    static bool Registered = false;
+    if (!Registered) {
+      std::atexit(writeAtExit);
+      Registered = true;
+    }
+    P->Next = Head;
+    Head = P;
+    P->Min = P->Max = Val;
+  } else if (Val < P->Min) {
+    P->Min = Val;
+  } else if (Val > P->Max) {
+    P->Max = Val;
+  }
+
+  // The slots fill up in order, so the first empty one ends the search.
+  for (int I = 0; I < CALC_PROFILE_VALUES; ++I) {
+    if (P->Counts[I] == 0)
+      P->Values[I] = Val;
+    else if (P->Values[I] != Val)
+      continue;
+    ++P->Counts[I];
+    return;
+  }
+  ++P->Other;
+}
+
+int calc_profile_write(const char *Path) {
+  if (!Head)
+    return 0;
+  if (!Path) {
+    Path = std::getenv("CALC_PROFILE");
+    if (!Path || !*Path)
+      Path = "calc.profile";
+  }
+  std::FILE *File = std::fopen(Path, "w");
+  if (!File)
+    return 1;
+
+  std::fprintf(File, "# function,variable,count,min,max,other[,value:count]...\n");
+  for (calc_value_profile *P = Head; P; P = P->Next) {
+    std::fprintf(File, "%s,%s,%" PRIu64 ",%" PRId64 ",%" PRId64 ",%" PRIu64,
+                 P->Function, P->Variable, P->Count, P->Min, P->Max, P->Other);
+    for (int I = 0; I < CALC_PROFILE_VALUES && P->Counts[I]; ++I)
+      std::fprintf(File, ",%" PRId64 ":%" PRIu64, P->Values[I], P->Counts[I]);
+    std::fputc('\n', File);
+  }
+
+  // Empty the records, so they start over if the code runs again.
+  while (calc_value_profile *P = Head) {
+    Head = P->Next;
+    P->Next = nullptr;
+    P->Count = P->Other = 0;
+    std::memset(P->Counts, 0, sizeof(P->Counts));
+  }
+  return std::fclose(File) != 0;
+}
+}
@@ -0,0 +1,54 @@
+#ifndef PROFILERUNTIME_H
+#define PROFILERUNTIME_H
+
+#include <cstdint>
+
+// The runtime of instrumented code (see CodeGenOptions::Instrument), which
+// records the values of the 'with' variables of integer expressions. The
+// generated code owns one record per variable, a global initialized with
+// the names of its function and variable, and passes it with every value:
+//
+//   calc_profile(&a.profile, a);
+//
+// A record keeps the number, minimum and maximum of the values, and counts
+// the first values that differ, up to CALC_PROFILE_VALUES of them. A record
+// joins the list of the records to write when it sees its first value.
+//
+// The profile is written in text, one line per variable:
+//
+//   function,variable,count,min,max,other[,value:count]...
+//
+// where 'other' counts the values that had no slot of their own. It is read
+// back with ValueProfile (see Profile.h) to specialize the code.
+//
+// Programs linked with the runtime write the profile to the file named by the
+// environment variable CALC_PROFILE, or calc.profile, when they exit. The
+// runtime is not thread-safe; instrumented code is meant for one profiling
+// run at a time. ProfileRuntime.cpp does not depend on LLVM.
+extern "C" {
+
+enum { CALC_PROFILE_VALUES = 8 };
+
+// The layout the generated code creates its records with.
+struct calc_value_profile {
+  const char *Function;
+  const char *Variable;
+  calc_value_profile *Next;   // The list of records that saw a value.
+  uint64_t Count;
+  uint64_t Other;
+  int64_t Min;
+  int64_t Max;
+  int64_t Values[CALC_PROFILE_VALUES];
+  uint64_t Counts[CALC_PROFILE_VALUES];
+};
+
+// Record a value, sign-extended to 64 bits.
+void calc_profile(calc_value_profile *P, int64_t Val);
+
+// Write the records that saw a value to the file at Path, or the default one
+// if Path is null, and start over with none. Writes no file if there are no
+// records. Returns 0 on success.
+int calc_profile_write(const char *Path);
+}
+
+#endif
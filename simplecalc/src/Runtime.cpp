@@ -0,0 +1,74 @@
+#include "Runtime.h"
+#include "llvm/Support/ErrorHandling.h" // report_fatal_error() for invalid divisions.
+#include <charconv>                    // For printing floating-point values.
+#include <cstdlib>                     // For exit().
+#include <iostream>                    // For reading the user input.
+#include <string>
+
+bool parseValue(llvm::StringRef Text, int32_t &Val) { return Text.getAsInteger(10, Val); }
+bool parseValue(llvm::StringRef Text, int64_t &Val) { return Text.getAsInteger(10, Val); }
+bool parseValue(llvm::StringRef Text, double &Val) { return Text.getAsDouble(Val); }
+bool parseValue(llvm::StringRef Text, float &Val) {
+  double D;
+  if (Text.getAsDouble(D))
+    return true;
+  Val = static_cast<float>(D);
+  return false;
+}
+
+namespace {
+
+template <typename T> void printFloat(llvm::raw_ostream &OS, T Val) {
+  char Buf[32];
+  std::to_chars_result Res = std::to_chars(Buf, Buf + sizeof(Buf), Val);
+  OS << llvm::StringRef(Buf, Res.ptr - Buf);
+}
+
+} // namespace
+
+void printValue(llvm::raw_ostream &OS, int32_t Val) { OS << Val; }
+void printValue(llvm::raw_ostream &OS, int64_t Val) { OS << Val; }
+void printValue(llvm::raw_ostream &OS, float Val) { printFloat(OS, Val); }
+void printValue(llvm::raw_ostream &OS, double Val) { printFloat(OS, Val); }
+
+namespace {
+
+// Prompt the user for the value of a variable and read it from standard input.
+template <typename T> T readValue(const char *Name) {
+  llvm::outs() << "Enter a value for " << Name << ": ";
+  llvm::outs().flush();  // Make sure the prompt is visible before blocking.
+
+  std::string Buf;
+  std::getline(std::cin, Buf);
+
+  // Convert the input line to a value, rejecting anything else.
+  T Val;
+  if (parseValue(llvm::StringRef(Buf).trim(), Val)) {
+    llvm::errs() << "Invalid input: " << Buf << "\n";
+    std::exit(1);
+  }
+  return Val;
+}
+
+// Print the result of a calculation.
+template <typename T> void writeValue(T Val) {
+  llvm::outs() << "The result is: ";
+  printValue(llvm::outs(), Val);
+  llvm::outs() << "\n";
+  llvm::outs().flush();
+}
+
+} // namespace
+
+int calc_read(const char *Name) { return readValue<int32_t>(Name); }
+int64_t calc_read_i64(const char *Name) { return readValue<int64_t>(Name); }
+float calc_read_f32(const char *Name) { return readValue<float>(Name); }
+double calc_read_f64(const char *Name) { return readValue<double>(Name); }
+
+void calc_write(int Val) { writeValue(Val); }
+void calc_write_i64(int64_t Val) { writeValue(Val); }
+void calc_write_f32(float Val) { writeValue(Val); }
+void calc_write_f64(double Val) { writeValue(Val); }
+
+// The message of arith::div, so both tiers of the tiered engine fail alike.
+void calc_div_error() { llvm::report_fatal_error("calc: integer division overflow"); }
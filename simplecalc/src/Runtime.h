@@ -0,0 +1,47 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+
+// In-process versions of the calc runtime functions.
+// The generated code calls these when it runs inside the JIT instead of being
+// linked against rtcalc.cpp.
+extern "C" {
+
+// Prompt for the value of the variable named `Name` and return it.
+int calc_read(const char *Name);
+
+// Print the result of a calculation.
+void calc_write(int Val);
+
+// The same functions for the other value types (see ValueType.h). The i32
+// versions keep their original names.
+int64_t calc_read_i64(const char *Name);
+float calc_read_f32(const char *Name);
+double calc_read_f64(const char *Name);
+void calc_write_i64(int64_t Val);
+void calc_write_f32(float Val);
+void calc_write_f64(double Val);
+
+// Report an integer division by zero, or of the smallest value by -1, in
+// code generated with CodeGenOptions::Wrapping, like the bytecode VM does.
+[[noreturn]] void calc_div_error();
+}
+
+// Convert the text of a value to the given type, returning true on errors.
+// The runtime and the batch driver read their input with these.
+bool parseValue(llvm::StringRef Text, int32_t &Val);
+bool parseValue(llvm::StringRef Text, int64_t &Val);
+bool parseValue(llvm::StringRef Text, float &Val);
+bool parseValue(llvm::StringRef Text, double &Val);
+
+// Print a value. Floating-point values are printed with the fewest digits
+// that read back as the same value.
+void printValue(llvm::raw_ostream &OS, int32_t Val);
+void printValue(llvm::raw_ostream &OS, int64_t Val);
+void printValue(llvm::raw_ostream &OS, float Val);
+void printValue(llvm::raw_ostream &OS, double Val);
+
+#endif
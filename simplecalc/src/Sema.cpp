@@ -1,29 +1,133 @@
 #include "Sema.h"
-#include "llvm/ADT/StringSet.h"        // LLVM's StringSet is used to track variable names in the scope.
+#include "Diagnostics.h"               // Errors reported at their source locations.
+#include "llvm/ADT/DenseSet.h"         // The undeclared variables reported already.
+#include "llvm/ADT/SmallPtrSet.h"      // The operations checked already.
+#include "llvm/ADT/StringExtras.h"     // isAlpha() and isDigit() to find whole tokens.
+#include "llvm/ADT/StringSet.h"        // LLVM's StringSet is used to track the names of catalog entries.
 #include "llvm/Support/raw_ostream.h"  // For error reporting using llvm's output streams.
 
 namespace {
 
-// DeclCheck class performs semantic analysis by visiting AST nodes to check variable declarations and usages.
-class DeclCheck : public ASTVisitor {
-  llvm::StringSet<> Scope;  // A set of declared variables to track which variables are in scope.
-  bool HasError;            // Flag indicating whether an error has been encountered.
+// Enumeration to represent different types of semantic errors.
+enum ErrorType { Twice, Not };
+
+// Print an error message to the error stream indicating the variable and the type of error.
+void printDeclError(const llvm::SourceMgr *SrcMgr, llvm::SMLoc Loc, ErrorType ET,
+                    llvm::StringRef V) {
+  printDiagnostic(SrcMgr, Loc,
+                  "Variable " + V + " " + (ET == Twice ? "already" : "not") +
+                      " declared");
+}
+
+// The location of the first use of the identifier or number Text in Source,
+// or an invalid one if there is none. Identifiers consist of letters only,
+// numbers of digits only.
+llvm::SMLoc findToken(llvm::StringRef Source, llvm::StringRef Text) {
+  bool (*IsPart)(char) = llvm::isDigit(Text.front()) ? llvm::isDigit : llvm::isAlpha;
+  for (size_t Pos = Source.find(Text); Pos != llvm::StringRef::npos;
+       Pos = Source.find(Text, Pos + 1)) {
+    size_t End = Pos + Text.size();
+    if ((Pos == 0 || !IsPart(Source[Pos - 1])) &&
+        (End == Source.size() || !IsPart(Source[End])))
+      return llvm::SMLoc::getFromPointer(Source.data() + Pos);
+  }
+  return llvm::SMLoc();
+}
+
+// Reports the numbers of one calculation that the value type cannot
+// represent, each once. The nodes of equal numbers may be shared, so like
+// undeclared variables, they are reported at their first use in the source.
+class OutOfRangeNumbers {
+  const llvm::SourceMgr *SrcMgr;
+  llvm::StringRef Source;
+  ValueType Ty;
+  llvm::SmallDenseSet<llvm::StringRef, 4> Reported;
+
+public:
+  OutOfRangeNumbers(const llvm::SourceMgr *SrcMgr, llvm::StringRef Source, ValueType Ty)
+      : SrcMgr(SrcMgr), Source(Source), Ty(Ty) {}
+
+  // Returns false for a number that does not fit, after reporting it.
+  bool check(llvm::StringRef Number) {
+    if (isRepresentable(Number, Ty))
+      return true;
+    if (Reported.insert(Number).second)
+      printDiagnostic(SrcMgr, findToken(Source, Number),
+                      "Number " + Number + " out of range for " + getTypeName(Ty));
+    return false;
+  }
+};
+
+// Reports the undeclared variables of one calculation, each once.
+class UndeclaredVars {
+  const llvm::SourceMgr *SrcMgr;
+  llvm::StringRef Source;
+  llvm::SmallDenseSet<uint32_t, 8> Reported;
 
-  // Enumeration to represent different types of semantic errors.
-  enum ErrorType { Twice, Not };
+public:
+  UndeclaredVars(const llvm::SourceMgr *SrcMgr, llvm::StringRef Source)
+      : SrcMgr(SrcMgr), Source(Source) {}
 
-  // Function to report errors about variable declarations or usages.
-  void error(ErrorType ET, llvm::StringRef V) {
-    // Print an error message to the error stream indicating the variable and the type of error.
-    llvm::errs() << "Variable " << V << " "
-                 << (ET == Twice ? "already" : "not")
-                 << " declared\n";
-    HasError = true;  // Set the HasError flag to true.
+  void report(uint32_t Sym, llvm::StringRef Name) {
+    if (Reported.insert(Sym).second)
+      printDeclError(SrcMgr, findToken(Source, Name), Not, Name);
   }
+};
+
+// VarScope is the set of declared variables, indexed by symbol ID, so checking
+// an identifier needs no hashing. It is shared by consecutive checks, which
+// remove their declarations again when they are done.
+class VarScope {
+  llvm::BitVector &Declared;
+  llvm::ArrayRef<uint32_t> Vars;
 
 public:
-  // Constructor to initialize the HasError flag.
-  DeclCheck() : HasError(false) {}
+  VarScope(llvm::BitVector &Declared) : Declared(Declared) {}
+  ~VarScope() {
+    for (uint32_t Sym : Vars)
+      Declared.reset(Sym);
+  }
+
+  // Declare the variables of a 'with'. Returns false for the variables that
+  // were already declared, after reporting them. The names point into the
+  // source, which locates the errors.
+  bool declare(llvm::ArrayRef<llvm::StringRef> Names,
+               llvm::ArrayRef<uint32_t> Syms, const llvm::SourceMgr *SrcMgr) {
+    Vars = Syms;
+    bool Ok = true;
+    for (size_t I = 0, E = Syms.size(); I != E; ++I) {
+      if (Syms[I] >= Declared.size())
+        Declared.resize(Syms[I] + 1);
+      if (Declared.test(Syms[I])) {
+        printDeclError(SrcMgr, llvm::SMLoc::getFromPointer(Names[I].data()),
+                       Twice, Names[I]);
+        Ok = false;
+      }
+      Declared.set(Syms[I]);
+    }
+    return Ok;
+  }
+
+  bool contains(uint32_t Sym) const {
+    return Sym < Declared.size() && Declared.test(Sym);
+  }
+};
+
+// DeclCheck class performs semantic analysis by visiting AST nodes to check variable declarations and usages.
+class DeclCheck : public ASTVisitor {
+  VarScope Scope;           // The declared variables, to track which variables are in scope.
+  llvm::SmallPtrSet<Expr *, 32> Checked;  // Shared subexpressions are checked only once.
+  const llvm::SourceMgr *SrcMgr;  // Locates the errors, if given.
+  UndeclaredVars Undeclared;      // Reports the uses of undeclared variables.
+  OutOfRangeNumbers OutOfRange;   // Reports the numbers the value type cannot hold.
+  bool HasError;            // Flag indicating whether an error has been encountered.
+
+public:
+  // Constructor to initialize the scope and the HasError flag.
+  DeclCheck(llvm::BitVector &Declared, const llvm::SourceMgr *SrcMgr,
+            llvm::StringRef Source, ValueType Ty)
+      : Scope(Declared), SrcMgr(SrcMgr), Undeclared(SrcMgr, Source),
+        OutOfRange(SrcMgr, Source, Ty), HasError(false) {}
 
   // Returns whether any semantic errors have been found during the analysis.
   bool hasError() { return HasError; }
@@ -34,36 +138,50 @@ public:
     // Check if the Factor node is an identifier.
     if (Node.getKind() == Factor::Ident) {
       // If the identifier is not found in the scope, it hasn't been declared.
-      if (Scope.find(Node.getVal()) == Scope.end())
-        error(Not, Node.getVal());  // Report an error for an undeclared variable.
+      if (!Scope.contains(Node.getSymbol())) {
+        Undeclared.report(Node.getSymbol(), Node.getVal());  // Report an error for an undeclared variable.
+        HasError = true;
+      }
+    } else if (!OutOfRange.check(Node.getVal())) {
+      HasError = true;  // A number must fit the value type, not be truncated.
     }
   };
 
+  // Checks the operands of an operation or conditional, and the operations
+  // below it, without recursion.
+  void checkOperands(Expr *E) {
+    evaluatePostOrder<bool>(
+        E,
+        [&](Factor *F) {
+          if (F)
+            visit(*F);
+          else
+            HasError = true;  // If an operand is missing, set the HasError flag.
+          return true;
+        },
+        [](BinaryOp *, bool, bool) { return true; },
+        [](SelectOp *, bool, bool, bool) { return true; },
+        [&](Expr *N, bool &) {
+          // A shared operation is checked once.
+          return N->isShared() && !Checked.insert(N).second;
+        });
+  }
+
   // Visit a BinaryOp node (which represents a binary operation like +, -, *, /).
   // This ensures that both the left and right operands of the binary operation are valid expressions.
-  virtual void visit(BinaryOp &Node) override {
-    // Visit the left operand of the binary operation.
-    if (Node.getLeft())
-      Node.getLeft()->accept(*this);  // Recursively check the left expression.
-    else
-      HasError = true;  // If the left operand is missing, set the HasError flag.
+  virtual void visit(BinaryOp &Node) override { checkOperands(&Node); };
 
-    // Visit the right operand of the binary operation.
-    if (Node.getRight())
-      Node.getRight()->accept(*this);  // Recursively check the right expression.
-    else
-      HasError = true;  // If the right operand is missing, set the HasError flag.
-  };
+  // Visit a SelectOp node (a conditional 'c ? a : b'), whose three operands
+  // are checked the same way.
+  virtual void visit(SelectOp &Node) override { checkOperands(&Node); };
 
   // Visit a WithDecl node (which represents a "with" declaration like `with x, y: <expr>`).
   // This checks if the declared variables are unique and adds them to the scope.
   virtual void visit(WithDecl &Node) override {
-    // Iterate over the variables declared in the "with" statement.
-    for (auto I = Node.begin(), E = Node.end(); I != E; ++I) {
-      // Try to insert the variable into the scope. If the insertion fails, the variable is already declared.
-      if (!Scope.insert(*I).second)
-        error(Twice, *I);  // Report an error for redeclaring a variable.
-    }
+    // Insert the variables declared in the "with" statement into the scope.
+    // This fails for a variable that is already declared.
+    if (!Scope.declare(Node.getVars(), Node.getSymbols(), SrcMgr))
+      HasError = true;  // The redeclarations have been reported.
 
     // Visit the expression that follows the "with" declaration.
     if (Node.getExpr())
@@ -77,13 +195,13 @@ public:
 
 // The Sema (semantic analysis) function performs the semantic analysis on the given AST.
 // It returns true if any semantic errors were found, false otherwise.
-bool Sema::semantic(AST *Tree) {
+bool Sema::semantic(AST *Tree, llvm::StringRef Source) {
   // If the AST is null, return false (no semantic analysis can be performed).
   if (!Tree)
     return false;
 
   // Create an instance of DeclCheck to perform the semantic analysis.
-  DeclCheck Check;
+  DeclCheck Check(Declared, SrcMgr, Source, Ty);
 
   // Start the semantic analysis by visiting the root of the AST.
   Tree->accept(Check);
@@ -92,3 +210,42 @@ bool Sema::semantic(AST *Tree) {
   return Check.hasError();
 }
 
+
+// Semantic analysis over the flat encoding: the same checks as DeclCheck,
+// done with one linear pass over the nodes.
+bool Sema::semantic(const FlatAST &Flat, llvm::StringRef Source) {
+  VarScope Scope(Declared);
+  UndeclaredVars Undeclared(SrcMgr, Source);
+  OutOfRangeNumbers OutOfRange(SrcMgr, Source, Ty);
+
+  // Add the declared variables to the scope, rejecting duplicates.
+  bool HasError = !Scope.declare(Flat.getVars(), Flat.getVarSymbols(), SrcMgr);
+
+  // Every identifier must be declared, and every number fit the value type.
+  for (const FlatAST::Node &N : Flat.nodes()) {
+    if (N.Op == FlatAST::Ident && !Scope.contains(Flat.getSymbol(N))) {
+      Undeclared.report(Flat.getSymbol(N), Flat.getText(N));
+      HasError = true;
+    } else if (N.Op == FlatAST::Number && !OutOfRange.check(Flat.getText(N))) {
+      HasError = true;
+    }
+  }
+  return HasError;
+}
+
+bool Sema::semantic(llvm::ArrayRef<CatalogEntry> Entries) {
+  llvm::StringSet<> Names;
+  bool HasError = false;
+  for (const CatalogEntry &Entry : Entries) {
+    // Names cannot contain '_', so they never clash with the runtime
+    // functions or the '<name>_columns' globals.
+    if (!Names.insert(Entry.Name).second) {
+      printDiagnostic(SrcMgr, llvm::SMLoc::getFromPointer(Entry.Name.data()),
+                      "Expression " + Entry.Name + " already defined");
+      HasError = true;
+    }
+    if (Entry.Tree && semantic(Entry.Tree, Entry.Source))
+      HasError = true;
+  }
+  return HasError;
+}
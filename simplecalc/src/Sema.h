@@ -2,11 +2,35 @@
 #define SEMA_H
 
 #include "AST.h"
+#include "FlatAST.h"
 #include "Lexer.h"
+#include "ValueType.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/Support/SourceMgr.h"
 
 class Sema {
+  // The declared variables, indexed by symbol ID. Kept between checks, so a
+  // catalog does not allocate a scope per entry.
+  llvm::BitVector Declared;
+  const llvm::SourceMgr *SrcMgr;  // Locates the errors, if given.
+  ValueType Ty;                   // The type the number literals must fit.
+
 public:
-  bool semantic(AST *Tree);
+  // Errors are reported at their locations if SrcMgr holds the input (see
+  // Diagnostics.h). The number literals must be representable in Ty.
+  explicit Sema(const llvm::SourceMgr *SrcMgr = nullptr, ValueType Ty = ValueType::I32)
+      : SrcMgr(SrcMgr), Ty(Ty) {}
+
+  // Check a tree parsed from Source. The nodes of identifiers are shared by
+  // all their uses, so an undeclared variable is reported once, at its first
+  // use in Source.
+  bool semantic(AST *Tree, llvm::StringRef Source = llvm::StringRef());
+  bool semantic(const FlatAST &Flat, llvm::StringRef Source = llvm::StringRef());
+
+  // Check all entries of a catalog. The names must be unique, since each
+  // entry becomes a function of the same module. Entries without a tree
+  // (see Parser::parseCatalog) only have their names checked.
+  bool semantic(llvm::ArrayRef<CatalogEntry> Entries);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "Session.h"
+#include "Parser.h"
+#include "Phases.h"
+#include "Simplify.h"
+
+using namespace llvm;
+
+CalcSession::CalcSession(CodeGenOptions Opts, std::unique_ptr<TargetMachine> TM,
+                         size_t CacheSize)
+    : Opts(Opts), TM(std::move(TM)), CG(Opts, this->TM.get()),
+      TSCtx(std::make_unique<LLVMContext>()), CacheSize(CacheSize),
+      Semantic(nullptr, Opts.Type) {}
+
+Expected<std::unique_ptr<CalcSession>> CalcSession::create(CodeGenOptions Opts,
+                                                          size_t CacheSize) {
+  auto TM = CodeGen::createHostTargetMachine(Opts.OptLevel);
+  if (!TM)
+    return TM.takeError();
+  return std::unique_ptr<CalcSession>(new CalcSession(Opts, std::move(*TM), CacheSize));
+}
+
+Expected<CalcJIT &> CalcSession::getJIT() {
+  if (!JIT) {
+    auto J = CalcJIT::create(Opts.OptLevel);
+    if (!J)
+      return J.takeError();
+    JIT = std::move(*J);
+    if (CacheSize)
+      Cache = std::make_unique<ExprCache>(*JIT, CacheSize);
+  }
+  return *JIT;
+}
+
+Expected<AST *> CalcSession::parse(StringRef Source, ASTContext &Ctx) {
+  AST *Tree;
+  {
+    PhaseTimer Timer("parse", "Lexing and parsing", Opts.TimePhases);
+    Lexer Lex(Source);
+    Parser P(Lex, Ctx);
+    Tree = P.parse();
+    if (!Tree || P.hasError())
+      return createStringError(inconvertibleErrorCode(), "Syntax errors occured");
+  }
+  {
+    PhaseTimer Timer("sema", "Semantic analysis", Opts.TimePhases);
+    if (Semantic.semantic(Tree))
+      return createStringError(inconvertibleErrorCode(), "Semantic errors occured");
+  }
+  PhaseTimer Timer("simplify", "AST simplification", Opts.TimePhases);
+  return Simplifier(Ctx, Opts.Type, Opts.Checked).run(Tree);
+}
+
+Expected<std::unique_ptr<Module>>
+CalcSession::generate(StringRef Source, std::vector<std::string> *Vars) {
+  ASTContext Ctx;
+  auto Tree = parse(Source, Ctx);
+  if (!Tree)
+    return Tree.takeError();
+  if (Vars) {
+    Vars->clear();
+    if (auto *W = dyn_cast<WithDecl>(*Tree))
+      for (StringRef Var : W->getVars())
+        Vars->push_back(Var.str());
+  }
+  // The JIT may be compiling a module of the same context on another thread.
+  orc::ThreadSafeContext::Lock Lock = TSCtx.getLock();
+  return CG.generate(*Tree, *TSCtx.getContext());
+}
+
+Error CalcSession::compile(StringRef Source, EmitKind Kind, raw_ostream &OS) {
+  auto M = generate(Source);
+  if (!M)
+    return M.takeError();
+  orc::ThreadSafeContext::Lock Lock = TSCtx.getLock();
+  Error Err = CG.emit(**M, Kind, OS);
+  M->reset();  // Free the module while holding the lock.
+  return Err;
+}
+
+Expected<CompiledExpr> CalcSession::compileJIT(StringRef Source) {
+  auto J = getJIT();
+  if (!J)
+    return J.takeError();
+
+  // The session always simplifies, so the options identify the code.
+  ExprKey Key;
+  if (Cache) {
+    Key = ExprKey::compute(Source, Opts.getKey());
+    auto Code = Cache->lookup(Key, CG.getEntryName());
+    if (!Code || *Code)
+      return Code;
+  }
+
+  std::vector<std::string> Vars;
+  auto M = generate(Source, &Vars);
+  if (!M)
+    return M.takeError();
+  if (Cache) {
+    PhaseTimer Timer("jit", "JIT compilation", Opts.TimePhases);
+    return Cache->add(Key, orc::ThreadSafeModule(std::move(*M), TSCtx),
+                      CG.getEntryName(), std::move(Vars));
+  }
+
+  // Each expression has a dylib of its own, so all can define 'main'.
+  auto JD = J->createDylib("expr." + std::to_string(NumDylibs++));
+  if (!JD)
+    return JD.takeError();
+  if (Error Err = J->addModule(*JD, orc::ThreadSafeModule(std::move(*M), TSCtx)))
+    return std::move(Err);
+
+  // The lookup compiles the module to native code.
+  PhaseTimer Timer("jit", "JIT compilation", Opts.TimePhases);
+  auto Entry = J->lookup(*JD, CG.getEntryName());
+  if (!Entry) {
+    consumeError(J->removeDylib(*JD));
+    return Entry.takeError();
+  }
+  CompiledExpr Code;
+  Code.JD = &*JD;
+  Code.Entry = *Entry;
+  Code.Vars = std::move(Vars);
+  return Code;
+}
+
+Error CalcSession::release(CompiledExpr &Code) {
+  if (!Code)
+    return Error::success();
+  auto J = getJIT();
+  if (!J)
+    return J.takeError();
+  Error Err = Error::success();
+  if (Cache)
+    Cache->release(Code);
+  else
+    Err = J->removeDylib(*Code.JD);
+  Code = CompiledExpr();
+  return Err;
+}
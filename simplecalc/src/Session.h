@@ -0,0 +1,85 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "AST.h"
+#include "Cache.h"
+#include "CodeGen.h"
+#include "JIT.h"
+#include "Sema.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// CalcSession compiles many expressions with the same options, for programs
+// that embed calc as a library. Everything that does not depend on the
+// expression is set up once and shared by all compilations: the LLVM context
+// (with its types and constants), the target machine, the code generator,
+// the semantic analysis and, on first use, the JIT.
+//
+// Each expression gets a fresh ASTContext and Module, which are freed when
+// its compilation is done; JIT-compiled code lives in a dylib of its own
+// until it is released. With a cache, JIT-compiled code is kept by its
+// normalized source (see ExprCache), and compiling the same expression again
+// returns it without running the front end. A session is not thread-safe;
+// use one per thread.
+class CalcSession {
+  CodeGenOptions Opts;
+  std::unique_ptr<llvm::TargetMachine> TM;
+  CodeGen CG;
+  llvm::orc::ThreadSafeContext TSCtx;  // Shared by all generated modules.
+  std::unique_ptr<CalcJIT> JIT;        // Created by the first compileJIT.
+  size_t CacheSize;
+  std::unique_ptr<ExprCache> Cache;    // Created with the JIT, if CacheSize > 0.
+  Sema Semantic;
+  unsigned NumDylibs = 0;
+
+  CalcSession(CodeGenOptions Opts, std::unique_ptr<llvm::TargetMachine> TM,
+              size_t CacheSize);
+
+  // Run the front end: parse, check and simplify the source. Errors are
+  // reported on llvm::errs(), like in the compiler, and returned.
+  llvm::Expected<AST *> parse(llvm::StringRef Source, ASTContext &Ctx);
+
+  // Run the front end and generate the optimized module in the session's
+  // context. If Vars is given, it receives the names of the 'with' variables.
+  llvm::Expected<std::unique_ptr<llvm::Module>>
+  generate(llvm::StringRef Source, std::vector<std::string> *Vars = nullptr);
+
+public:
+  // Create a session generating code for the host with the given options.
+  // Up to CacheSize expressions compiled with the JIT are cached; 0 disables
+  // the cache.
+  static llvm::Expected<std::unique_ptr<CalcSession>>
+  create(CodeGenOptions Opts = CodeGenOptions(), size_t CacheSize = 0);
+
+  CalcSession(const CalcSession &) = delete;
+  CalcSession &operator=(const CalcSession &) = delete;
+
+  const CodeGenOptions &getOptions() const { return Opts; }
+  llvm::TargetMachine &getTargetMachine() { return *TM; }
+
+  // The JIT of the session, created on first use.
+  llvm::Expected<CalcJIT &> getJIT();
+
+  // The cache of JIT-compiled code, nullptr if there is none (yet).
+  const ExprCache *getCache() const { return Cache.get(); }
+
+  // Compile the source and write the code to OS in the given format.
+  llvm::Error compile(llvm::StringRef Source, EmitKind Kind, llvm::raw_ostream &OS);
+
+  // Compile the source with the JIT. The entry point is 'main' or, with the
+  // batch or eval option, 'calc_batch' (see CalcJIT::lookupBatch) or
+  // 'calc_eval'. The code lists the 'with' variables, the arguments of
+  // calc_eval.
+  llvm::Expected<CompiledExpr> compileJIT(llvm::StringRef Source);
+
+  // Free the code of an expression compiled with compileJIT. Cached code is
+  // only freed when the cache evicts it.
+  llvm::Error release(CompiledExpr &Code);
+};
+
+#endif
@@ -0,0 +1,304 @@
+#include "Simplify.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/MathExtras.h"  // Overflow-checked arithmetic.
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+using namespace llvm;
+
+namespace {
+
+// The range of the integer value type, whose semantics folding follows.
+struct IntRange {
+  int64_t Min, Max;
+
+  IntRange(ValueType Ty)
+      : Min(Ty == ValueType::I32 ? std::numeric_limits<int32_t>::min()
+                                 : std::numeric_limits<int64_t>::min()),
+        Max(Ty == ValueType::I32 ? std::numeric_limits<int32_t>::max()
+                                 : std::numeric_limits<int64_t>::max()) {}
+
+  // Returns true if V is representable in the value type.
+  bool fits(int64_t V) const { return V >= Min && V <= Max; }
+
+  // Compute L + R, L - R and L * R, returning false if the result is not a
+  // valid value.
+  bool add(int64_t L, int64_t R, int64_t &Res) const {
+    return !AddOverflow(L, R, Res) && fits(Res);
+  }
+  bool sub(int64_t L, int64_t R, int64_t &Res) const {
+    return !SubOverflow(L, R, Res) && fits(Res);
+  }
+  bool mul(int64_t L, int64_t R, int64_t &Res) const {
+    return !MulOverflow(L, R, Res) && fits(Res);
+  }
+
+  // Evaluates L Op R, returning false if the result is not a valid value or
+  // the operation would trap at run time.
+  bool fold(BinaryOp::Operator Op, int64_t L, int64_t R, int64_t &Res) const {
+    switch (Op) {
+    case BinaryOp::Plus:
+      return add(L, R, Res);
+    case BinaryOp::Minus:
+      return sub(L, R, Res);
+    case BinaryOp::Mul:
+      return mul(L, R, Res);
+    case BinaryOp::Div:
+      if (R == 0 || (L == Min && R == -1))
+        return false;
+      Res = L / R;  // Truncates towards zero, like sdiv.
+      return true;
+    case BinaryOp::Lt:
+      Res = L < R;
+      return true;
+    case BinaryOp::Le:
+      Res = L <= R;
+      return true;
+    case BinaryOp::Gt:
+      Res = L > R;
+      return true;
+    case BinaryOp::Ge:
+      Res = L >= R;
+      return true;
+    case BinaryOp::Eq:
+      Res = L == R;
+      return true;
+    case BinaryOp::Ne:
+      Res = L != R;
+      return true;
+    case BinaryOp::Min:
+      Res = std::min(L, R);
+      return true;
+    case BinaryOp::Max:
+      Res = std::max(L, R);
+      return true;
+    }
+    llvm_unreachable("Unknown binary operator");
+  }
+
+  // Returns true if E is a number of the value type, storing its value in C.
+  bool getConst(Expr *E, int64_t &C) const {
+    auto *F = dyn_cast<Factor>(E);
+    if (!F || F->getKind() != Factor::Number)
+      return false;
+    return !F->getVal().getAsInteger(10, C) && fits(C);
+  }
+};
+
+// Counts the distinct nodes of an expression.
+unsigned countNodes(Expr *E) {
+  SmallPtrSet<Expr *, 32> Seen;
+  return evaluatePostOrder<unsigned>(
+      E, [&](Factor *F) { return Seen.insert(F).second ? 1u : 0u; },
+      [](BinaryOp *, unsigned L, unsigned R) { return 1 + L + R; },
+      [](SelectOp *, unsigned C, unsigned T, unsigned E) { return 1 + C + T + E; },
+      [&](Expr *N, unsigned &Res) {
+        Res = 0;
+        return !Seen.insert(N).second;
+      });
+}
+
+class SimplifyVisitor {
+  ASTContext &Ctx;
+  SimplifyStats &Stats;
+  IntRange Range;
+  bool Checked;  // Whether the code checks for overflow.
+  DenseMap<Expr *, Expr *> Simplified;  // Shared subexpressions are simplified once.
+
+  Expr *makeConst(int64_t V) {
+    // A uniquing context copies the text itself.
+    std::string Text = std::to_string(V);
+    return Ctx.getFactor(Factor::Number,
+                         Ctx.isUniquing() ? StringRef(Text) : Ctx.save(Text));
+  }
+
+  // Builds X + K, using a subtraction for negative K.
+  Expr *makeAdd(Expr *X, int64_t K) {
+    if (K == 0)
+      return X;
+    if (K < 0 && K != Range.Min)
+      return Ctx.getBinaryOp(BinaryOp::Minus, X, makeConst(-K));
+    return Ctx.getBinaryOp(BinaryOp::Plus, X, makeConst(K));
+  }
+
+  // Matches X + K and X - K with a constant right operand.
+  bool matchAddConst(Expr *E, Expr *&X, int64_t &K) {
+    auto *B = dyn_cast<BinaryOp>(E);
+    if (!B || !Range.getConst(B->getRight(), K))
+      return false;
+    if (B->getOperator() == BinaryOp::Minus) {
+      if (!Range.sub(0, K, K))
+        return false;
+    } else if (B->getOperator() != BinaryOp::Plus) {
+      return false;
+    }
+    X = B->getLeft();
+    return true;
+  }
+
+  // Matches X * K and X / K with a constant right operand.
+  bool matchOpConst(Expr *E, BinaryOp::Operator Op, Expr *&X, int64_t &K) {
+    auto *B = dyn_cast<BinaryOp>(E);
+    if (!B || B->getOperator() != Op || !Range.getConst(B->getRight(), K))
+      return false;
+    X = B->getLeft();
+    return true;
+  }
+
+  // Simplifies Op applied to already simplified operands. Orig is the node
+  // being simplified, which is reused if nothing changes.
+  Expr *simplifyBinary(BinaryOp *Orig, Expr *L, Expr *R) {
+    BinaryOp::Operator Op = Orig->getOperator();
+    int64_t CL, CR;
+    bool LC = Range.getConst(L, CL), RC = Range.getConst(R, CR);
+
+    // Fold operations on two constants.
+    int64_t Res;
+    if (LC && RC && Range.fold(Op, CL, CR, Res)) {
+      ++Stats.Folded;
+      return makeConst(Res);
+    }
+
+    // Move a constant operand of a commutative operator to the right, so the
+    // patterns below only need to look there.
+    if (LC && !RC && (Op == BinaryOp::Plus || Op == BinaryOp::Mul)) {
+      std::swap(L, R);
+      std::swap(LC, RC);
+      std::swap(CL, CR);
+    }
+
+    // Neutral elements.
+    if (RC && ((CR == 0 && (Op == BinaryOp::Plus || Op == BinaryOp::Minus)) ||
+               (CR == 1 && (Op == BinaryOp::Mul || Op == BinaryOp::Div)))) {
+      ++Stats.Identities;
+      return L;
+    }
+
+    // The absorbing element and the reassociations drop operations, so they
+    // are not applied to checked code, which reports their overflows.
+    if (RC && !Checked) {
+      if (CR == 0 && Op == BinaryOp::Mul) {
+        ++Stats.Identities;
+        return makeConst(0);
+      }
+
+      // (X + K) + C and (X + K) - C become X + (K + C) and X + (K - C).
+      Expr *X;
+      int64_t K;
+      if ((Op == BinaryOp::Plus || Op == BinaryOp::Minus) &&
+          matchAddConst(L, X, K)) {
+        int64_t Sum;
+        if (Op == BinaryOp::Plus ? Range.add(K, CR, Sum) : Range.sub(K, CR, Sum)) {
+          ++Stats.Reassociated;
+          return makeAdd(X, Sum);
+        }
+      }
+
+      // (X * K) * C becomes X * (K * C).
+      int64_t Prod;
+      if (Op == BinaryOp::Mul && matchOpConst(L, BinaryOp::Mul, X, K) &&
+          Range.mul(K, CR, Prod)) {
+        ++Stats.Reassociated;
+        if (Prod == 0)
+          return makeConst(0);
+        if (Prod == 1)
+          return X;
+        return Ctx.getBinaryOp(BinaryOp::Mul, X, makeConst(Prod));
+      }
+
+      // (X / K) / C becomes X / (K * C), which truncates the same way. Both
+      // divisors are positive, so neither division can trap.
+      if (Op == BinaryOp::Div && CR > 0 && matchOpConst(L, BinaryOp::Div, X, K) &&
+          K > 0 && Range.mul(K, CR, Prod)) {
+        ++Stats.Reassociated;
+        return Ctx.getBinaryOp(BinaryOp::Div, X, makeConst(Prod));
+      }
+    }
+
+    if (L == Orig->getLeft() && R == Orig->getRight())
+      return Orig;
+    return Ctx.getBinaryOp(Op, L, R);
+  }
+
+  // Simplifies a conditional with already simplified operands. A constant
+  // condition selects one of the arms, whose other arm is dropped. Checked
+  // code keeps all operands, since the overflows of both arms count.
+  Expr *simplifySelect(SelectOp *Orig, Expr *C, Expr *Then, Expr *Else) {
+    int64_t CC;
+    if (!Checked && Range.getConst(C, CC)) {
+      ++Stats.Folded;
+      return CC ? Then : Else;
+    }
+    if (!Checked && Then == Else) {
+      ++Stats.Identities;
+      return Then;
+    }
+    if (C == Orig->getCond() && Then == Orig->getThen() && Else == Orig->getElse())
+      return Orig;
+    return Ctx.getSelectOp(C, Then, Else);
+  }
+
+public:
+  SimplifyVisitor(ASTContext &Ctx, SimplifyStats &Stats, ValueType Ty, bool Checked)
+      : Ctx(Ctx), Stats(Stats), Range(Ty), Checked(Checked) {}
+
+  // Simplifies an expression bottom-up, without recursion.
+  Expr *simplify(Expr *E) {
+    return evaluatePostOrder<Expr *>(
+        E, [](Factor *F) -> Expr * { return F; },
+        [&](BinaryOp *B, Expr *L, Expr *R) {
+          Expr *Res = simplifyBinary(B, L, R);
+          if (B->isShared())
+            Simplified[B] = Res;
+          return Res;
+        },
+        [&](SelectOp *S, Expr *C, Expr *Then, Expr *Else) {
+          Expr *Res = simplifySelect(S, C, Then, Else);
+          if (S->isShared())
+            Simplified[S] = Res;
+          return Res;
+        },
+        [&](Expr *N, Expr *&Res) {
+          // Shared subexpressions are simplified once.
+          Res = N->isShared() ? Simplified.lookup(N) : nullptr;
+          return Res != nullptr;
+        });
+  }
+};
+
+} // namespace
+
+AST *Simplifier::run(AST *Tree) {
+  // Floating-point expressions are left alone: x + 0 and x * 0 are not
+  // identities for negative zero, infinities and NaNs, and reassociation
+  // changes the rounding.
+  if (isFloatType(Ty))
+    return Tree;
+
+  SimplifyVisitor V(Ctx, Stats, Ty, Checked);
+
+  // A WithDecl can only appear at the root.
+  if (auto *W = dyn_cast<WithDecl>(Tree)) {
+    Stats.NodesBefore += countNodes(W->getExpr());
+    Expr *E = V.simplify(W->getExpr());
+    Stats.NodesAfter += countNodes(E);
+    if (E == W->getExpr())
+      return W;
+    return Ctx.create<WithDecl>(W->getVars(), W->getSymbols(), E);
+  }
+
+  Expr *E = cast<Expr>(Tree);
+  Stats.NodesBefore += countNodes(E);
+  E = V.simplify(E);
+  Stats.NodesAfter += countNodes(E);
+  return E;
+}
+
+void SimplifyStats::print(raw_ostream &OS) const {
+  OS << "simplify: " << Folded << " constants folded, " << Identities
+     << " identities applied, " << Reassociated << " reassociations, "
+     << NodesBefore << " -> " << NodesAfter << " nodes\n";
+}
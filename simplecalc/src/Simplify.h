@@ -0,0 +1,49 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "AST.h"
+#include "ValueType.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Counters reported by the simplifier.
+struct SimplifyStats {
+  unsigned Folded = 0;        // Operations on constants, and conditionals on a constant, replaced.
+  unsigned Identities = 0;    // Applications of x+0, x-0, x*1, x/1 and x*0.
+  unsigned Reassociated = 0;  // Constants combined across a chain of +, * or /.
+  unsigned NodesBefore = 0;   // Size of the expression before simplification.
+  unsigned NodesAfter = 0;    // Size of the expression after simplification.
+
+  void print(llvm::raw_ostream &OS) const;
+};
+
+// Simplifier rewrites a checked AST before code generation: it folds constant
+// subtrees, removes neutral elements and moves constants together across
+// chains of additions, multiplications and divisions, e.g. (x + 3) + 4
+// becomes x + 7 and (x / 2) / 3 becomes x / 6.
+// Folding follows the signed semantics of the integer value type; an
+// operation whose result would overflow or trap, like a division by zero, is
+// left alone. Floating-point expressions are not simplified. New nodes are
+// allocated in the given context. A subexpression shared by several
+// operations is simplified once.
+//
+// For code checked for overflow (CodeGenOptions::Checked), no operation is
+// removed whose overflow would have to be reported: constants are still
+// folded and neutral elements removed, but x * 0 is kept, constants are
+// not reassociated and conditionals keep both arms.
+class Simplifier {
+  ASTContext &Ctx;
+  ValueType Ty;
+  bool Checked;
+  SimplifyStats Stats;
+
+public:
+  Simplifier(ASTContext &Ctx, ValueType Ty = ValueType::I32, bool Checked = false)
+      : Ctx(Ctx), Ty(Ty), Checked(Checked) {}
+
+  // Simplify the tree and return the new root.
+  AST *run(AST *Tree);
+
+  const SimplifyStats &getStats() const { return Stats; }
+};
+
+#endif
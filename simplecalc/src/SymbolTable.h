@@ -0,0 +1,34 @@
+#ifndef SYMBOLTABLE_H
+#define SYMBOLTABLE_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+
+// SymbolTable interns identifiers. Every distinct name gets a dense ID,
+// starting at 0, so later passes can keep per-symbol data in a vector
+// indexed by the ID instead of hashing the name again.
+class SymbolTable {
+  llvm::StringMap<uint32_t> IDs;             // Name to ID; owns the names.
+  llvm::SmallVector<llvm::StringRef, 32> Names;  // ID to name.
+
+public:
+  // The ID of Factors that are not identifiers.
+  static constexpr uint32_t None = ~0u;
+
+  // Return the ID for the name, assigning the next free one if it is new.
+  uint32_t intern(llvm::StringRef Name) {
+    auto Res = IDs.try_emplace(Name, uint32_t(Names.size()));
+    if (Res.second)
+      Names.push_back(Res.first->getKey());
+    return Res.first->getValue();
+  }
+
+  llvm::StringRef getName(uint32_t ID) const { return Names[ID]; }
+
+  // The number of symbols; all IDs are smaller.
+  uint32_t size() const { return Names.size(); }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "Tiered.h"
+#include "Parser.h"
+#include "Simplify.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "calc-tiered"
+
+ALWAYS_ENABLED_STATISTIC(NumPromoted, "Number of expressions promoted to native code");
+
+TieredEngine::TieredEngine(CodeGenOptions Opts, unsigned Threshold,
+                           unsigned NumThreads, std::unique_ptr<CalcJIT> JIT)
+    : Opts(Opts), Threshold(Threshold), JIT(std::move(JIT)), Semantic(nullptr, Opts.Type),
+      Pool(heavyweight_hardware_concurrency(NumThreads)) {}
+
+Expected<std::unique_ptr<TieredEngine>>
+TieredEngine::create(CodeGenOptions Opts, unsigned Threshold, unsigned NumThreads) {
+  if (Opts.Type != ValueType::I32 || Opts.Batch || Opts.Checked)
+    return createStringError(inconvertibleErrorCode(),
+                             "Tiered evaluation supports only unchecked scalar i32 code");
+  auto JIT = CalcJIT::create(/*OptLevel=*/3);  // See compile.
+  if (!JIT)
+    return JIT.takeError();
+  return std::unique_ptr<TieredEngine>(
+      new TieredEngine(Opts, Threshold, NumThreads, std::move(*JIT)));
+}
+
+TieredEngine::~TieredEngine() { Pool.wait(); }
+
+Expected<TieredEngine::Expression &> TieredEngine::add(StringRef Source) {
+  auto Ctx = std::make_unique<ASTContext>();
+  Lexer Lex(Source);
+  Parser P(Lex, *Ctx);
+  AST *Tree = P.parse();
+  if (!Tree || P.hasError())
+    return createStringError(inconvertibleErrorCode(), "Syntax errors occured");
+  if (Semantic.semantic(Tree))
+    return createStringError(inconvertibleErrorCode(), "Semantic errors occured");
+  Tree = Simplifier(*Ctx, Opts.Type, Opts.Checked).run(Tree);
+
+  BytecodeBuilder Builder(ValueType::I32);
+  Builder.add("calc_eval", Tree);
+  auto Bytecode = BytecodeFile::get(Builder);
+  if (!Bytecode)
+    return Bytecode.takeError();
+  Expressions.push_back(std::unique_ptr<Expression>(
+      new Expression(std::move(Ctx), Tree, std::move(*Bytecode))));
+  Expression &E = *Expressions.back();
+  if (Threshold == 0)
+    promote(E);
+  return E;
+}
+
+// Generates calc_eval for the expression in a context of its own and adds it
+// to the JIT in a dylib of its own. The tree is only read, and the VM runs
+// the bytecode meanwhile.
+Expected<TieredEngine::EvalFnTy> TieredEngine::compile(Expression &E) {
+  CodeGenOptions EvalOpts = Opts;
+  EvalOpts.Eval = true;
+  EvalOpts.Wrapping = true;  // Compute what the VM does.
+  EvalOpts.OptLevel = 3;
+  EvalOpts.TimePhases = false;  // Timers cannot run on several threads.
+
+  // A target machine is not thread-safe, so every compilation has its own.
+  auto TM = CodeGen::createHostTargetMachine(EvalOpts.OptLevel);
+  if (!TM)
+    return TM.takeError();
+  CodeGen CG(EvalOpts, TM->get());
+  auto JD = JIT->createDylib("tiered." + std::to_string(NumDylibs++));
+  if (!JD)
+    return JD.takeError();
+  if (Error Err = JIT->addModule(*JD, CG.generate(E.Tree)))
+    return std::move(Err);
+  auto Addr = JIT->lookup(*JD, CG.getEntryName());
+  if (!Addr)
+    return Addr.takeError();
+  return jitTargetAddressToFunction<EvalFnTy>(*Addr);
+}
+
+void TieredEngine::promote(Expression &E) {
+  Pool.async([this, &E] {
+    auto Fn = compile(E);
+    if (!Fn) {
+      // The expression stays interpreted.
+      logAllUnhandledErrors(Fn.takeError(), errs(), "calc: cannot compile: ");
+      return;
+    }
+    E.Compiled.store(*Fn, std::memory_order_release);
+    ++NumPromoted;
+  });
+}
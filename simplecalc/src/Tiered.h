@@ -0,0 +1,106 @@
+#ifndef TIERED_H
+#define TIERED_H
+
+#include "AST.h"
+#include "Bytecode.h"
+#include "CodeGen.h"
+#include "JIT.h"
+#include "Sema.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// TieredEngine evaluates expressions in two tiers. A new expression is
+// compiled to bytecode and run by the VM (tier 0), which is cheaper than
+// compiling it with LLVM as long as it is evaluated only a few times. Every
+// expression counts its evaluations; when it reaches the threshold, a
+// background thread compiles it with the JIT at -O3 (tier 1), and the next
+// evaluations call the native code. The switch is a single atomic pointer, so
+// evaluation never waits for the compiler.
+class TieredEngine {
+public:
+  // Signature of the compiled code, the 'calc_eval' entry point.
+  using EvalFnTy = CalcJIT::EvalFn<int32_t>;
+
+  // An expression added to the engine.
+  class Expression {
+    friend class TieredEngine;
+
+    std::unique_ptr<ASTContext> Ctx;  // Owns the tree.
+    AST *Tree;
+    std::unique_ptr<BytecodeFile> Bytecode;
+    const bytecode::Function &Fn;     // The bytecode of the tree.
+    std::atomic<EvalFnTy> Compiled{nullptr};  // Set once tier 1 is ready.
+    std::atomic<unsigned> NumCalls{0};        // Evaluations so far, counted until promotion.
+
+    Expression(std::unique_ptr<ASTContext> Ctx, AST *Tree,
+               std::unique_ptr<BytecodeFile> Bytecode)
+        : Ctx(std::move(Ctx)), Tree(Tree), Bytecode(std::move(Bytecode)),
+          Fn(this->Bytecode->functions().front()) {}
+
+    int32_t interpret(const int32_t *Args) const {
+      llvm::SmallVector<int32_t, 64> Regs;
+      Regs.resize_for_overwrite(Fn.NumRegs);
+      return Fn.run(Args, Regs.data());
+    }
+
+  public:
+    // Number of 'with' variables, the length of the argument array.
+    unsigned getNumVars() const {
+      return Fn.NumArgs;
+    }
+
+    // Whether the expression runs as native code yet.
+    bool isCompiled() const { return Compiled.load(std::memory_order_acquire); }
+  };
+
+private:
+  CodeGenOptions Opts;
+  unsigned Threshold;
+  std::unique_ptr<CalcJIT> JIT;
+  Sema Semantic;
+  std::vector<std::unique_ptr<Expression>> Expressions;
+  std::atomic<unsigned> NumDylibs{0};
+  llvm::ThreadPool Pool;  // Last, so it is joined before anything else goes.
+
+  TieredEngine(CodeGenOptions Opts, unsigned Threshold, unsigned NumThreads,
+               std::unique_ptr<CalcJIT> JIT);
+
+  // Compile the expression in the background and switch it to the code.
+  void promote(Expression &E);
+  llvm::Expected<EvalFnTy> compile(Expression &E);
+
+public:
+  // Create an engine. Threshold is the number of interpreted evaluations
+  // after which an expression is compiled; with 0, expressions are compiled
+  // as soon as they are added. NumThreads threads (0: all cores) compile in
+  // the background. Opts selects the optimization level of the compiled
+  // code; only i32 values are supported.
+  static llvm::Expected<std::unique_ptr<TieredEngine>>
+  create(CodeGenOptions Opts, unsigned Threshold = 1000, unsigned NumThreads = 1);
+
+  // Waits for the compilations in progress.
+  ~TieredEngine();
+
+  // Parse, check and simplify an expression and add it to the engine. Errors
+  // are reported on llvm::errs(), like in the compiler, and returned.
+  llvm::Expected<Expression &> add(llvm::StringRef Source);
+
+  // Evaluate the expression. Args holds the values of the 'with' variables
+  // in the order of their declaration. Safe to call from several threads.
+  int32_t evaluate(Expression &E, const int32_t *Args) {
+    if (EvalFnTy Fn = E.Compiled.load(std::memory_order_acquire))
+      return Fn(Args);
+    if (E.NumCalls.fetch_add(1, std::memory_order_relaxed) + 1 == Threshold)
+      promote(E);
+    return E.interpret(Args);
+  }
+
+  // Wait until all promotions started so far are done.
+  void wait() { Pool.wait(); }
+};
+
+#endif
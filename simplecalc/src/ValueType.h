@@ -0,0 +1,62 @@
+#ifndef VALUETYPE_H
+#define VALUETYPE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <cstdint>
+#include <limits>
+
+// The type of the values an expression computes with. It is chosen per
+// compilation; all variables, literals and operations of the expression use it.
+enum class ValueType {
+  I32,  // 32-bit signed integers, the default.
+  I64,  // 64-bit signed integers.
+  F32,  // IEEE single precision.
+  F64   // IEEE double precision.
+};
+
+inline bool isFloatType(ValueType Ty) {
+  return Ty == ValueType::F32 || Ty == ValueType::F64;
+}
+
+inline unsigned getBitWidth(ValueType Ty) {
+  return Ty == ValueType::I32 || Ty == ValueType::F32 ? 32 : 64;
+}
+
+// The name of the type on the command line, in cache keys and in the names of
+// the runtime functions, e.g. calc_read_f64.
+inline llvm::StringRef getTypeName(ValueType Ty) {
+  switch (Ty) {
+  case ValueType::I32:
+    return "i32";
+  case ValueType::I64:
+    return "i64";
+  case ValueType::F32:
+    return "f32";
+  case ValueType::F64:
+    return "f64";
+  }
+  llvm_unreachable("Unknown value type");
+}
+
+// Whether the number literal Text, a string of decimal digits, has a value of
+// the type. Floating-point types round literals, unless they exceed the
+// largest finite value.
+inline bool isRepresentable(llvm::StringRef Text, ValueType Ty) {
+  int32_t I32;
+  int64_t I64;
+  double F64;
+  switch (Ty) {
+  case ValueType::I32:
+    return !Text.getAsInteger(10, I32);
+  case ValueType::I64:
+    return !Text.getAsInteger(10, I64);
+  case ValueType::F32:
+    return !Text.getAsDouble(F64) && F64 <= std::numeric_limits<float>::max();
+  case ValueType::F64:
+    return !Text.getAsDouble(F64) && F64 <= std::numeric_limits<double>::max();
+  }
+  llvm_unreachable("Unknown value type");
+}
+
+#endif
@@ -0,0 +1,97 @@
+// Tests of the cache of JIT-compiled expressions of CalcSession (see
+// ExprCache): repeated expressions hit in memory, expressions in use are not
+// evicted, and released ones are evicted least recently used first.
+#include "Session.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdlib>
+
+using namespace llvm;
+
+namespace {
+
+unsigned NumFailures = 0;
+
+void check(bool Cond, const char *What) {
+  if (!Cond) {
+    errs() << "cache-test: failed: " << What << "\n";
+    ++NumFailures;
+  }
+}
+
+CompiledExpr compile(CalcSession &Session, StringRef Source) {
+  auto Code = Session.compileJIT(Source);
+  if (!Code) {
+    errs() << "cache-test: " << Source << ": " << toString(Code.takeError()) << "\n";
+    std::exit(1);
+  }
+  return std::move(*Code);
+}
+
+int32_t eval(const CompiledExpr &Code, const int32_t *Args) {
+  return reinterpret_cast<CalcJIT::EvalFn<int32_t>>(Code.Entry)(Args);
+}
+
+void release(CalcSession &Session, CompiledExpr &Code) {
+  if (Error Err = Session.release(Code)) {
+    errs() << "cache-test: " << toString(std::move(Err)) << "\n";
+    std::exit(1);
+  }
+}
+
+} // namespace
+
+int main() {
+  CodeGenOptions Opts;
+  Opts.Eval = true;
+  auto Session = CalcSession::create(Opts, /*CacheSize=*/2);
+  if (!Session) {
+    errs() << "cache-test: " << toString(Session.takeError()) << "\n";
+    return 1;
+  }
+  CalcSession &S = **Session;
+  const int32_t Args[] = {20, 2};
+
+  // The same expression, formatted differently, hits in memory and shares
+  // the code and the variables.
+  CompiledExpr A = compile(S, "with a, b: a + b");
+  CompiledExpr A2 = compile(S, "with a,b:a+b");
+  const ExprCache &Cache = *S.getCache();
+  check(Cache.getMisses() == 1 && Cache.getMemoryHits() == 1, "memory hit");
+  check(A.JD == A2.JD && A.Entry == A2.Entry, "shared code");
+  check(A2.Vars == std::vector<std::string>({"a", "b"}), "variables of a hit");
+  check(eval(A2, Args) == 22, "value of a hit");
+
+  // Expressions in use are kept beyond the capacity.
+  CompiledExpr B = compile(S, "with a, b: a - b");
+  CompiledExpr C = compile(S, "with a, b: a * b");
+  check(Cache.getEvictions() == 0 && Cache.size() == 3, "entries in use are kept");
+  check(eval(A, Args) == 22 && eval(B, Args) == 18 && eval(C, Args) == 40,
+        "values of the entries in use");
+
+  // Releasing the last user of an entry of a cache over its capacity evicts
+  // it; the other user of A keeps it meanwhile.
+  release(S, A);
+  check(Cache.getEvictions() == 0 && eval(A2, Args) == 22, "entry with a user is kept");
+  release(S, A2);
+  check(Cache.getEvictions() == 1 && Cache.size() == 2, "released entry is evicted");
+
+  // Within the capacity, released entries stay cached until a new one needs
+  // their place; the least recently used goes first.
+  release(S, B);
+  release(S, C);
+  check(Cache.getEvictions() == 1 && Cache.size() == 2, "released entries are cached");
+  CompiledExpr B2 = compile(S, "with a, b: a - b");
+  check(Cache.getMemoryHits() == 2 && eval(B2, Args) == 18, "hit on a released entry");
+  release(S, B2);
+  CompiledExpr D = compile(S, "with a, b: a / b");
+  check(Cache.getEvictions() == 2 && Cache.size() == 2, "least recently used is evicted");
+  CompiledExpr B3 = compile(S, "with a, b: a - b");
+  check(Cache.getMemoryHits() == 3, "more recently used entry is kept");
+  CompiledExpr C2 = compile(S, "with a, b: a * b");
+  check(Cache.getMisses() == 5 && eval(C2, Args) == 40, "evicted entry is compiled again");
+  release(S, B3);
+  release(S, C2);
+  release(S, D);
+
+  return NumFailures ? 1 : 0;
+}
@@ -0,0 +1,127 @@
+// Tests of the C interface (see CalcAPI.h): compiled functions called from
+// several threads at once, compiling from several threads against one
+// session, disposing expressions and sessions, and the error path.
+#include "CalcAPI.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<unsigned> NumFailures{0};
+
+void check(bool Cond, const char *What) {
+  if (!Cond) {
+    std::fprintf(stderr, "calc-api-test: failed: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// Run Fn(I) on NumThreads threads at once.
+template <typename FnTy> void runThreads(unsigned NumThreads, FnTy Fn) {
+  std::vector<std::thread> Threads;
+  for (unsigned I = 0; I < NumThreads; ++I)
+    Threads.emplace_back(Fn, I);
+  for (std::thread &T : Threads)
+    T.join();
+}
+
+} // namespace
+
+int main() {
+  char *Error = nullptr;
+  calc_session *Session = calc_session_create(CALC_I32, 2, /*cache_size=*/0, &Error);
+  if (!Session) {
+    std::fprintf(stderr, "calc-api-test: %s\n", Error);
+    return 1;
+  }
+
+  // The slots are the 'with' variables, in their order.
+  calc_expr *Expr = calc_session_compile(Session, "with a, b: a * b + 1", &Error);
+  check(Expr && !Error, "compile");
+  if (!Expr)
+    return 1;
+  check(calc_expr_num_slots(Expr) == 2, "number of slots");
+  check(!std::strcmp(calc_expr_slot_name(Expr, 0), "a") &&
+            !std::strcmp(calc_expr_slot_name(Expr, 1), "b") &&
+            !calc_expr_slot_name(Expr, 2),
+        "slot names");
+  check(!calc_expr_i64(Expr) && !calc_expr_f32(Expr) && !calc_expr_f64(Expr),
+        "functions of other types");
+
+  // Many threads call the same function at once, each with its own slots.
+  calc_eval_i32_fn Eval = calc_expr_i32(Expr);
+  runThreads(8, [&](unsigned T) {
+    for (int32_t I = 0; I < 100000; ++I) {
+      int32_t Slots[] = {I, int32_t(T)};
+      if (Eval(Slots) != I * int32_t(T) + 1) {
+        check(false, "concurrent calls");
+        return;
+      }
+    }
+  });
+
+  // Two threads compile against the session at once; the session serializes
+  // them, and each gets its own expression.
+  calc_expr *Compiled[2] = {};
+  runThreads(2, [&](unsigned T) {
+    std::string Source = "with x: x * " + std::to_string(T + 2);
+    Compiled[T] = calc_session_compile(Session, Source.c_str(), nullptr);
+  });
+  check(Compiled[0] && Compiled[1], "concurrent compilation");
+  if (Compiled[0] && Compiled[1]) {
+    int32_t Slots[] = {21};
+    check(calc_expr_i32(Compiled[0])(Slots) == 42 &&
+              calc_expr_i32(Compiled[1])(Slots) == 63,
+          "values of the concurrently compiled expressions");
+  }
+
+  // Disposing an expression leaves the others callable.
+  calc_expr_dispose(Compiled[0]);
+  calc_expr_dispose(nullptr);
+  int32_t Slots[] = {6, 7};
+  check(Eval(Slots) == 43, "call after disposing another expression");
+
+  // Errors return NULL and a message, which is optional.
+  Error = nullptr;
+  check(!calc_session_compile(Session, "with a: a +", &Error) && Error,
+        "syntax error");
+  calc_error_dispose(Error);
+  Error = nullptr;
+  check(!calc_session_compile(Session, "with a: b", &Error) && Error, "semantic error");
+  calc_error_dispose(Error);
+  check(!calc_session_compile(Session, "with a: a +", nullptr), "error without message");
+  Error = nullptr;
+  check(!calc_session_create(static_cast<calc_value_type>(7), 2, 0, &Error) && Error,
+        "invalid value type");
+  calc_error_dispose(Error);
+  Error = nullptr;
+  check(!calc_session_create(CALC_I64, 4, 0, &Error) && Error, "invalid level");
+  calc_error_dispose(Error);
+
+  // The session compiles on after the errors, and disposing it frees the
+  // expressions that were not disposed.
+  calc_expr *After = calc_session_compile(Session, "with a: a - 1", nullptr);
+  check(After && calc_expr_i32(After)(Slots) == 5, "compile after errors");
+  calc_session_dispose(Session);
+  calc_session_dispose(nullptr);
+
+  // A cached session returns the code of an expression compiled again until
+  // it is disposed by all its users.
+  calc_session *Cached = calc_session_create(CALC_F64, 0, 4, nullptr);
+  check(Cached != nullptr, "cached session");
+  if (Cached) {
+    calc_expr *A = calc_session_compile(Cached, "with x: x / 2", nullptr);
+    calc_expr *B = calc_session_compile(Cached, "with x:x/2", nullptr);
+    check(A && B && calc_expr_f64(A) == calc_expr_f64(B), "cached code is shared");
+    calc_expr_dispose(A);
+    double X[] = {3};
+    check(B && calc_expr_f64(B)(X) == 1.5, "cached code outlives one user");
+    calc_session_dispose(Cached);
+  }
+
+  return NumFailures ? 1 : 0;
+}
@@ -0,0 +1,27 @@
+# Runs 'calc -jit -batch -checked ARGS EXPR' on the rows ROWS and checks its
+# output against EXPECTED, one result per row, and that it reports OVERFLOWS
+# overflowing rows. Rows and results are separated by '|'.
+string(REPLACE "|" "\n" Input "${ROWS}\n")
+string(REPLACE "|" "\n" Expected "${EXPECTED}\n")
+string(MAKE_C_IDENTIFIER "${ARGS}-${EXPR}" Name)
+set(InputFile "${CMAKE_CURRENT_BINARY_DIR}/${Name}.csv")
+file(WRITE "${InputFile}" "${Input}")
+
+execute_process(
+  COMMAND "${CALC}" -jit -batch -checked ${ARGS} "${EXPR}"
+  INPUT_FILE "${InputFile}"
+  OUTPUT_VARIABLE Output
+  ERROR_VARIABLE Errors
+  RESULT_VARIABLE Result)
+
+if(NOT Output STREQUAL Expected)
+  message(FATAL_ERROR "'${EXPR}' ${ARGS}: expected\n${Expected}got\n${Output}${Errors}")
+endif()
+if(OVERFLOWS EQUAL 0)
+  if(NOT Result EQUAL 0 OR NOT Errors STREQUAL "")
+    message(FATAL_ERROR "'${EXPR}' ${ARGS}: exit code ${Result}\n${Errors}")
+  endif()
+elseif(NOT Result EQUAL 1 OR NOT Errors MATCHES "calc: ${OVERFLOWS} rows overflowed")
+  message(FATAL_ERROR "'${EXPR}' ${ARGS}: expected ${OVERFLOWS} overflowing rows and exit code 1, "
+                      "got exit code ${Result}\n${Errors}")
+endif()
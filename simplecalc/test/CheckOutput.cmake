@@ -0,0 +1,41 @@
+# Runs 'CALC ARGS' with the rows INPUT on stdin and checks what it prints.
+# ARGS, INPUT and EXPECTED separate their elements by '|'. The rows are
+# repeated REPEAT times (default 1), followed by the row LAST if it is given,
+# and the results EXPECTED are repeated alike; without EXPECTED the output is
+# not checked. The run must succeed with nothing on stderr, unless ERROR is
+# given: then it must fail with stderr matching the regular expression ERROR.
+string(REPLACE "|" ";" Args "${ARGS}")
+if(NOT DEFINED REPEAT)
+  set(REPEAT 1)
+endif()
+string(REPLACE "|" "\n" Row "${INPUT}\n")
+string(REPEAT "${Row}" ${REPEAT} Input)
+if(DEFINED LAST)
+  string(APPEND Input "${LAST}\n")
+endif()
+string(MAKE_C_IDENTIFIER "${ARGS}" Name)
+set(InputFile "${CMAKE_CURRENT_BINARY_DIR}/${Name}.in")
+file(WRITE "${InputFile}" "${Input}")
+
+execute_process(
+  COMMAND "${CALC}" ${Args}
+  INPUT_FILE "${InputFile}"
+  OUTPUT_VARIABLE Output
+  ERROR_VARIABLE Errors
+  RESULT_VARIABLE Result)
+
+if(DEFINED EXPECTED)
+  string(REPLACE "|" "\n" Result1 "${EXPECTED}\n")
+  string(REPEAT "${Result1}" ${REPEAT} Expected)
+  if(NOT Output STREQUAL Expected)
+    message(FATAL_ERROR "${ARGS}: expected\n${Expected}got\n${Output}${Errors}")
+  endif()
+endif()
+if(DEFINED ERROR)
+  if(Result EQUAL 0 OR NOT Errors MATCHES "${ERROR}")
+    message(FATAL_ERROR "${ARGS}: expected a failure with '${ERROR}', "
+                        "got exit code ${Result}\n${Errors}")
+  endif()
+elseif(NOT Result EQUAL 0 OR NOT Errors STREQUAL "")
+  message(FATAL_ERROR "${ARGS}: exit code ${Result}\n${Errors}")
+endif()